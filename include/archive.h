@@ -0,0 +1,26 @@
+#ifndef A8C52F71_E3D9_4B06_9A4E_61F7B2D0C893
+#define A8C52F71_E3D9_4B06_9A4E_61F7B2D0C893
+
+#include "common.h"
+
+// Options of the archive subcommand. Bound to flags in main.
+// Batch size and pacing come from the --gentle options in load_options.
+typedef struct {
+    char *invoices_older_than; // Interval: invoices purchased before now minus this move.
+    char *expired_for;         // Interval: items expired longer than this move.
+    char *output;   // Directory to write the archived rows to. NULL keeps archive tables.
+    char *compress; // Compression of the files written to output.
+} ArchiveOptions;
+
+extern ArchiveOptions archive_options;
+
+// Subcommand moving old invoices (with their lines) and long expired inventory items
+// (with their prices and the invoice lines referencing them) into <table>_archive
+// tables. Rows move in key order, one short transaction per
+// batch, paced like a --gentle load. Each batch deletes and archives in a single
+// statement, so an interrupted run loses nothing and a rerun picks up where it
+// stopped. With output, the archive tables are then written to compressed files
+// and emptied.
+void archive_rows(Subcommand *cmd);
+
+#endif /* A8C52F71_E3D9_4B06_9A4E_61F7B2D0C893 */
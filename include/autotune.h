@@ -0,0 +1,21 @@
+#ifndef F41C8A27_5E93_4B06_A2D8_6C17E0B9D345
+#define F41C8A27_5E93_4B06_A2D8_6C17E0B9D345
+
+#include "loader.h"
+
+// Strategy and window size chosen while loading, for --strategy auto.
+//
+// The first rows of a plan are sent in equal trial windows with pipeline, batch and
+// copy in turn, and the fastest in rows per second loads the rest. Row by row is left
+// out: pipeline sends the same statements without waiting for each. Pipeline is left
+// out too if the connection cannot pipeline, and inputs too small for trials go as
+// one batch statement per window.
+//
+// The window of the chosen strategy (rows per pipeline sync, batch statement or COPY
+// and merge) starts where the measured round trip is a twentieth of a window and is
+// tuned with AIMD: it grows by a fixed step while windows finish within --target-ms
+// and keep their rate, and halves when one does not. Trial rows are part of the load.
+LoadCounts autotune_execute(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                            LoadStrategy strategy);
+
+#endif /* F41C8A27_5E93_4B06_A2D8_6C17E0B9D345 */
@@ -0,0 +1,16 @@
+#ifndef E7C3A19F_5D02_4B6E_9F81_2A4D7E0B6C35
+#define E7C3A19F_5D02_4B6E_9F81_2A4D7E0B6C35
+
+#include "loader.h"
+
+// Bulk-load mode for maintenance windows. Everything happens inside the load
+// transaction so that a failed load rolls settings and dropped indexes back.
+
+// Tune the session and, with --drop-indexes, drop the non-unique secondary indexes
+// of the target tables after saving their definitions. Call right after BEGIN.
+void bulk_begin(const LoadSpec *const *specs, size_t num_specs);
+
+// Rebuild the dropped indexes and ANALYZE every target table. Call before COMMIT.
+void bulk_finish(void);
+
+#endif /* E7C3A19F_5D02_4B6E_9F81_2A4D7E0B6C35 */
@@ -0,0 +1,46 @@
+#ifndef B7E2D9C4_16A8_4F3B_9C05_E48A1F6D2B70
+#define B7E2D9C4_16A8_4F3B_9C05_E48A1F6D2B70
+
+#include "loader.h"
+
+// Rows per load workload of the probe subcommand. Bound to a flag.
+extern int probe_rows;
+
+// Round trips and commits timed by the probe subcommand. Bound to a flag.
+extern int probe_samples;
+
+// What a target server costs per round trip, commit and row, measured on temp tables.
+typedef struct {
+    double rtt_ms;         // Median round trip of SELECT 1.
+    double rtt_p90_ms;     // 90th percentile round trip.
+    double commit_ms;      // Median COMMIT of a transaction that wrote WAL.
+    double commit_p90_ms;  // 90th percentile COMMIT.
+    double copy_rows_s;    // Raw COPY FROM STDIN into an unindexed temp table.
+    double copy_mb_s;      // Same, in megabytes per second.
+    bool pipeline;         // Pipeline mode works end to end, proxies included.
+    double rows_s[4];      // Upsert rows per second per LoadStrategy. 0 if not run.
+    LoadStrategy strategy; // Fastest strategy.
+    size_t batch_size;     // Rows per batch that hide the round trip within the batch budget.
+} Capability;
+
+// Measure the server on conn with rows per load workload and samples round trips
+// and commits. Nothing outside the session's temp tables is written.
+Capability capability_measure(size_t rows, int samples);
+
+// Median round trip of SELECT 1 over samples queries, and the 90th percentile if p90
+// is not NULL.
+double capability_round_trip(int samples, double *p90);
+
+// Whether two queries and a sync in pipeline mode are both answered. libpq always
+// enters pipeline mode; what fails is a proxy or server in between that mishandles it.
+bool capability_pipeline(void);
+
+// Rows per batch that keep the round trip within a twentieth of a batch and a batch
+// within 250 ms, from a rate measured with batches of measured_batch rows. The row
+// cost is the measured one less the round trips of those batches.
+size_t capability_batch_size(double rtt_ms, double rows_s, size_t measured_batch);
+
+// Subcommand printing the capability of the database and the load options it suggests.
+void probe_target(Subcommand *cmd);
+
+#endif /* B7E2D9C4_16A8_4F3B_9C05_E48A1F6D2B70 */
@@ -18,9 +18,14 @@ extern char *filename;
 extern Arena *arena;
 extern void runpsql_script(const char *filename);
 
+// Open another connection with the PG* environment variables. Aborts on failure.
+extern PGconn *open_connection(void);
+
 // ================= Exported subcommands ===================
 void upload_invoices_csv(Subcommand *cmd);
+void upload_invoice_items_csv(Subcommand *cmd);
 void upload_pricelist_csv(Subcommand *cmd);
+void upload_prices_csv(Subcommand *cmd);
 void upload_user_accounts_csv(Subcommand *cmd);
 void upload_diagnosis_categories(Subcommand *cmd);
 void initialize_enums(Subcommand *cmd);
@@ -0,0 +1,24 @@
+#ifndef B84E6F20_1C3A_4D97_A6E2_0F59C8D31B7A
+#define B84E6F20_1C3A_4D97_A6E2_0F59C8D31B7A
+
+#include "loader.h"
+
+// Which row survives when a file repeats a key.
+typedef enum {
+    DEDUP_OFF,   // Send every row.
+    DEDUP_FIRST, // Keep the first occurrence.
+    DEDUP_LAST,  // Keep the last occurrence.
+    DEDUP_AUTO,  // Last for DO UPDATE, first for DO NOTHING: what per-row upserts would store.
+} DedupMode;
+
+// Parse a dedup mode name. Aborts on unknown names.
+DedupMode dedup_mode_parse(const char *name);
+
+// Drop rows whose client key repeats, keeping survivors in file order.
+// Keys are held in an in-memory hash table; when it would exceed memory_budget bytes
+// the (row, hash) pairs are partitioned by hash into temp files and each partition is
+// deduplicated on its own. Returns the number of rows left in rows.
+size_t dedup_rows(const LoadPlan *plan, CsvRow **rows, size_t num_rows, DedupMode mode,
+                  size_t memory_budget);
+
+#endif /* B84E6F20_1C3A_4D97_A6E2_0F59C8D31B7A */
@@ -0,0 +1,65 @@
+#ifndef C9A46E1B_8F25_4D73_B0E9_27D5A3C18F64
+#define C9A46E1B_8F25_4D73_B0E9_27D5A3C18F64
+
+#include "loader.h"
+
+// Plans of slow load statements, for --explain-slow.
+//
+// Each batch and COPY merge runs in a savepoint. One slower than
+// load_options.explain_slow milliseconds is rolled back, run under EXPLAIN (ANALYZE,
+// BUFFERS, WAL) in a savepoint of its own that is rolled back too, and then run for real
+// again, so the plan sees the table as the statement did. Row statements, alone or
+// pipelined, are not undone, since a savepoint each would cost two round trips and a
+// subtransaction per row: a slow one is explained after it ran, so an upsert shows its
+// conflict path. Of a pipeline window only the statement whose result took longest is
+// explained. The plan is appended to load_options.explain_file with the CSV lines of
+// the rows the statement sent.
+//
+// After a capture the next one waits ten times as long as it took, re-runs included,
+// and at least a second, so that captures cost the load no more than about a tenth of
+// its time.
+
+// CSV line of each parsed row, taken before rows are filtered, deduplicated or
+// reordered. Sorted by row address.
+typedef struct {
+    CsvRow *row;
+    size_t line;
+} ExplainLine;
+
+typedef struct {
+    const char *path;
+    ExplainLine *lines;
+    size_t num_lines;
+} ExplainSource;
+
+// Index the lines of a freshly parsed file. Does nothing unless --explain-slow is set.
+void explain_source_init(ExplainSource *source, const char *path, CsvRow **rows,
+                         size_t num_rows);
+
+void explain_source_free(ExplainSource *source);
+
+// File whose rows the following captures report lines of. NULL for none.
+void explain_use_source(const ExplainSource *source);
+
+// Take the savepoint a slow batch or COPY merge is rolled back to. Does nothing unless
+// --explain-slow is set. Must be called in a transaction, outside pipeline mode.
+void explain_savepoint(void);
+
+// Whether a statement that took elapsed_ms is to be captured now. If so, and
+// explain_savepoint was called, everything since is rolled back and the caller
+// discards its results, calls explain_capture and runs the statement again. Otherwise
+// the caller calls explain_capture on the statement it already ran.
+bool explain_due(double elapsed_ms);
+
+// Run sql with its parameters under EXPLAIN and save the plan. rows are the rows it
+// sent and what says how the statement relates to them e.g "batch". Must be called
+// outside pipeline mode.
+void explain_capture(const LoadPlan *plan, const char *what, const char *sql, int nparams,
+                     const char *const *params, CsvRow **rows, size_t num_rows,
+                     double elapsed_ms);
+
+// Release the savepoint, if any, once the statement or its re-run succeeded, and end
+// the capture if one was due.
+void explain_release(void);
+
+#endif /* C9A46E1B_8F25_4D73_B0E9_27D5A3C18F64 */
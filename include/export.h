@@ -0,0 +1,28 @@
+#ifndef C4E81A6F_5D27_4B93_8F0E_A29B3D71C586
+#define C4E81A6F_5D27_4B93_8F0E_A29B3D71C586
+
+#include "loader.h"
+#include "sink.h"
+
+// Options of the export subcommand. Bound to flags in main.
+typedef struct {
+    char *tables;   // Comma separated loader names (pricelist, invoices) or table names.
+    char *output;   // Directory the files are written to.
+    char *compress; // none, gzip or zstd.
+    int jobs;       // Connections exporting concurrently from one snapshot.
+} ExportOptions;
+
+extern ExportOptions export_options;
+
+// Stream the result of query on pg through COPY TO STDOUT (CSV with a header) into path.
+// Returns the number of rows written; aborts on failure. Memory use does not depend on
+// the row count.
+size_t export_query(PGconn *pg, const char *query, const char *path, Compression compression);
+
+// Subcommand writing each table to <output>/<table>.csv[.gz|.zst] from one snapshot.
+// Loader names produce files in the loader's CSV layout that load back unchanged.
+// With jobs > 1 the snapshot is exported to worker connections and tables large
+// enough are split by integer primary key ranges into <table>.NNN.csv slices.
+void export_tables(Subcommand *cmd);
+
+#endif /* C4E81A6F_5D27_4B93_8F0E_A29B3D71C586 */
@@ -0,0 +1,21 @@
+#ifndef D05E8B3A_71C4_4F29_B6D8_2A9E4C17F053
+#define D05E8B3A_71C4_4F29_B6D8_2A9E4C17F053
+
+#include "common.h"
+
+// TCP port the fake server listens on, on the loopback interface. Bound to a flag.
+extern int fakepg_port;
+
+// Subcommand running a stand-in PostgreSQL server that answers instantly, to measure
+// what eclinic itself can push: CSV parsing, parameter building, hashing and protocol
+// framing, without any database cost.
+//
+// It speaks enough of protocol v3 for the loaders: startup without authentication,
+// simple queries, Parse/Bind/Describe/Execute/Sync with pipelining, and COPY FROM
+// STDIN. Nothing is stored. Load upserts report every row as inserted, column type
+// lookups answer text, other queries return no rows and commands succeed, so the
+// plain load paths work while --gentle, --stats and --bulk, which read server
+// statistics, do not. Each connection logs its rows, statements and bytes on close.
+void fakepg_serve(Subcommand *cmd);
+
+#endif /* D05E8B3A_71C4_4F29_B6D8_2A9E4C17F053 */
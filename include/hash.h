@@ -0,0 +1,11 @@
+#ifndef F2B7D3E1_94C6_4A0F_8D25_6C1E9A4B73D8
+#define F2B7D3E1_94C6_4A0F_8D25_6C1E9A4B73D8
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fast non-cryptographic 64-bit hash (wyhash construction).
+// Used for dedup keys, ledger fingerprints and row digests. Not for passwords.
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
+#endif /* F2B7D3E1_94C6_4A0F_8D25_6C1E9A4B73D8 */
@@ -0,0 +1,40 @@
+#ifndef F6A1B9C4_2E8D_4073_9C5B_E43D0A7F1628
+#define F6A1B9C4_2E8D_4073_9C5B_E43D0A7F1628
+
+#include "loader.h"
+
+// Content-defined chunk of an input file, cut at a CSV record boundary.
+typedef struct {
+    uint64_t hash;
+    size_t offset;
+    size_t length;
+    size_t first_row; // Index of the chunk's first data row (the header is not a data row).
+    size_t num_rows;
+    bool loaded;      // Recorded in the ledger by an earlier load.
+} LedgerChunk;
+
+// Load ledger of one input file: its fingerprint and chunk fingerprints, recorded in
+// eclinic_load_ledger per subcommand and target tables so re-sent data can be skipped.
+typedef struct {
+    const char *subcommand;
+    char *tables; // Comma separated target tables.
+    uint64_t file_hash;
+    LedgerChunk *chunks;
+    size_t num_chunks;
+    size_t num_rows; // Data rows counted while chunking.
+} Ledger;
+
+// Fingerprint path and look it up. Returns false if the same file was loaded before
+// for this subcommand and tables, in which case there is nothing to do.
+bool ledger_open(Ledger *ledger, const char *subcommand, const char *path,
+                 const LoadSpec *const *specs, size_t num_specs);
+
+// Keep only the rows of chunks that are not in the ledger. Returns the new row count.
+size_t ledger_filter_rows(const Ledger *ledger, CsvRow **rows, size_t num_rows);
+
+// Record the file and its chunks as loaded. Runs in the caller's transaction.
+void ledger_record(const Ledger *ledger);
+
+void ledger_close(Ledger *ledger);
+
+#endif /* F6A1B9C4_2E8D_4073_9C5B_E43D0A7F1628 */
@@ -0,0 +1,236 @@
+#ifndef A3F1C2D4_7B8E_4C59_9E0A_51D6B2F8C713
+#define A3F1C2D4_7B8E_4C59_9E0A_51D6B2F8C713
+
+#include "common.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Maps one CSV column to one table column.
+// The source is resolved in this order: expr, compute, header, index.
+// Inputs are cast to the target column type read from the catalog unless type is set.
+typedef struct {
+    const char *column; // Target table column.
+    const char *type;   // SQL type override. "table.column%TYPE" copies another column's type.
+    const char *header; // CSV header name (case-insensitive). NULL to map by index.
+    size_t index;       // Zero-based CSV field index, used when header is NULL.
+
+    // SQL expression computed on the server in terms of the typed s.<column> inputs
+    // of the other columns e.g "s.invoice_total - s.amount_paid".
+    const char *expr;
+
+    // Value computed on the client from the CSV fields e.g a password hash.
+    // The returned string only needs to stay valid until the next call.
+    const char *(*compute)(char **fields, size_t numfields);
+
+    // Input visible to expressions and filters as s.<column> but not inserted.
+    bool input_only;
+
+    // Makes a header column optional: SQL expression inserted when the CSV has no such
+    // column, e.g "0". A missing column is left alone on conflict.
+    const char *if_missing;
+} ColumnMap;
+
+// Declarative description of how a CSV file is loaded into a table.
+typedef struct {
+    const char *name;  // Short identifier used for statement and staging table names.
+    const char *table; // Target table.
+    const ColumnMap *columns;
+    size_t num_columns;
+    size_t expected_fields; // Required number of CSV fields per row. 0 to skip the check.
+
+    // NULL-terminated list of target columns forming the ON CONFLICT key.
+    // NULL for plain inserts.
+    const char *const *conflict_key;
+
+    // NULL-terminated list of columns set from EXCLUDED on conflict.
+    // NULL with a conflict key means ON CONFLICT DO NOTHING.
+    const char *const *update_columns;
+
+    // Optional joins after the inputs s, e.g. to map natural keys to ids in one pass.
+    // Expressions and the filter can use the joined tables.
+    const char *joins;
+
+    // Optional row filter over the typed s.<column> inputs.
+    const char *where;
+
+    // NULL-terminated input columns that identify a conflict on the client when the
+    // conflict key is computed on the server. Defaults to conflict_key.
+    const char *const *client_key;
+
+    // For a client_key spec, FROM items reading the table back as t with its client key
+    // columns as k.<column>, e.g. a join mapping ids back to natural keys. Lets verify
+    // look stored rows up by file values.
+    const char *client_key_from;
+
+    // Date column the table is range partitioned on by month, if it is partitioned.
+    // See partition.h.
+    const char *partition_column;
+
+    // Data-modifying SQL run in the same statement as each upsert, e.g. to keep totals
+    // in another table in step. It reads the rows the upsert wrote from w, which has
+    // the boolean inserted and the target columns listed in returning (NULL-terminated).
+    const char *const *returning;
+    const char *after;
+} LoadSpec;
+
+// How rows are shipped to the server.
+typedef enum {
+    LOAD_ROW,      // One prepared statement round trip per row.
+    LOAD_PIPELINE, // Prepared statements sent in pipeline mode, one sync per batch.
+    LOAD_BATCH,    // One statement per batch with every column passed as a text[].
+    LOAD_COPY,     // COPY into a temp staging table then one set-based upsert.
+    LOAD_AUTO,     // One of the above chosen and tuned while loading, see autotune.h.
+} LoadStrategy;
+
+// Load plan compiled from a LoadSpec against a concrete CSV header.
+typedef struct {
+    const LoadSpec *spec;
+    size_t num_inputs;        // Text values sent per row.
+    const ColumnMap **inputs; // Column for each input.
+    size_t *input_fields;     // CSV field index for each input (unused for computed inputs).
+    size_t min_fields;        // Smallest field count a row needs to supply every input.
+    size_t num_keys;          // Number of client key inputs. 0 if rows cannot be keyed.
+    size_t *key_inputs;       // Input positions of the client key columns.
+    bool *key_numeric;        // Whether each client key column compares as a number.
+    char **input_types;       // SQL type each input is cast to.
+    char stmt_name[64];       // Prepared statement name of row_sql.
+    char batch_stmt_name[64]; // Prepared statement name of batch_sql.
+    bool row_prepared;        // row_sql is prepared on the connection.
+    bool batch_prepared;      // batch_sql is prepared on the connection.
+    char stage_table[64];     // Temp table used by LOAD_COPY.
+    char *row_sql;            // Upsert of a single row from $1..$n.
+    char *batch_sql;          // Upsert of a batch from unnest($1::text[]...).
+    char *stage_sql;          // CREATE TEMP TABLE for LOAD_COPY.
+    char *copy_sql;           // COPY into the staging table.
+    char *merge_sql;          // Upsert from the staging table.
+} LoadPlan;
+
+// Options shared by all CSV loaders. Bound to subcommand flags in main.
+typedef struct {
+    char *strategy; // row, pipeline, batch or copy.
+    int batch_size; // Rows per batch, pipeline sync or COPY flush.
+    char *dedup;    // Duplicate key resolution: auto, first, last or off.
+    int memory_mb;  // Memory budget for client-side key processing before spilling to disk.
+    char *order;    // Send rows in client key order: none, batch or file.
+    bool stats;     // Report throughput and buffer hits per table.
+
+    bool bulk;          // Maintenance window load, see bulk.h.
+    bool drop_indexes;  // With bulk, drop and rebuild non-unique secondary indexes.
+    int maintenance_mb; // With bulk, maintenance_work_mem for index rebuilds.
+    int index_workers;  // With bulk, parallel workers per index rebuild.
+
+    bool gentle;    // Online load with short transactions and adaptive pacing, see throttle.h.
+    int max_rate;   // With gentle, rows per second cap.
+    int target_ms;  // With gentle, statement latency above which the load backs off.
+    int max_lag_ms; // With gentle, replica replay lag above which the load backs off.
+
+    bool ledger; // Skip files and chunks already loaded, see ledger.h.
+    char *trace;  // Chrome trace file written at exit, see trace.h.
+    char *record; // File recording every libpq call of the load, see record.h.
+
+    int explain_slow;   // Statement latency above which its plan is captured. 0 for never.
+    char *explain_file; // File the captured plans are appended to, see explain.h.
+} LoadOptions;
+
+extern LoadOptions load_options;
+
+// Text value of an input for a row.
+static inline const char *load_input_value(const LoadPlan *plan, CsvRow *row, size_t input) {
+    const ColumnMap *col = plan->inputs[input];
+    if (col->compute) {
+        return col->compute(row->fields, row->numFields);
+    }
+    return row->fields[plan->input_fields[input]];
+}
+
+// SQL type of table.column read from the catalog. Returns a malloc'd string or NULL.
+char *load_column_type(const char *table, const char *column);
+
+// Whether a SQL type name is a text type. Text inputs are passed through uncast.
+bool load_type_is_text(const char *type);
+
+// Whether a SQL type name is a number type. Client keys of number types compare by value.
+bool load_type_is_numeric(const char *type);
+
+// Hash of a row's client key. Number keys that compare equal hash equal.
+uint64_t load_key_hash(const LoadPlan *plan, CsvRow *row);
+
+// Compare the client keys of two rows field by field, in the order of their index: number
+// keys by value, the others bytewise. Returns <0, 0 or >0.
+int load_key_compare(const LoadPlan *plan, CsvRow *a, CsvRow *b);
+
+// Compile a spec into a load plan. header may be NULL if no column maps by header name.
+// Aborts with a fatal error if the spec does not match the header.
+LoadPlan *load_plan_compile(const LoadSpec *spec, CsvRow *header);
+
+// Free a plan returned by load_plan_compile.
+void load_plan_free(LoadPlan *plan);
+
+// Per-row outcome of a load.
+typedef struct {
+    size_t inserted;  // New rows.
+    size_t updated;   // Existing rows whose values changed.
+    size_t unchanged; // Identical rows and DO NOTHING conflicts.
+    size_t filtered;  // Rows dropped by the spec's joins or filter.
+} LoadCounts;
+
+// Run a compiled plan over rows using the given strategy.
+// Must be called inside a transaction.
+LoadCounts load_plan_execute(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                             LoadStrategy strategy);
+
+// load_plan_execute with batch_size rows per pipeline sync, batch statement or COPY
+// flush instead of --batch-size.
+LoadCounts load_plan_execute_sized(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                                   LoadStrategy strategy, size_t batch_size);
+
+void load_counts_add(LoadCounts *total, LoadCounts counts);
+
+// Execute a command that returns no rows. Aborts on failure.
+void load_exec(const char *sql);
+
+// Parse a strategy name. Aborts on unknown names.
+LoadStrategy load_strategy_parse(const char *name);
+
+// Name of a strategy as parsed by load_strategy_parse.
+const char *load_strategy_name(LoadStrategy strategy);
+
+// Parse a CSV file with a header row. The returned parser owns the rows.
+// header is NULL and num_rows 0 for an empty file.
+CsvParser *load_csv_parse(const char *path, CsvRow **header, CsvRow ***rows, size_t *num_rows);
+
+// Abort unless every row has the fields the plan reads.
+void load_validate_rows(const LoadPlan *plan, CsvRow **rows, size_t num_rows);
+
+// Load a CSV file with a header row through one or more specs, in order,
+// in a single transaction using the strategy in load_options.
+// subcommand identifies the load in the ledger.
+void load_csv(const char *subcommand, const char *path, const LoadSpec *const *specs,
+              size_t num_specs);
+
+// A CSV file and the specs it is loaded through.
+typedef struct {
+    const char *path;
+    const LoadSpec *const *specs;
+    size_t num_specs;
+} LoadSource;
+
+// Load several files like load_csv, in order, in a single transaction.
+void load_sources(const char *subcommand, const LoadSource *sources, size_t num_sources);
+
+// Specs of the CSV loader subcommands, in load order. NULL-terminated.
+extern const LoadSpec *const invoices_specs[];
+extern const LoadSpec *const pricelist_specs[];
+extern const LoadSpec *const users_specs[];
+extern const LoadSpec *const tariffs_specs[];
+
+// Line items file of the invoice-items subcommand. NULL when each line repeats its
+// invoice in the invoices file.
+extern char *invoice_lines_file;
+
+// Queries returning a loader's rows in its CSV layout, so that exports load back.
+extern const char *const pricelist_export_query;
+extern const char *const invoices_export_query;
+
+#endif /* A3F1C2D4_7B8E_4C59_9E0A_51D6B2F8C713 */
@@ -0,0 +1,11 @@
+#ifndef B1E5C8A2_7D3F_4096_8E14_3A6F9C0D2B57
+#define B1E5C8A2_7D3F_4096_8E14_3A6F9C0D2B57
+
+#include <stddef.h>
+#include <stdint.h>
+
+// MD5 (RFC 1321). Only used where a digest must match PostgreSQL's md5(),
+// never for security.
+void md5(const void *data, size_t len, uint8_t digest[16]);
+
+#endif /* B1E5C8A2_7D3F_4096_8E14_3A6F9C0D2B57 */
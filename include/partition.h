@@ -0,0 +1,32 @@
+#ifndef F1B86D2E_4C79_4A30_8D5F_0E92C7A3B418
+#define F1B86D2E_4C79_4A30_8D5F_0E92C7A3B418
+
+#include "loader.h"
+
+// Monthly range partitioning of a load target by spec->partition_column.
+//
+// A partitioned table cannot have a unique index on the conflict key alone, so
+// uniqueness is kept in two places: every partition has a local unique index on the
+// conflict key, and <table>_keys (key PRIMARY KEY, partition column) is maintained by
+// a trigger so that a key cannot appear in two partitions. Partitions are named
+// <table>_yYYYYmMM.
+
+// Runs one strategy over rows; load_plan_execute or throttle_execute.
+typedef LoadCounts (*LoadExecutor)(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                                   LoadStrategy strategy);
+
+// Whether the target of spec is a partitioned table.
+bool partition_enabled(const LoadSpec *spec);
+
+// Load rows of a partitioned target. The partitions the rows fall in are created if
+// missing, rows whose key already lives in another partition are moved to the new one
+// by updating their partition column, and each partition is upserted directly with a
+// plan compiled for it. Moved rows keep their other columns and count as updated.
+// Must run in the load transaction, so --gentle loads cannot target partitioned tables.
+LoadCounts partition_execute(const LoadPlan *plan, CsvRow *header, CsvRow **rows,
+                             size_t num_rows, LoadStrategy strategy, LoadExecutor execute);
+
+// Subcommand converting invoices into a partitioned table in one transaction.
+void partition_invoices(Subcommand *cmd);
+
+#endif /* F1B86D2E_4C79_4A30_8D5F_0E92C7A3B418 */
@@ -0,0 +1,24 @@
+#ifndef B4E81C2D_6A93_4F07_9D5E_37C0A2F8B615
+#define B4E81C2D_6A93_4F07_9D5E_37C0A2F8B615
+
+// Static tracepoints (USDT) under the eclinic provider. Each one is a single nop until a
+// tracer attaches, e.g:
+//   bpftrace -e 'usdt:./bin/eclinic:eclinic:batch_sent { @t[tid] = nsecs; }
+//                usdt:./bin/eclinic:eclinic:statement_complete /@t[tid]/
+//                { @us = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]); }'
+// Without <sys/sdt.h> (systemtap-sdt-dev, systemtap-sdt-devel) or with
+// -DECLINIC_NO_PROBES they compile to nothing, so arguments must not have side effects.
+#if defined(__has_include) && !defined(ECLINIC_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ECLINIC_PROBES 1
+#endif
+#endif
+
+#ifdef ECLINIC_PROBES
+#define PROBE(name, ...) STAP_PROBEV(eclinic, name, __VA_ARGS__)
+#else
+#define PROBE(name, ...) ((void)0)
+#endif
+
+#endif /* B4E81C2D_6A93_4F07_9D5E_37C0A2F8B615 */
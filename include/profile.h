@@ -0,0 +1,16 @@
+#ifndef E29B6F41_7D3C_4A58_B0E6_1C84D5F7A3B2
+#define E29B6F41_7D3C_4A58_B0E6_1C84D5F7A3B2
+
+#include "common.h"
+
+// Most frequent values listed per column by the profile subcommand. Bound to a flag.
+extern int profile_top;
+
+// Subcommand describing a CSV file in one streaming pass, without loading it:
+// per column the null and empty counts, the narrowest type every value parses as,
+// min and max, an approximate distinct count (HyperLogLog) and the most frequent
+// values (space-saving), plus the rows each loader would reject for their field
+// count. Memory does not grow with the file.
+void profile_csv(Subcommand *cmd);
+
+#endif /* E29B6F41_7D3C_4A58_B0E6_1C84D5F7A3B2 */
@@ -0,0 +1,42 @@
+#ifndef A8C3E5F1_4B27_4D96_8E0A_71D2F9B6C354
+#define A8C3E5F1_4B27_4D96_8E0A_71D2F9B6C354
+
+#include "common.h"
+#include <stdbool.h>
+
+// Recording of the libpq calls of a load, replayed later against another server.
+//
+// The record_* functions below stand in for the libpq calls of the same name on the
+// upload path. Until record_open is called they only forward to libpq. After it,
+// every call is appended to the recording with its arguments and the time since
+// record_open, and every result with its status, row counts, first row and how long
+// the client waited for it. The file is flushed when the process exits.
+//
+// Recordings hold the loaded data and are read back on the same architecture.
+
+// Start recording to path. Later calls are ignored.
+void record_open(const char *path);
+
+PGresult *record_exec(PGconn *c, const char *sql);
+PGresult *record_exec_params(PGconn *c, const char *sql, int nparams,
+                             const char *const *values);
+PGresult *record_prepare(PGconn *c, const char *name, const char *sql, int nparams);
+PGresult *record_exec_prepared(PGconn *c, const char *name, int nparams,
+                               const char *const *values);
+int record_send_prepared(PGconn *c, const char *name, int nparams, const char *const *values);
+int record_send_params(PGconn *c, const char *sql, int nparams, const char *const *values);
+int record_enter_pipeline(PGconn *c);
+int record_exit_pipeline(PGconn *c);
+int record_pipeline_sync(PGconn *c);
+PGresult *record_get_result(PGconn *c);
+int record_put_copy_data(PGconn *c, const char *data, int len);
+int record_put_copy_end(PGconn *c);
+
+// Replay as fast as the server answers instead of at the recorded pace. Bound to a flag.
+extern bool replay_fast;
+
+// Subcommand re-issuing a recording on the connection from the dotenv file and
+// comparing each result and wait with the recorded one.
+void replay_recording(Subcommand *cmd);
+
+#endif /* A8C3E5F1_4B27_4D96_8E0A_71D2F9B6C354 */
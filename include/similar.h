@@ -0,0 +1,19 @@
+#ifndef B4E81F27_6C3A_4D95_A0B2_7F19C5D3E846
+#define B4E81F27_6C3A_4D95_A0B2_7F19C5D3E846
+
+#include "common.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Check incoming items against inventory_items before the pricelist is loaded.
+extern bool check_similar;
+
+// Report incoming item names that are probably another spelling of an existing item
+// of the same type: equal once case, punctuation and spacing are normalized, or
+// within a few edits of it. Candidates are found through an index of the 3-grams of
+// the existing names and confirmed with a bounded bit-parallel edit distance.
+// rows are data rows; name_field and type_field are their field indexes.
+// Returns the number of rows reported.
+size_t similar_report(CsvRow **rows, size_t num_rows, size_t name_field, size_t type_field);
+
+#endif /* B4E81F27_6C3A_4D95_A0B2_7F19C5D3E846 */
@@ -0,0 +1,37 @@
+#ifndef B7D03E5A_9C21_4F68_A4B3_6E18F2C90D75
+#define B7D03E5A_9C21_4F68_A4B3_6E18F2C90D75
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Output file compression. gzip needs zlib and zstd libzstd at build time.
+typedef enum {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD,
+} Compression;
+
+// Parse none, gzip, zstd or auto. auto picks from the file extension of path
+// (.gz or .zst). Aborts on unknown names and compressors missing from the build.
+Compression compression_parse(const char *name, const char *path);
+
+// File extension of a compression, including the dot. "" for none.
+const char *compression_extension(Compression compression);
+
+// Buffered file writer that compresses and writes on its own thread.
+// Memory is bounded: the producer blocks once every chunk is waiting to be written.
+// Errors are logged and returned rather than fatal, so sinks can be used from worker
+// threads.
+typedef struct FileSink FileSink;
+
+// Create path. Returns NULL if it cannot be created.
+FileSink *sink_open(const char *path, Compression compression);
+
+// Queue data. After a write error the data is dropped and sink_close reports it.
+void sink_write(FileSink *sink, const char *data, size_t len);
+
+// Flush, finish the compressed stream and close the file. Stores the bytes written and
+// returns false if any write failed.
+bool sink_close(FileSink *sink, size_t *written);
+
+#endif /* B7D03E5A_9C21_4F68_A4B3_6E18F2C90D75 */
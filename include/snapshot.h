@@ -0,0 +1,33 @@
+#ifndef C61D9A3E_2F84_4B7C_8E15_A4F03B9D6E27
+#define C61D9A3E_2F84_4B7C_8E15_A4F03B9D6E27
+
+#include "common.h"
+#include <stdbool.h>
+
+// Options of the snapshot and lookup subcommands. Bound to flags in main.
+typedef struct {
+    char *path;   // Snapshot file.
+    bool full;    // Rebuild from every row instead of the rows changed since the last run.
+    bool listen;  // Keep running and refresh whenever the tables change.
+    char *name;   // Lookup: exact item name, ignoring case.
+    char *prefix; // Lookup: item name prefix, ignoring case.
+    char *id;     // Lookup: item id.
+    int limit;    // Lookup: most rows printed.
+} SnapshotOptions;
+
+extern SnapshotOptions snapshot_options;
+
+// Subcommand writing inventory_items joined with prices to a file made to be
+// memory-mapped: fixed-size records sorted by id, an index sorted by lowercase
+// name, hash tables on name and id, and one string pool. The file records the
+// oldest transaction its rows may not include; a refresh only pulls rows written
+// since then and rewrites the file next to the old one, then renames it over.
+// With listen, statement triggers notify the eclinic_prices channel and every
+// notification refreshes the file.
+void snapshot_prices(Subcommand *cmd);
+
+// Subcommand answering exact name, name prefix and id lookups from a snapshot file
+// without a database connection.
+void lookup_prices(Subcommand *cmd);
+
+#endif /* C61D9A3E_2F84_4B7C_8E15_A4F03B9D6E27 */
@@ -0,0 +1,23 @@
+#ifndef D05A9C73_E8B1_4F26_B3D4_7A2E61F0C95B
+#define D05A9C73_E8B1_4F26_B3D4_7A2E61F0C95B
+
+#include "loader.h"
+
+// When rows are put in client key order before they are sent.
+typedef enum {
+    ORDER_NONE,  // File order.
+    ORDER_BATCH, // Each batch is sorted on its own.
+    ORDER_FILE,  // The whole file is sorted.
+} RowOrder;
+
+// Parse a row order name. Aborts on unknown names.
+RowOrder row_order_parse(const char *name);
+
+// Sort rows by client key in place. The rows and their keys are already in memory, so
+// the sort needs no more than its own stack.
+void sort_rows(const LoadPlan *plan, CsvRow **rows, size_t num_rows);
+
+// Sort each consecutive batch of batch_size rows by client key.
+void sort_batches(const LoadPlan *plan, CsvRow **rows, size_t num_rows, size_t batch_size);
+
+#endif /* D05A9C73_E8B1_4F26_B3D4_7A2E61F0C95B */
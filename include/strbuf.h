@@ -0,0 +1,27 @@
+#ifndef C61E0B7A_2F44_4D8B_A1C9_8E3F5D27B690
+#define C61E0B7A_2F44_4D8B_A1C9_8E3F5D27B690
+
+#include <stdarg.h>
+#include <stddef.h>
+
+// Growable heap string buffer for hot paths (array literals, COPY data).
+// data is always NUL-terminated.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+void sb_init(StrBuf *sb, size_t cap);
+void sb_reserve(StrBuf *sb, size_t extra);
+void sb_appendn(StrBuf *sb, const char *s, size_t n);
+void sb_append(StrBuf *sb, const char *s);
+void sb_appendf(StrBuf *sb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void sb_putc(StrBuf *sb, char c);
+void sb_reset(StrBuf *sb);
+
+// Append value as a double-quoted element of a PostgreSQL array literal.
+void sb_append_array_element(StrBuf *sb, const char *value);
+void sb_free(StrBuf *sb);
+
+#endif /* C61E0B7A_2F44_4D8B_A1C9_8E3F5D27B690 */
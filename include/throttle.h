@@ -0,0 +1,37 @@
+#ifndef C3F8A6D1_0B94_4E72_A5C7_9D2B18E4F063
+#define C3F8A6D1_0B94_4E72_A5C7_9D2B18E4F063
+
+#include "loader.h"
+
+// Adaptive pacing for loads that share the database with live traffic.
+typedef struct {
+    size_t batch;        // Rows per transaction.
+    size_t max_batch;    // Upper bound for batch, from --batch-size.
+    double rate;         // Current rows per second.
+    double max_rate;     // Upper bound for rate, from --max-rate.
+    double target_ms;    // Batch latency above which the load backs off.
+    double max_lag_ms;   // Replica lag above which the load backs off.
+    double last_probe;   // When pg_stat_activity was last sampled (ms).
+    int lock_waiters;    // Backends of this database waiting on a lock, until observed.
+    double replica_lag;  // Largest replica replay lag, until observed (ms).
+} Throttle;
+
+void throttle_init(Throttle *t);
+
+// Sample lock waiters and replica lag, at most once a second. Called between
+// transactions, so the sample is not part of any batch's latency.
+void throttle_sample(Throttle *t);
+
+// Feed the latency of a batch of rows. Shrinks batch and rate on slow statements,
+// lock waits or replica lag seen by the last sample and grows them back while the
+// server is idle. Each sample is cleared once it has been observed.
+void throttle_observe(Throttle *t, double elapsed_ms);
+
+// Sleep long enough that rows sent in elapsed_ms do not exceed the current rate.
+void throttle_pace(const Throttle *t, size_t rows, double elapsed_ms);
+
+// Run a plan in one short transaction per batch, paced by a Throttle.
+LoadCounts throttle_execute(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                            LoadStrategy strategy);
+
+#endif /* C3F8A6D1_0B94_4E72_A5C7_9D2B18E4F063 */
@@ -0,0 +1,22 @@
+#ifndef A9D4E2B8_3F71_4C05_8B6A_D1E07C5F2A94
+#define A9D4E2B8_3F71_4C05_8B6A_D1E07C5F2A94
+
+#include <time.h>
+
+// Monotonic clock in milliseconds.
+static inline double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static inline void sleep_ms(double ms) {
+    if (ms <= 0)
+        return;
+
+    time_t sec = (time_t)(ms / 1e3);
+    struct timespec ts = {.tv_sec = sec, .tv_nsec = (long)((ms - sec * 1e3) * 1e6)};
+    nanosleep(&ts, NULL);
+}
+
+#endif /* A9D4E2B8_3F71_4C05_8B6A_D1E07C5F2A94 */
@@ -0,0 +1,27 @@
+#ifndef F3A7C61B_58D2_4E09_A4B1_9C26E0D7F348
+#define F3A7C61B_58D2_4E09_A4B1_9C26E0D7F348
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timeline of a run in Chrome Trace Event format, for Perfetto or chrome://tracing.
+// Each thread appends spans to its own buffer without locking; the buffers are written
+// to the file when the process exits, including after LOG_FATAL. Until trace_open
+// is called nothing is recorded and the calls below only test a flag.
+//
+//   double start = trace_begin();
+//   ...
+//   trace_end("send", plan->spec->table, rows, start);
+
+// Start recording and write the trace to path at exit. Later calls are ignored.
+void trace_open(const char *path);
+
+// Start of a span in microseconds since trace_open, or -1 when not tracing.
+double trace_begin(void);
+
+// Record a span from start until now. name is not copied and must be a string
+// literal; detail is copied, so it can be a plan's table or statement name.
+// detail may be NULL; count is shown as an argument, e.g. rows.
+void trace_end(const char *name, const char *detail, int64_t count, double start);
+
+#endif /* F3A7C61B_58D2_4E09_A4B1_9C26E0D7F348 */
@@ -0,0 +1,25 @@
+#ifndef D2F95B3C_6A48_4E17_B0C9_7E53A1D8F246
+#define D2F95B3C_6A48_4E17_B0C9_7E53A1D8F246
+
+#include "common.h"
+
+// Options of the transfer subcommand. Bound to flags in main.
+typedef struct {
+    char *source_env; // dotenv file of the source database.
+    char *target_env; // dotenv file of the target database.
+    char *tables;     // Comma separated tables, any order.
+    int jobs;         // Tables copied concurrently.
+    bool truncate;    // Empty each target table in its copy's transaction.
+} TransferOptions;
+
+extern TransferOptions transfer_options;
+
+// Subcommand piping binary COPY TO STDOUT on the source into COPY FROM STDIN on the
+// target, table by table, without touching disk. Tables start once the tables they
+// reference through foreign keys are done, up to jobs at a time. The source is read
+// from one exported snapshot and each target table commits on its own, after its
+// truncate if any. A failed table is rolled back, no more tables start and the run
+// fails once the running ones are done.
+void transfer_tables(Subcommand *cmd);
+
+#endif /* D2F95B3C_6A48_4E17_B0C9_7E53A1D8F246 */
@@ -0,0 +1,19 @@
+#ifndef E7A24C19_3B6D_4F85_9C01_D58E2F6A7B34
+#define E7A24C19_3B6D_4F85_9C01_D58E2F6A7B34
+
+#include "loader.h"
+
+// Loader whose specs describe the file being verified: pricelist or invoices.
+extern char *verify_loader;
+
+// Subcommand comparing a CSV file with the rows it was loaded into.
+// Each row is hashed on the client (md5 of its normalized inputs, truncated to 64
+// bits) and the hashes are summed, so the digest does not depend on row order.
+// One aggregate query computes the same sum on the server over the rows with the
+// file's keys. A mismatch is narrowed down by bisecting the key-sorted rows; the
+// server sum of each half costs one query since the other half is the difference.
+// Rows a spec's filter drops are found by the server and left out. Tables whose rows
+// cannot be looked up by file values are skipped; the command then lists them and fails.
+void verify_load(Subcommand *cmd);
+
+#endif /* E7A24C19_3B6D_4F85_9C01_D58E2F6A7B34 */
@@ -0,0 +1,244 @@
+#include "../include/archive.h"
+#include "../include/export.h"
+#include "../include/strbuf.h"
+#include "../include/throttle.h"
+#include "../include/timing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+ArchiveOptions archive_options = {
+    .invoices_older_than = "3 years",
+    .expired_for = "90 days",
+    .output = NULL,
+    .compress = "gzip",
+};
+
+// Table whose rows referencing the archived rows move with them.
+typedef struct {
+    const char *table;
+    const char *column; // Foreign key to the parent's key.
+} ArchiveChild;
+
+typedef struct {
+    const char *table;
+    const char *key;       // Integer key the batches walk in order.
+    const char *condition; // Rows to archive, in terms of the cutoff date $1.
+    const ArchiveChild *children;
+    size_t num_children;
+} ArchiveTarget;
+
+// Invoice lines move with their invoice, or with their item if that goes first.
+static const ArchiveChild invoice_children[] = {
+    {.table = "invoice_items", .column = "invoice_id"},
+};
+
+static const ArchiveChild item_children[] = {
+    {.table = "prices", .column = "item_id"},
+    {.table = "invoice_items", .column = "item_id"},
+};
+
+static const ArchiveTarget invoices_target = {
+    .table = "invoices",
+    .key = "id",
+    .condition = "purchase_date < $1::date",
+    .children = invoice_children,
+    .num_children = sizeof(invoice_children) / sizeof(invoice_children[0]),
+};
+
+static const ArchiveTarget items_target = {
+    .table = "inventory_items",
+    .key = "id",
+    .condition = "expiry_date < $1::date",
+    .children = item_children,
+    .num_children = sizeof(item_children) / sizeof(item_children[0]),
+};
+
+static void create_archive_table(const char *table) {
+    char *sql = NULL;
+    asprintf(&sql, "CREATE TABLE IF NOT EXISTS %s_archive (LIKE %s)", table, table);
+    load_exec(sql);
+    free(sql);
+}
+
+// Statement moving the next batch: rows matching the condition with a key above $2,
+// at most $3 of them, and their children. Returns the rows moved and the last key.
+static char *move_sql(const ArchiveTarget *target) {
+    StrBuf sql;
+    sb_init(&sql, 1024);
+    sb_appendf(&sql,
+               "WITH batch AS (SELECT %s FROM %s WHERE %s AND %s > $2::bigint ORDER BY %s LIMIT $3)",
+               target->key, target->table, target->condition, target->key, target->key);
+
+    for (size_t i = 0; i < target->num_children; i++) {
+        const ArchiveChild *child = &target->children[i];
+        sb_appendf(&sql,
+                   ", c%zu AS (DELETE FROM %s t USING batch b WHERE t.%s = b.%s RETURNING t.*)"
+                   ", a%zu AS (INSERT INTO %s_archive SELECT * FROM c%zu)",
+                   i, child->table, child->column, target->key, i, child->table, i);
+    }
+
+    sb_appendf(&sql,
+               ", moved AS (DELETE FROM %s t USING batch b WHERE t.%s = b.%s RETURNING t.*)"
+               ", archived AS (INSERT INTO %s_archive SELECT * FROM moved RETURNING %s) "
+               "SELECT count(*), max(%s) FROM archived",
+               target->table, target->key, target->key, target->table, target->key, target->key);
+    return sql.data;
+}
+
+// Move every row of target older than cutoff. Returns the number of rows moved.
+static size_t archive_target(const ArchiveTarget *target, const char *cutoff) {
+    create_archive_table(target->table);
+    for (size_t i = 0; i < target->num_children; i++) {
+        create_archive_table(target->children[i].table);
+    }
+
+    char *sql = move_sql(target);
+    Throttle t;
+    throttle_init(&t);
+
+    size_t total = 0;
+    char last_key[32] = "-9223372036854775808";
+    for (;;) {
+        char limit[32];
+        snprintf(limit, sizeof(limit), "%zu", t.batch);
+        const char *const params[3] = {cutoff, last_key, limit};
+
+        // Autocommit: every batch is its own short transaction.
+        double start = now_ms();
+        res = PQexecParams(conn, sql, 3, NULL, params, NULL, NULL, 0);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            LOG_FATAL("archiving %s failed: %s", target->table, PQerrorMessage(conn));
+        }
+        double elapsed = now_ms() - start;
+
+        size_t moved = strtoull(PQgetvalue(res, 0, 0), NULL, 10);
+        if (moved > 0) {
+            snprintf(last_key, sizeof(last_key), "%s", PQgetvalue(res, 0, 1));
+        }
+        FreeResult();
+
+        if (moved == 0)
+            break;
+
+        total += moved;
+        LOG_INFO("%s: archived %zu row(s) up to %s %s", target->table, total, target->key,
+                 last_key);
+        throttle_sample(&t);
+        throttle_observe(&t, elapsed);
+        throttle_pace(&t, moved, elapsed);
+    }
+
+    free(sql);
+    return total;
+}
+
+// Flush a file or directory to disk.
+static void sync_path(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        LOG_FATAL("unable to sync %s: %s", path, strerror(errno));
+    }
+    close(fd);
+}
+
+// Write an archive table to output and empty it. The rows are only truncated once
+// the file is on disk under its final name: a crash before then leaves the rows in
+// the table (and possibly a .partial file to delete), a crash between the rename and
+// COMMIT leaves them in both, so the next run writes them to a second file too.
+static void flush_archive(const char *table, Compression compression) {
+    char archive[128];
+    snprintf(archive, sizeof(archive), "%s_archive", table);
+
+    char stamp[32];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", localtime(&now));
+
+    char *path = NULL, *partial = NULL, *query = NULL, *truncate = NULL;
+    asprintf(&path, "%s/%s-%s.csv%s", archive_options.output, archive, stamp,
+             compression_extension(compression));
+    asprintf(&partial, "%s.partial", path);
+    asprintf(&query, "SELECT * FROM %s", archive);
+    asprintf(&truncate, "TRUNCATE %s", archive);
+
+    load_exec("BEGIN");
+    size_t rows = export_query(conn, query, partial, compression);
+    sync_path(partial);
+    if (rename(partial, path) != 0) {
+        LOG_FATAL("unable to rename %s: %s", partial, strerror(errno));
+    }
+    sync_path(archive_options.output);
+
+    load_exec(truncate);
+    load_exec("COMMIT");
+    LOG_INFO("Wrote %zu archived row(s) of %s to %s", rows, table, path);
+
+    free(path);
+    free(partial);
+    free(query);
+    free(truncate);
+}
+
+// Whether table is one of target's children.
+static bool archive_child_of(const ArchiveTarget *target, const char *table) {
+    for (size_t i = 0; i < target->num_children; i++) {
+        if (strcmp(target->children[i].table, table) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void archive_rows(Subcommand *cmd) {
+    (void)cmd;
+
+    if (load_options.batch_size <= 0 || load_options.max_rate <= 0 ||
+        load_options.target_ms <= 0) {
+        LOG_FATAL("--batch-size, --max-rate and --target-ms must be positive");
+    }
+
+    Compression compression = COMPRESS_NONE;
+    if (archive_options.output) {
+        compression = compression_parse(archive_options.compress, NULL);
+    }
+
+    // Cutoffs are fixed once so that every batch of a run agrees on them.
+    const char *const intervals[2] = {archive_options.invoices_older_than,
+                                      archive_options.expired_for};
+    res = PQexecParams(conn,
+                       "SELECT (current_date - $1::interval)::date, "
+                       "(current_date - $2::interval)::date",
+                       2, NULL, intervals, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("invalid archive interval: %s", PQerrorMessage(conn));
+    }
+    char *invoice_cutoff = strdup(PQgetvalue(res, 0, 0));
+    char *expiry_cutoff = strdup(PQgetvalue(res, 0, 1));
+    FreeResult();
+
+    LOG_INFO("Archiving invoices purchased before %s and items expired before %s",
+             invoice_cutoff, expiry_cutoff);
+
+    size_t invoices = archive_target(&invoices_target, invoice_cutoff);
+    size_t items = archive_target(&items_target, expiry_cutoff);
+    LOG_INFO("Archived %zu invoice(s) and %zu inventory item(s)", invoices, items);
+
+    if (archive_options.output) {
+        flush_archive(invoices_target.table, compression);
+        flush_archive(items_target.table, compression);
+        for (size_t i = 0; i < items_target.num_children; i++) {
+            flush_archive(items_target.children[i].table, compression);
+        }
+        // Children of both targets, e.g. invoice_items, are written once.
+        for (size_t i = 0; i < invoices_target.num_children; i++) {
+            if (!archive_child_of(&items_target, invoices_target.children[i].table)) {
+                flush_archive(invoices_target.children[i].table, compression);
+            }
+        }
+    }
+
+    free(invoice_cutoff);
+    free(expiry_cutoff);
+}
@@ -0,0 +1,106 @@
+#include "../include/autotune.h"
+#include "../include/capability.h"
+#include "../include/timing.h"
+#include "../include/trace.h"
+
+#define AUTO_MIN_WINDOW 50 // Smallest window, and smallest trial worth comparing.
+#define AUTO_MAX_WINDOW 50000
+#define AUTO_RTT_SAMPLES 5
+#define AUTO_RATE_DROP 0.7 // A window this much slower than the recent average counts as overload.
+#define AUTO_RATE_WEIGHT 0.3 // Weight of the latest window in that average.
+
+static const LoadStrategy candidates[] = {LOAD_PIPELINE, LOAD_BATCH, LOAD_COPY};
+#define NUM_CANDIDATES (sizeof(candidates) / sizeof(candidates[0]))
+
+// Measured on the first plan and kept for the others.
+static double rtt_ms = -1;
+static bool pipeline_ok = false;
+
+// Send rows as one window of a strategy: a single pipeline sync, batch statement or
+// COPY flush. Returns the elapsed milliseconds.
+static double run_window(LoadPlan *plan, CsvRow **rows, size_t n, LoadStrategy strategy,
+                         LoadCounts *counts) {
+    double start = now_ms();
+    load_counts_add(counts, load_plan_execute_sized(plan, rows, n, strategy, n));
+    double elapsed = now_ms() - start;
+    return elapsed > 1e-3 ? elapsed : 1e-3;
+}
+
+LoadCounts autotune_execute(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                            LoadStrategy strategy) {
+    (void)strategy;
+
+    LoadCounts counts = {0};
+    if (num_rows == 0)
+        return counts;
+
+    if (rtt_ms < 0) {
+        rtt_ms = capability_round_trip(AUTO_RTT_SAMPLES, NULL);
+        pipeline_ok = capability_pipeline();
+    }
+
+    const char *table = plan->spec->table;
+    // Trials take at most half the rows so that the winner loads the rest.
+    size_t trial = (size_t)load_options.batch_size;
+    if (trial > num_rows / (2 * NUM_CANDIDATES)) {
+        trial = num_rows / (2 * NUM_CANDIDATES);
+    }
+
+    LoadStrategy best = LOAD_BATCH;
+    size_t window = num_rows < AUTO_MAX_WINDOW ? num_rows : AUTO_MAX_WINDOW;
+    size_t start = 0;
+
+    if (trial >= AUTO_MIN_WINDOW) {
+        double rates[NUM_CANDIDATES] = {0};
+        double best_rate = 0;
+        for (size_t i = 0; i < NUM_CANDIDATES; i++) {
+            if (candidates[i] == LOAD_PIPELINE && !pipeline_ok)
+                continue;
+
+            double span = trace_begin();
+            double elapsed = run_window(plan, rows + start, trial, candidates[i], &counts);
+            trace_end("trial", load_strategy_name(candidates[i]), (int64_t)trial, span);
+            start += trial;
+
+            rates[i] = trial * 1e3 / elapsed;
+            if (rates[i] > best_rate) {
+                best = candidates[i];
+                best_rate = rates[i];
+            }
+        }
+
+        window = capability_batch_size(rtt_ms, best_rate, trial);
+        LOG_INFO("auto: %s for %s at %zu rows per window (pipeline %.0f, batch %.0f, copy %.0f "
+                 "rows/s over %zu rows each, round trip %.2f ms)",
+                 load_strategy_name(best), table, window, rates[0], rates[1], rates[2], trial,
+                 rtt_ms);
+    } else {
+        LOG_INFO("auto: batch for %s, %zu row(s) are too few to compare strategies", table,
+                 num_rows);
+    }
+
+    // AIMD: grow while windows finish within the target at a steady rate, halve on overload.
+    size_t step = window / 4 > AUTO_MIN_WINDOW ? window / 4 : AUTO_MIN_WINDOW;
+    double average = 0;
+    while (start < num_rows) {
+        size_t n = num_rows - start < window ? num_rows - start : window;
+        double elapsed = run_window(plan, rows + start, n, best, &counts);
+        start += n;
+
+        // A short last window says nothing about the window size.
+        if (n < window)
+            break;
+
+        double rate = n * 1e3 / elapsed;
+        if (elapsed > load_options.target_ms || rate < average * AUTO_RATE_DROP) {
+            window = window / 2 > AUTO_MIN_WINDOW ? window / 2 : AUTO_MIN_WINDOW;
+            LOG_INFO("auto: %s down to %zu rows per window for %s (%.0f ms, %.0f rows/s)",
+                     load_strategy_name(best), window, table, elapsed, rate);
+        } else {
+            window = window + step < AUTO_MAX_WINDOW ? window + step : AUTO_MAX_WINDOW;
+        }
+        average = average > 0 ? average + AUTO_RATE_WEIGHT * (rate - average) : rate;
+    }
+
+    return counts;
+}
@@ -1,14 +1,24 @@
 #include "../include/bcrypt.h"
+#include "../include/probe.h"
+#include "../include/trace.h"
+#include <stddef.h>
+
+// Work factor of new hashes: 2^12 rounds.
+#define BCRYPT_COST 12
 
 // Hash user passwords using bcrypt.
 // The hash is stored in the hash buffer. Returns true if successful.
 bool hash_password(const char *password, char hash[BCRYPT_HASHSIZE]) {
     char salt[BCRYPT_HASHSIZE];
-    if (bcrypt_gensalt(12, salt) != 0)
+    double start = trace_begin();
+    PROBE(hash_start, BCRYPT_COST);
+    if (bcrypt_gensalt(BCRYPT_COST, salt) != 0)
         return false;
     if (bcrypt_hashpw(password, salt, hash) != 0) {
         return false;
     }
+    PROBE(hash_complete, BCRYPT_COST);
+    trace_end("bcrypt", NULL, BCRYPT_COST, start);
     return true;
 }
 
@@ -0,0 +1,106 @@
+#include "../include/bulk.h"
+#include "../include/record.h"
+#include <string.h>
+
+// Tables touched by the load and the definitions of the indexes dropped from them.
+static const char **tables = NULL;
+static size_t num_tables = 0;
+static char **index_defs = NULL;
+static size_t num_indexes = 0;
+
+// Save and drop the non-unique, non-constraint indexes of a table.
+static void drop_secondary_indexes(const char *table) {
+    const char *query =
+        "SELECT quote_ident(n.nspname) || '.' || quote_ident(c.relname), "
+        "pg_get_indexdef(i.indexrelid) || CASE WHEN c.reltablespace <> 0 THEN "
+        "' TABLESPACE ' || quote_ident(t.spcname) ELSE '' END "
+        "FROM pg_index i JOIN pg_class c ON c.oid = i.indexrelid "
+        "JOIN pg_namespace n ON n.oid = c.relnamespace "
+        "LEFT JOIN pg_tablespace t ON t.oid = c.reltablespace "
+        "WHERE i.indrelid = $1::regclass AND NOT i.indisunique AND NOT i.indisprimary "
+        "AND NOT i.indisexclusion AND i.indisvalid "
+        "AND NOT EXISTS (SELECT 1 FROM pg_constraint k WHERE k.conindid = i.indexrelid)";
+
+    const char *const paramValues[1] = {table};
+    PGresult *indexes = record_exec_params(conn, query, 1, paramValues);
+    if (PQresultStatus(indexes) != PGRES_TUPLES_OK) {
+        LOG_FATAL("unable to list indexes of %s: %s", table, PQerrorMessage(conn));
+    }
+
+    int n = PQntuples(indexes);
+    index_defs = realloc(index_defs, (num_indexes + n) * sizeof(char *));
+    for (int i = 0; i < n; i++) {
+        index_defs[num_indexes++] = strdup(PQgetvalue(indexes, i, 1));
+
+        char *drop = NULL;
+        asprintf(&drop, "DROP INDEX %s", PQgetvalue(indexes, i, 0));
+        load_exec(drop);
+        free(drop);
+    }
+
+    if (n > 0) {
+        LOG_INFO("bulk: dropped %d secondary index(es) on %s", n, table);
+    }
+    PQclear(indexes);
+}
+
+void bulk_begin(const LoadSpec *const *specs, size_t num_specs) {
+    // SET LOCAL ends with the transaction whether it commits or not.
+    char *sql = NULL;
+    asprintf(&sql,
+             "SET LOCAL synchronous_commit = off; "
+             "SET LOCAL maintenance_work_mem = '%dMB'; "
+             "SET LOCAL max_parallel_maintenance_workers = %d",
+             load_options.maintenance_mb, load_options.index_workers);
+    load_exec(sql);
+    free(sql);
+
+    tables = realloc(tables, (num_specs ? num_specs : 1) * sizeof(char *));
+    if (!tables) {
+        LOG_FATAL("out of memory");
+    }
+
+    num_tables = 0;
+    for (size_t i = 0; i < num_specs; i++) {
+        bool seen = false;
+        for (size_t t = 0; t < num_tables; t++) {
+            seen = seen || strcmp(tables[t], specs[i]->table) == 0;
+        }
+
+        if (!seen) {
+            tables[num_tables++] = specs[i]->table;
+        }
+    }
+
+    if (load_options.drop_indexes) {
+        for (size_t t = 0; t < num_tables; t++) {
+            drop_secondary_indexes(tables[t]);
+        }
+    }
+}
+
+void bulk_finish(void) {
+    // Each CREATE INDEX sorts with parallel maintenance workers.
+    for (size_t i = 0; i < num_indexes; i++) {
+        load_exec(index_defs[i]);
+        free(index_defs[i]);
+    }
+
+    if (num_indexes > 0) {
+        LOG_INFO("bulk: rebuilt %zu secondary index(es)", num_indexes);
+    }
+    free(index_defs);
+    index_defs = NULL;
+    num_indexes = 0;
+
+    for (size_t t = 0; t < num_tables; t++) {
+        char *sql = NULL;
+        asprintf(&sql, "ANALYZE %s", tables[t]);
+        load_exec(sql);
+        free(sql);
+        LOG_INFO("bulk: analyzed %s", tables[t]);
+    }
+    free(tables);
+    tables = NULL;
+    num_tables = 0;
+}
@@ -0,0 +1,329 @@
+#include "../include/capability.h"
+#include "../include/record.h"
+#include "../include/strbuf.h"
+#include "../include/timing.h"
+#include <stdio.h>
+#include <string.h>
+
+int probe_rows = 5000;
+int probe_samples = 20;
+
+#define PROBE_ROW_LIMIT 200  // Row by row is timed on fewer rows: its rate does not depend on size.
+#define PROBE_ROW_TEXT 96    // Bytes of text per synthetic row.
+#define PROBE_COPY_CHUNK (1 << 16)
+#define PROBE_RTT_SHARE 0.05 // Share of a batch's time the recommendation leaves to the round trip.
+#define PROBE_BATCH_MS 250.0 // Longest batch recommended, so transactions and locks stay short.
+#define PROBE_MIN_BATCH 100
+#define PROBE_MAX_BATCH 50000
+
+// Shaped like inventory_items: a key, a name, a price and a date, upserted on the key.
+static const ColumnMap probe_columns[] = {
+    {.column = "id", .index = 0},
+    {.column = "name", .index = 1},
+    {.column = "price", .index = 2},
+    {.column = "expiry_date", .index = 3},
+};
+
+static const LoadSpec probe_spec = {
+    .name = "capability",
+    .table = "_probe_items",
+    .columns = probe_columns,
+    .num_columns = sizeof(probe_columns) / sizeof(probe_columns[0]),
+    .expected_fields = 4,
+    .conflict_key = (const char *const[]){"id", NULL},
+    .update_columns = (const char *const[]){"name", "price", "expiry_date", NULL},
+};
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Value at fraction p of the samples, which are sorted in place.
+static double percentile(double *samples, int n, double p) {
+    qsort(samples, (size_t)n, sizeof(double), compare_doubles);
+    return samples[(int)(p * (n - 1) + 0.5)];
+}
+
+static double *alloc_samples(int samples) {
+    double *ms = malloc((size_t)samples * sizeof(double));
+    if (!ms) {
+        LOG_FATAL("out of memory");
+    }
+    return ms;
+}
+
+double capability_round_trip(int samples, double *p90) {
+    double *ms = alloc_samples(samples);
+    for (int i = 0; i < samples; i++) {
+        double start = now_ms();
+        res = record_exec(conn, "SELECT 1");
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            LOG_FATAL("SELECT 1: %s", PQerrorMessage(conn));
+        }
+        FreeResult();
+        ms[i] = now_ms() - start;
+    }
+
+    double median = percentile(ms, samples, 0.5);
+    if (p90) {
+        *p90 = percentile(ms, samples, 0.9);
+    }
+    free(ms);
+    return median;
+}
+
+// Rows of temp tables are not WAL-logged, but creating one writes catalog rows, so its
+// COMMIT waits for the WAL flush as a load's does. The table is dropped outside the
+// timed transaction: dropping files at commit would force a flush even with
+// synchronous_commit off.
+static void measure_commit(Capability *cap, int samples) {
+    double *ms = alloc_samples(samples);
+    for (int i = 0; i < samples; i++) {
+        load_exec("BEGIN");
+        load_exec("CREATE TEMP TABLE _probe_commit (id int)");
+
+        double start = now_ms();
+        load_exec("COMMIT");
+        ms[i] = now_ms() - start;
+
+        load_exec("DROP TABLE _probe_commit");
+    }
+
+    cap->commit_ms = percentile(ms, samples, 0.5);
+    cap->commit_p90_ms = percentile(ms, samples, 0.9);
+    free(ms);
+}
+
+// Raw COPY FROM STDIN into an unindexed table, without the upsert that follows in a load.
+static void measure_copy(Capability *cap, CsvRow **rows, size_t num_rows) {
+    load_exec("CREATE TEMP TABLE _probe_copy (id text, name text, price text, expiry_date text)");
+
+    StrBuf csv;
+    sb_init(&csv, num_rows * PROBE_ROW_TEXT);
+    for (size_t i = 0; i < num_rows; i++) {
+        sb_appendf(&csv, "%s,%s,%s,%s\n", rows[i]->fields[0], rows[i]->fields[1],
+                   rows[i]->fields[2], rows[i]->fields[3]);
+    }
+
+    double start = now_ms();
+    res = PQexec(conn, "COPY _probe_copy FROM STDIN (FORMAT csv)");
+    if (PQresultStatus(res) != PGRES_COPY_IN) {
+        LOG_FATAL("COPY failed: %s", PQerrorMessage(conn));
+    }
+    FreeResult();
+
+    for (size_t off = 0; off < csv.len; off += PROBE_COPY_CHUNK) {
+        size_t len = csv.len - off < PROBE_COPY_CHUNK ? csv.len - off : PROBE_COPY_CHUNK;
+        if (PQputCopyData(conn, csv.data + off, (int)len) != 1) {
+            LOG_FATAL("COPY failed: %s", PQerrorMessage(conn));
+        }
+    }
+    if (PQputCopyEnd(conn, NULL) != 1) {
+        LOG_FATAL("COPY failed: %s", PQerrorMessage(conn));
+    }
+
+    res = PQgetResult(conn);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        LOG_FATAL("COPY failed: %s", PQerrorMessage(conn));
+    }
+    FreeResult();
+    while ((res = PQgetResult(conn)) != NULL) {
+        FreeResult();
+    }
+
+    double elapsed = now_ms() - start;
+    cap->copy_rows_s = num_rows * 1e3 / elapsed;
+    cap->copy_mb_s = csv.len / (elapsed * 1e3);
+
+    sb_free(&csv);
+    load_exec("DROP TABLE _probe_copy");
+}
+
+bool capability_pipeline(void) {
+    if (record_enter_pipeline(conn) != 1)
+        return false;
+
+    bool sent = record_send_params(conn, "SELECT 1", 0, NULL) &&
+                record_send_params(conn, "SELECT 1", 0, NULL) && record_pipeline_sync(conn);
+
+    int answered = 0;
+    while (sent) {
+        res = record_get_result(conn);
+        if (res == NULL) {
+            if (PQstatus(conn) != CONNECTION_OK)
+                break;
+            continue; // End of one query's results.
+        }
+
+        ExecStatusType status = PQresultStatus(res);
+        if (status == PGRES_TUPLES_OK) {
+            answered++;
+        }
+        FreeResult();
+        if (status == PGRES_PIPELINE_SYNC)
+            break;
+    }
+
+    return record_exit_pipeline(conn) == 1 && answered == 2;
+}
+
+// Synthetic pricelist-like rows with distinct keys.
+static CsvRow **make_rows(size_t num_rows) {
+    CsvRow **rows = malloc(num_rows * sizeof(CsvRow *));
+    if (!rows) {
+        LOG_FATAL("out of memory");
+    }
+
+    for (size_t i = 0; i < num_rows; i++) {
+        CsvRow *row = calloc(1, sizeof(CsvRow));
+        char **fields = malloc(4 * sizeof(char *));
+        char *text = malloc(PROBE_ROW_TEXT);
+        if (!row || !fields || !text) {
+            LOG_FATAL("out of memory");
+        }
+
+        int id = snprintf(text, PROBE_ROW_TEXT, "%zu", i + 1) + 1;
+        int name = snprintf(text + id, PROBE_ROW_TEXT - id, "Probe item %zu 500mg", i + 1) + 1;
+        int price = snprintf(text + id + name, PROBE_ROW_TEXT - id - name, "%zu.50",
+                             100 + i % 9000) + 1;
+        snprintf(text + id + name + price, PROBE_ROW_TEXT - id - name - price, "2027-%02zu-28",
+                 1 + i % 12);
+
+        fields[0] = text;
+        fields[1] = text + id;
+        fields[2] = text + id + name;
+        fields[3] = text + id + name + price;
+        row->fields = fields;
+        row->numFields = 4;
+        rows[i] = row;
+    }
+    return rows;
+}
+
+static void free_rows(CsvRow **rows, size_t num_rows) {
+    for (size_t i = 0; i < num_rows; i++) {
+        free(rows[i]->fields[0]);
+        free(rows[i]->fields);
+        free(rows[i]);
+    }
+    free(rows);
+}
+
+// Upsert rows through the load path in a transaction that is rolled back. Rows per second.
+static double time_strategy(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                            LoadStrategy strategy) {
+    load_exec("BEGIN");
+    double start = now_ms();
+    LoadCounts counts = load_plan_execute(plan, rows, num_rows, strategy);
+    double elapsed = now_ms() - start;
+    load_exec("ROLLBACK");
+
+    if (counts.inserted != num_rows) {
+        LOG_FATAL("%s probe inserted %zu of %zu rows", load_strategy_name(strategy), counts.inserted,
+                  num_rows);
+    }
+    return num_rows * 1e3 / (elapsed > 1e-3 ? elapsed : 1e-3);
+}
+
+// Smallest batch on the 1-2-5 series whose round trip is at most PROBE_RTT_SHARE of
+// the batch, within PROBE_BATCH_MS.
+size_t capability_batch_size(double rtt_ms, double rows_s, size_t measured_batch) {
+    double row_ms = 1e3 / rows_s - rtt_ms / measured_batch;
+    if (row_ms < 1e-6) {
+        row_ms = 1e-6;
+    }
+
+    double want = rtt_ms * (1 - PROBE_RTT_SHARE) / PROBE_RTT_SHARE / row_ms;
+    if (want > PROBE_BATCH_MS / row_ms) {
+        want = PROBE_BATCH_MS / row_ms;
+    }
+
+    static const size_t steps[] = {1, 2, 5};
+    size_t batch = PROBE_MIN_BATCH;
+    for (size_t scale = PROBE_MIN_BATCH; batch < want && batch < PROBE_MAX_BATCH; scale *= 10) {
+        for (size_t i = 0; i < 3 && batch < want; i++) {
+            batch = scale * steps[i];
+        }
+    }
+    return batch < PROBE_MAX_BATCH ? batch : PROBE_MAX_BATCH;
+}
+
+Capability capability_measure(size_t rows, int samples) {
+    Capability cap = {0};
+    CsvRow **data = make_rows(rows);
+
+    cap.rtt_ms = capability_round_trip(samples, &cap.rtt_p90_ms);
+    measure_commit(&cap, samples);
+    measure_copy(&cap, data, rows);
+    cap.pipeline = capability_pipeline();
+
+    load_exec("CREATE TEMP TABLE _probe_items (id bigint PRIMARY KEY, name text NOT NULL, "
+              "price numeric(12,2), expiry_date date)");
+    LoadPlan *plan = load_plan_compile(&probe_spec, NULL);
+
+    cap.strategy = LOAD_ROW;
+    for (LoadStrategy s = LOAD_ROW; s <= LOAD_COPY; s++) {
+        if (s == LOAD_PIPELINE && !cap.pipeline)
+            continue;
+
+        size_t n = s == LOAD_ROW && rows > PROBE_ROW_LIMIT ? PROBE_ROW_LIMIT : rows;
+        cap.rows_s[s] = time_strategy(plan, data, n, s);
+        if (cap.rows_s[s] > cap.rows_s[cap.strategy]) {
+            cap.strategy = s;
+        }
+    }
+
+    cap.batch_size = capability_batch_size(cap.rtt_ms, cap.rows_s[cap.strategy],
+                                           (size_t)load_options.batch_size);
+
+    load_plan_free(plan);
+    load_exec("DROP TABLE _probe_items");
+    free_rows(data, rows);
+    return cap;
+}
+
+void probe_target(Subcommand *cmd) {
+    (void)cmd;
+
+    if (probe_rows < 1 || probe_samples < 1) {
+        LOG_FATAL("--rows and --samples must be positive");
+    }
+
+    Capability cap = capability_measure((size_t)probe_rows, probe_samples);
+
+    res = PQexec(conn, "SHOW synchronous_commit");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("SHOW synchronous_commit: %s", PQerrorMessage(conn));
+    }
+    char sync_commit[32] = "unknown";
+    if (PQntuples(res) == 1) {
+        snprintf(sync_commit, sizeof(sync_commit), "%s", PQgetvalue(res, 0, 0));
+    }
+    FreeResult();
+
+    int server = PQserverVersion(conn);
+    int lib = PQlibVersion();
+    printf("target      %s:%s, server %d.%d, libpq %d.%d\n", PQhost(conn), PQport(conn),
+           server / 10000, server % 10000, lib / 10000, lib % 10000);
+    printf("round trip  %.2f ms median, %.2f ms p90 over %d queries\n", cap.rtt_ms,
+           cap.rtt_p90_ms, probe_samples);
+    printf("commit      %.2f ms median, %.2f ms p90 (synchronous_commit %s)\n", cap.commit_ms,
+           cap.commit_p90_ms, sync_commit);
+    printf("copy        %.0f rows/s, %.1f MB/s\n", cap.copy_rows_s, cap.copy_mb_s);
+    printf("pipeline    %s\n\n", cap.pipeline ? "supported" : "not supported");
+
+    printf("%-10s %10s %12s\n", "strategy", "rows", "rows/s");
+    for (LoadStrategy s = LOAD_ROW; s <= LOAD_COPY; s++) {
+        if (cap.rows_s[s] == 0) {
+            printf("%-10s %10s %12s\n", load_strategy_name(s), "-", "-");
+            continue;
+        }
+        size_t n = s == LOAD_ROW && probe_rows > PROBE_ROW_LIMIT ? PROBE_ROW_LIMIT
+                                                                 : (size_t)probe_rows;
+        printf("%-10s %10zu %12.0f\n", load_strategy_name(s), n, cap.rows_s[s]);
+    }
+
+    printf("\nrecommended --strategy %s --batch-size %zu\n", load_strategy_name(cap.strategy),
+           cap.batch_size);
+}
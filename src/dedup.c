@@ -0,0 +1,181 @@
+#include "../include/dedup.h"
+#include <stdio.h>
+#include <string.h>
+
+// Bytes per row while deduplicating: its (row, hash) record plus two hash table slots.
+#define DEDUP_BYTES_PER_ROW (sizeof(DedupRecord) + 2 * sizeof(DedupSlot))
+
+typedef struct {
+    uint64_t hash;
+    size_t row; // SIZE_MAX when the slot is empty.
+} DedupSlot;
+
+// (row, hash) pair written to a spill partition.
+typedef struct {
+    size_t row;
+    uint64_t hash;
+} DedupRecord;
+
+DedupMode dedup_mode_parse(const char *name) {
+    if (strcmp(name, "off") == 0)
+        return DEDUP_OFF;
+    if (strcmp(name, "first") == 0)
+        return DEDUP_FIRST;
+    if (strcmp(name, "last") == 0)
+        return DEDUP_LAST;
+    if (strcmp(name, "auto") == 0)
+        return DEDUP_AUTO;
+
+    LOG_FATAL("unknown dedup mode: %s (expected auto, first, last or off)", name);
+}
+
+static size_t next_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+// Deduplicate the n rows listed in ascending order in records.
+// Marks the losers in drop and returns how many there were.
+static size_t dedup_records(const LoadPlan *plan, CsvRow **rows, const DedupRecord *records,
+                            size_t n, bool last_wins, uint8_t *drop) {
+    size_t cap = next_pow2(n * 2 + 1);
+    DedupSlot *slots = malloc(cap * sizeof(DedupSlot));
+    if (!slots) {
+        LOG_FATAL("out of memory");
+    }
+
+    for (size_t i = 0; i < cap; i++) {
+        slots[i].row = SIZE_MAX;
+    }
+
+    size_t dups = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t row = records[i].row;
+        uint64_t hash = records[i].hash;
+        size_t pos = hash & (cap - 1);
+
+        for (;;) {
+            DedupSlot *slot = &slots[pos];
+            if (slot->row == SIZE_MAX) {
+                slot->hash = hash;
+                slot->row = row;
+                break;
+            }
+
+            if (slot->hash == hash && load_key_compare(plan, rows[slot->row], rows[row]) == 0) {
+                dups++;
+                if (last_wins) {
+                    drop[slot->row] = 1;
+                    slot->row = row;
+                } else {
+                    drop[row] = 1;
+                }
+                break;
+            }
+            pos = (pos + 1) & (cap - 1);
+        }
+    }
+
+    free(slots);
+    return dups;
+}
+
+// Partition (row, hash) pairs into temp files by the top bits of the hash so that
+// every partition's hash table fits the budget, then deduplicate them one at a time.
+static size_t dedup_spill(const LoadPlan *plan, CsvRow **rows, size_t num_rows, bool last_wins,
+                          size_t memory_budget, uint8_t *drop) {
+    size_t parts = next_pow2((num_rows * DEDUP_BYTES_PER_ROW) / memory_budget + 1) * 2;
+    int bits = __builtin_ctzll(parts);
+
+    FILE **files = calloc(parts, sizeof(FILE *));
+    size_t *counts = calloc(parts, sizeof(size_t));
+    if (!files || !counts) {
+        LOG_FATAL("out of memory");
+    }
+
+    for (size_t p = 0; p < parts; p++) {
+        files[p] = tmpfile();
+        if (!files[p]) {
+            LOG_FATAL("unable to create dedup spill file");
+        }
+    }
+
+    for (size_t i = 0; i < num_rows; i++) {
+        DedupRecord rec = {.row = i, .hash = load_key_hash(plan, rows[i])};
+        size_t p = rec.hash >> (64 - bits);
+        if (fwrite(&rec, sizeof(rec), 1, files[p]) != 1) {
+            LOG_FATAL("unable to write dedup spill file");
+        }
+        counts[p]++;
+    }
+
+    LOG_INFO("%s: key set exceeds %zu MB, spilled to %zu partitions", plan->spec->name,
+             memory_budget >> 20, parts);
+
+    size_t dups = 0;
+    for (size_t p = 0; p < parts; p++) {
+        DedupRecord *records = malloc((counts[p] + 1) * sizeof(DedupRecord));
+        if (!records) {
+            LOG_FATAL("out of memory");
+        }
+
+        rewind(files[p]);
+        if (fread(records, sizeof(DedupRecord), counts[p], files[p]) != counts[p]) {
+            LOG_FATAL("unable to read dedup spill file");
+        }
+        fclose(files[p]);
+
+        dups += dedup_records(plan, rows, records, counts[p], last_wins, drop);
+        free(records);
+    }
+
+    free(files);
+    free(counts);
+    return dups;
+}
+
+size_t dedup_rows(const LoadPlan *plan, CsvRow **rows, size_t num_rows, DedupMode mode,
+                  size_t memory_budget) {
+    if (mode == DEDUP_OFF || plan->num_keys == 0 || num_rows < 2)
+        return num_rows;
+
+    bool last_wins = mode == DEDUP_LAST || (mode == DEDUP_AUTO && plan->spec->update_columns);
+
+    uint8_t *drop = calloc(num_rows, 1);
+    if (!drop) {
+        LOG_FATAL("out of memory");
+    }
+
+    size_t dups;
+    if (num_rows * DEDUP_BYTES_PER_ROW <= memory_budget) {
+        DedupRecord *records = malloc(num_rows * sizeof(DedupRecord));
+        if (!records) {
+            LOG_FATAL("out of memory");
+        }
+
+        for (size_t i = 0; i < num_rows; i++) {
+            records[i] = (DedupRecord){.row = i, .hash = load_key_hash(plan, rows[i])};
+        }
+        dups = dedup_records(plan, rows, records, num_rows, last_wins, drop);
+        free(records);
+    } else {
+        dups = dedup_spill(plan, rows, num_rows, last_wins, memory_budget, drop);
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < num_rows; i++) {
+        if (!drop[i]) {
+            rows[n++] = rows[i];
+        }
+    }
+    free(drop);
+
+    if (dups > 0) {
+        LOG_INFO("%s: collapsed %zu duplicate key(s), %s occurrence wins", plan->spec->name, dups,
+                 last_wins ? "last" : "first");
+    }
+    return n;
+}
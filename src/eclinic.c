@@ -1,6 +1,18 @@
-#define MAX_SUBCOMMANDS 10
+#define MAX_SUBCOMMANDS 32
 
 #include "../include/common.h"
+#include "../include/archive.h"
+#include "../include/capability.h"
+#include "../include/export.h"
+#include "../include/fakepg.h"
+#include "../include/loader.h"
+#include "../include/partition.h"
+#include "../include/profile.h"
+#include "../include/record.h"
+#include "../include/similar.h"
+#include "../include/snapshot.h"
+#include "../include/transfer.h"
+#include "../include/verify.h"
 #include <solidc/process.h>
 #include <solidc/stdstreams.h>
 
@@ -81,20 +93,99 @@ void cleanup(void) {
     }
 }
 
-void connect_db(void) {
+PGconn *open_connection(void) {
     const char *db = secure_getenv("PGDATABASE");
     const char *host = secure_getenv("PGHOST");
     const char *user = secure_getenv("PGUSER");
     const char *password = secure_getenv("PGPASSWORD");
+    const char *port = secure_getenv("PGPORT");
 
     char *conninfo = NULL;
-    asprintf(&conninfo, "postgres://%s:%s@%s:5432/%s?sslmode=disable", user, password, host, db);
-    conn = PQconnectdb(conninfo);
+    asprintf(&conninfo, "postgres://%s:%s@%s:%s/%s?sslmode=disable", user, password, host,
+             port ? port : "5432", db);
+    PGconn *pg = PQconnectdb(conninfo);
     free(conninfo);
 
-    if (PQstatus(conn) != CONNECTION_OK) {
-        LOG_FATAL("Connection to database failed: %s", PQerrorMessage(conn));
+    if (PQstatus(pg) != CONNECTION_OK) {
+        LOG_FATAL("Connection to database failed: %s", PQerrorMessage(pg));
     }
+    return pg;
+}
+
+void connect_db(void) {
+    conn = open_connection();
+}
+
+// Flags shared by the CSV loaders.
+static void add_load_flags(Subcommand *cmd) {
+    subcommand_add_flag(cmd, FLAG_STRING, "strategy", 's',
+                        "Load strategy: row|pipeline|batch|copy|auto", &load_options.strategy,
+                        false);
+    subcommand_add_flag(cmd, FLAG_INT, "batch-size", 'b', "Rows per batch or pipeline sync",
+                        &load_options.batch_size, false);
+    subcommand_add_flag(cmd, FLAG_STRING, "dedup", 'd', "Repeated keys: auto|first|last|off",
+                        &load_options.dedup, false);
+    subcommand_add_flag(cmd, FLAG_INT, "memory-mb", 'm', "Memory budget before spilling to disk",
+                        &load_options.memory_mb, false);
+    subcommand_add_flag(cmd, FLAG_STRING, "order", 'o', "Send rows in key order: none|batch|file",
+                        &load_options.order, false);
+    subcommand_add_flag(cmd, FLAG_BOOL, "stats", 'S', "Report throughput and buffer hits",
+                        &load_options.stats, false);
+    subcommand_add_flag(cmd, FLAG_BOOL, "bulk", 'B', "Maintenance window load: tune, analyze",
+                        &load_options.bulk, false);
+    subcommand_add_flag(cmd, FLAG_BOOL, "drop-indexes", 'D',
+                        "With --bulk, drop and rebuild secondary indexes", &load_options.drop_indexes,
+                        false);
+    subcommand_add_flag(cmd, FLAG_INT, "maintenance-mb", 'M', "With --bulk, maintenance_work_mem",
+                        &load_options.maintenance_mb, false);
+    subcommand_add_flag(cmd, FLAG_INT, "index-workers", 'W',
+                        "With --bulk, parallel workers per index rebuild",
+                        &load_options.index_workers, false);
+    subcommand_add_flag(cmd, FLAG_BOOL, "gentle", 'g', "Online load: short transactions, paced",
+                        &load_options.gentle, false);
+    subcommand_add_flag(cmd, FLAG_INT, "max-rate", 'r', "With --gentle, rows per second cap",
+                        &load_options.max_rate, false);
+    subcommand_add_flag(cmd, FLAG_INT, "target-ms", 't',
+                        "With --gentle or auto, batch latency target", &load_options.target_ms,
+                        false);
+    subcommand_add_flag(cmd, FLAG_INT, "max-lag-ms", 'L', "With --gentle, replica lag limit",
+                        &load_options.max_lag_ms, false);
+    subcommand_add_flag(cmd, FLAG_BOOL, "ledger", 'l', "Skip files and chunks already loaded",
+                        &load_options.ledger, false);
+    subcommand_add_flag(cmd, FLAG_STRING, "trace", 'T', "Write a Chrome trace to this file",
+                        &load_options.trace, false);
+    subcommand_add_flag(cmd, FLAG_STRING, "record", 'R', "Record database calls to this file",
+                        &load_options.record, false);
+    subcommand_add_flag(cmd, FLAG_INT, "explain-slow", 'E',
+                        "Save the plans of statements slower than this many ms",
+                        &load_options.explain_slow, false);
+    subcommand_add_flag(cmd, FLAG_STRING, "explain-file", 'X', "File slow plans are appended to",
+                        &load_options.explain_file, false);
+}
+
+// Flags of the loaders that always stage with COPY.
+static void add_staged_load_flags(Subcommand *cmd) {
+    subcommand_add_flag(cmd, FLAG_INT, "batch-size", 'b', "Rows per COPY flush",
+                        &load_options.batch_size, false);
+    subcommand_add_flag(cmd, FLAG_STRING, "dedup", 'd', "Repeated keys: auto|first|last|off",
+                        &load_options.dedup, false);
+    subcommand_add_flag(cmd, FLAG_INT, "memory-mb", 'm', "Memory budget before spilling to disk",
+                        &load_options.memory_mb, false);
+    subcommand_add_flag(cmd, FLAG_STRING, "order", 'o', "Send rows in key order: none|batch|file",
+                        &load_options.order, false);
+    subcommand_add_flag(cmd, FLAG_BOOL, "stats", 'S', "Report throughput and buffer hits",
+                        &load_options.stats, false);
+    subcommand_add_flag(cmd, FLAG_BOOL, "ledger", 'l', "Skip files and chunks already loaded",
+                        &load_options.ledger, false);
+    subcommand_add_flag(cmd, FLAG_STRING, "trace", 'T', "Write a Chrome trace to this file",
+                        &load_options.trace, false);
+    subcommand_add_flag(cmd, FLAG_STRING, "record", 'R', "Record database calls to this file",
+                        &load_options.record, false);
+    subcommand_add_flag(cmd, FLAG_INT, "explain-slow", 'E',
+                        "Save the plans of statements slower than this many ms",
+                        &load_options.explain_slow, false);
+    subcommand_add_flag(cmd, FLAG_STRING, "explain-file", 'X', "File slow plans are appended to",
+                        &load_options.explain_file, false);
 }
 
 int main(int argc, char *argv[]) {
@@ -115,15 +206,38 @@ int main(int argc, char *argv[]) {
     Subcommand *uploadcmd = flag_add_subcommand(
         "pricelist", "Upload items to eclinichms inventory price list", upload_pricelist_csv);
     subcommand_add_flag(uploadcmd, FLAG_STRING, "file", 'f', "Price list file", &filename, true);
+    add_load_flags(uploadcmd);
+    subcommand_add_flag(uploadcmd, FLAG_BOOL, "check-similar", 'c',
+                        "Stop if item names look like existing items", &check_similar, false);
+    // ===================================================================================
+    Subcommand *prices_cmd = flag_add_subcommand(
+        "prices", "Upload insurer prices of inventory items", upload_prices_csv);
+    subcommand_add_flag(prices_cmd, FLAG_STRING, "file", 'f', "csv file of prices", &filename,
+                        true);
+    add_staged_load_flags(prices_cmd);
     // ===================================================================================
     Subcommand *invoices_cmd =
         flag_add_subcommand("invoices", "Upload invoices to eclinichms", upload_invoices_csv);
     subcommand_add_flag(invoices_cmd, FLAG_STRING, "file", 'f', "csv file for invoices", &filename,
                         true);
+    add_load_flags(invoices_cmd);
+    // ===================================================================================
+    Subcommand *items_cmd = flag_add_subcommand(
+        "invoice-items", "Upload invoices with their line items", upload_invoice_items_csv);
+    subcommand_add_flag(items_cmd, FLAG_STRING, "file", 'f', "csv file for invoices", &filename,
+                        true);
+    subcommand_add_flag(items_cmd, FLAG_STRING, "lines", 'i',
+                        "csv file for line items, if not in the invoices file",
+                        &invoice_lines_file, false);
+    add_staged_load_flags(items_cmd);
     // ===================================================================================
     Subcommand *users_cmd =
         flag_add_subcommand("users", "Upload user accounts", upload_user_accounts_csv);
     subcommand_add_flag(users_cmd, FLAG_STRING, "file", 'f', "user accounts csv", &filename, true);
+    add_load_flags(users_cmd);
+    // ===================================================================================
+    flag_add_subcommand("partition", "Partition invoices by month of purchase_date",
+                        partition_invoices);
     // ===================================================================================
     Subcommand *initcmd =
         flag_add_subcommand("schema", "Initialize the database schema", initialize_schema);
@@ -143,11 +257,132 @@ int main(int argc, char *argv[]) {
     subcommand_add_flag(dxcatcmd, FLAG_BOOL, "incremental", 'i', "Incremental upload", &incremental,
                         false);
 
+    // ===================================================================================
+    Subcommand *verifycmd =
+        flag_add_subcommand("verify", "Check that a loaded CSV matches the database", verify_load);
+    subcommand_add_flag(verifycmd, FLAG_STRING, "file", 'f', "csv file that was loaded", &filename,
+                        true);
+    subcommand_add_flag(verifycmd, FLAG_STRING, "loader", 'l',
+                        "Loader the file was loaded with: pricelist|invoices", &verify_loader,
+                        true);
+    subcommand_add_flag(verifycmd, FLAG_STRING, "dedup", 'd', "Repeated keys: auto|first|last|off",
+                        &load_options.dedup, false);
+    subcommand_add_flag(verifycmd, FLAG_INT, "memory-mb", 'm',
+                        "Memory budget before spilling to disk", &load_options.memory_mb, false);
+
+    // ===================================================================================
+    Subcommand *exportcmd =
+        flag_add_subcommand("export", "Export tables to CSV with COPY", export_tables);
+    subcommand_add_flag(exportcmd, FLAG_STRING, "tables", 't',
+                        "Comma separated loaders (pricelist, invoices) or tables",
+                        &export_options.tables, false);
+    subcommand_add_flag(exportcmd, FLAG_STRING, "output", 'o', "Output directory",
+                        &export_options.output, false);
+    subcommand_add_flag(exportcmd, FLAG_STRING, "compress", 'z', "Compression: none|gzip|zstd",
+                        &export_options.compress, false);
+    subcommand_add_flag(exportcmd, FLAG_INT, "jobs", 'j', "Connections sharing one snapshot",
+                        &export_options.jobs, false);
+
+    // ===================================================================================
+    Subcommand *transfercmd = flag_add_subcommand(
+        "transfer", "Copy tables from one database to another", transfer_tables);
+    subcommand_add_flag(transfercmd, FLAG_STRING, "source", 's', "dotenv file of the source",
+                        &transfer_options.source_env, true);
+    subcommand_add_flag(transfercmd, FLAG_STRING, "target", 'T', "dotenv file of the target",
+                        &transfer_options.target_env, true);
+    subcommand_add_flag(transfercmd, FLAG_STRING, "tables", 't', "Comma separated tables",
+                        &transfer_options.tables, false);
+    subcommand_add_flag(transfercmd, FLAG_INT, "jobs", 'j', "Tables copied concurrently",
+                        &transfer_options.jobs, false);
+    subcommand_add_flag(transfercmd, FLAG_BOOL, "truncate", 'x', "Empty each table before its copy",
+                        &transfer_options.truncate, false);
+
+    // ===================================================================================
+    Subcommand *archivecmd = flag_add_subcommand(
+        "archive", "Move old invoices and expired stock to archive tables", archive_rows);
+    subcommand_add_flag(archivecmd, FLAG_STRING, "invoices-older-than", 'i',
+                        "Archive invoices older than this interval",
+                        &archive_options.invoices_older_than, false);
+    subcommand_add_flag(archivecmd, FLAG_STRING, "expired-for", 'x',
+                        "Archive items expired for longer than this interval",
+                        &archive_options.expired_for, false);
+    subcommand_add_flag(archivecmd, FLAG_STRING, "output", 'o',
+                        "Write archived rows to files in this directory", &archive_options.output,
+                        false);
+    subcommand_add_flag(archivecmd, FLAG_STRING, "compress", 'z',
+                        "Compression of archive files: none|gzip|zstd", &archive_options.compress,
+                        false);
+    subcommand_add_flag(archivecmd, FLAG_INT, "batch-size", 'b', "Most rows per transaction",
+                        &load_options.batch_size, false);
+    subcommand_add_flag(archivecmd, FLAG_INT, "max-rate", 'r', "Rows per second cap",
+                        &load_options.max_rate, false);
+    subcommand_add_flag(archivecmd, FLAG_INT, "target-ms", 't', "Batch latency target",
+                        &load_options.target_ms, false);
+    subcommand_add_flag(archivecmd, FLAG_INT, "max-lag-ms", 'L', "Replica lag limit",
+                        &load_options.max_lag_ms, false);
+
+    // ===================================================================================
+    Subcommand *snapshotcmd = flag_add_subcommand(
+        "snapshot", "Write item prices to a memory-mapped lookup file", snapshot_prices);
+    subcommand_add_flag(snapshotcmd, FLAG_STRING, "output", 'o', "Snapshot file",
+                        &snapshot_options.path, false);
+    subcommand_add_flag(snapshotcmd, FLAG_BOOL, "full", 'F', "Read every row, not only changes",
+                        &snapshot_options.full, false);
+    subcommand_add_flag(snapshotcmd, FLAG_BOOL, "listen", 'l', "Refresh whenever prices change",
+                        &snapshot_options.listen, false);
+
+    // ===================================================================================
+    Subcommand *lookupcmd =
+        flag_add_subcommand("lookup", "Look up item prices in a snapshot file", lookup_prices);
+    subcommand_add_flag(lookupcmd, FLAG_STRING, "snapshot", 's', "Snapshot file",
+                        &snapshot_options.path, false);
+    subcommand_add_flag(lookupcmd, FLAG_STRING, "name", 'n', "Item name, ignoring case",
+                        &snapshot_options.name, false);
+    subcommand_add_flag(lookupcmd, FLAG_STRING, "prefix", 'p', "Item name prefix, ignoring case",
+                        &snapshot_options.prefix, false);
+    subcommand_add_flag(lookupcmd, FLAG_STRING, "id", 'i', "Item id", &snapshot_options.id,
+                        false);
+    subcommand_add_flag(lookupcmd, FLAG_INT, "limit", 'L', "Most items listed",
+                        &snapshot_options.limit, false);
+
+    // ===================================================================================
+    Subcommand *profilecmd =
+        flag_add_subcommand("profile", "Describe the columns of a CSV file", profile_csv);
+    subcommand_add_flag(profilecmd, FLAG_STRING, "file", 'f', "csv file", &filename, true);
+    subcommand_add_flag(profilecmd, FLAG_INT, "top", 'k', "Most frequent values per column",
+                        &profile_top, false);
+
+    // ===================================================================================
+    Subcommand *replaycmd = flag_add_subcommand(
+        "replay", "Replay a recorded load against the database", replay_recording);
+    subcommand_add_flag(replaycmd, FLAG_STRING, "file", 'f', "Recording file", &filename, true);
+    subcommand_add_flag(replaycmd, FLAG_BOOL, "fast", 'F', "Do not wait between calls as recorded",
+                        &replay_fast, false);
+
+    // ===================================================================================
+    Subcommand *fakepgcmd = flag_add_subcommand(
+        "fakepg", "Serve a stand-in database that answers instantly", fakepg_serve);
+    subcommand_add_flag(fakepgcmd, FLAG_INT, "port", 'p', "Port on 127.0.0.1", &fakepg_port,
+                        false);
+
+    // ===================================================================================
+    Subcommand *probecmd = flag_add_subcommand(
+        "probe", "Measure the database and suggest load options", probe_target);
+    subcommand_add_flag(probecmd, FLAG_INT, "rows", 'n', "Rows per load workload", &probe_rows,
+                        false);
+    subcommand_add_flag(probecmd, FLAG_INT, "samples", 's', "Round trips and commits timed",
+                        &probe_samples, false);
+
     // ==================== Parse the flags ==========================================
     Subcommand *subcmd = flag_parse(argc, argv);
 
-    parse_env_file(env);
-    connect_db();
+    // Lookups and profiles only read files, fakepg is the database and transfer connects
+    // with its own dotenv files.
+    if (subcmd != lookupcmd && subcmd != profilecmd && subcmd != fakepgcmd &&
+        subcmd != transfercmd) {
+        parse_env_file(env);
+        connect_db();
+    }
 
     if (subcmd == NULL) {
         flag_print_usage(argv[0]);
@@ -0,0 +1,186 @@
+#include "../include/explain.h"
+#include "../include/record.h"
+#include "../include/strbuf.h"
+#include "../include/timing.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define EXPLAIN_MIN_GAP_MS 1000.0 // Shortest wait between two captures.
+#define EXPLAIN_COST_FACTOR 10.0  // Wait after a capture, in multiples of its duration.
+
+static const ExplainSource *current = NULL;
+static double next_capture = 0;   // now_ms() before which slow statements are not captured.
+static size_t num_skipped = 0;    // Slow statements not captured since the last capture.
+static bool disabled = false;     // A capture failed, e.g. on a server without EXPLAIN (WAL).
+static bool saved = false;        // Inside explain_savepoint.
+static double capture_start = -1; // now_ms() when the statement being captured was due.
+
+static int compare_lines(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)((const ExplainLine *)a)->row;
+    uintptr_t y = (uintptr_t)((const ExplainLine *)b)->row;
+    return (x > y) - (x < y);
+}
+
+void explain_source_init(ExplainSource *source, const char *path, CsvRow **rows,
+                         size_t num_rows) {
+    *source = (ExplainSource){.path = path};
+    if (load_options.explain_slow <= 0 || num_rows == 0)
+        return;
+
+    source->lines = malloc(num_rows * sizeof(ExplainLine));
+    if (!source->lines) {
+        LOG_FATAL("out of memory");
+    }
+
+    // The header is line 1.
+    for (size_t i = 0; i < num_rows; i++) {
+        source->lines[i] = (ExplainLine){.row = rows[i], .line = i + 2};
+    }
+    qsort(source->lines, num_rows, sizeof(ExplainLine), compare_lines);
+    source->num_lines = num_rows;
+}
+
+void explain_source_free(ExplainSource *source) {
+    free(source->lines);
+    *source = (ExplainSource){0};
+}
+
+void explain_use_source(const ExplainSource *source) {
+    current = source;
+}
+
+// CSV line of a row of the current source, 0 if unknown.
+static size_t line_of(CsvRow *row) {
+    if (!current)
+        return 0;
+
+    size_t lo = 0, hi = current->num_lines;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((uintptr_t)current->lines[mid].row < (uintptr_t)row) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < current->num_lines && current->lines[lo].row == row ? current->lines[lo].line
+                                                                     : 0;
+}
+
+void explain_savepoint(void) {
+    if (load_options.explain_slow <= 0 || disabled)
+        return;
+
+    load_exec("SAVEPOINT eclinic_explain");
+    saved = true;
+}
+
+bool explain_due(double elapsed_ms) {
+    if (load_options.explain_slow <= 0 || disabled || elapsed_ms <= load_options.explain_slow)
+        return false;
+
+    if (now_ms() < next_capture) {
+        num_skipped++;
+        return false;
+    }
+
+    capture_start = now_ms();
+    if (saved) {
+        load_exec("ROLLBACK TO SAVEPOINT eclinic_explain");
+    }
+    return true;
+}
+
+void explain_release(void) {
+    if (saved) {
+        load_exec("RELEASE SAVEPOINT eclinic_explain");
+        saved = false;
+    }
+
+    if (capture_start >= 0) {
+        double took = now_ms() - capture_start;
+        next_capture = now_ms() + (EXPLAIN_COST_FACTOR * took > EXPLAIN_MIN_GAP_MS
+                                       ? EXPLAIN_COST_FACTOR * took
+                                       : EXPLAIN_MIN_GAP_MS);
+        capture_start = -1;
+    }
+}
+
+// Append a captured plan to the explain file.
+static void save_plan(const LoadPlan *plan, const char *what, CsvRow **rows, size_t num_rows,
+                      double elapsed_ms) {
+    const char *path = load_options.explain_file;
+    FILE *f = fopen(path, "a");
+    if (!f) {
+        LOG_ERROR("unable to write %s: %s, no more plans are captured", path, strerror(errno));
+        disabled = true;
+        return;
+    }
+
+    // Deduplication and --order can spread a batch over lines that are not adjacent.
+    size_t first = SIZE_MAX, last = 0;
+    for (size_t i = 0; i < num_rows; i++) {
+        size_t line = line_of(rows[i]);
+        if (line && line < first) {
+            first = line;
+        }
+        if (line > last) {
+            last = line;
+        }
+    }
+
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm));
+
+    fprintf(f, "-- %s %s: %s of %zu row(s) took %.1f ms\n", stamp, plan->spec->table, what,
+            num_rows, elapsed_ms);
+    if (last > 0) {
+        fprintf(f, "-- %s lines %zu-%zu\n", current->path, first, last);
+    }
+    if (num_skipped > 0) {
+        fprintf(f, "-- %zu slow statement(s) not captured since the previous plan\n",
+                num_skipped);
+    }
+    for (int i = 0; i < PQntuples(res); i++) {
+        fprintf(f, "%s\n", PQgetvalue(res, i, 0));
+    }
+    fputc('\n', f);
+
+    if (fclose(f) != 0) {
+        LOG_ERROR("unable to write %s: %s, no more plans are captured", path, strerror(errno));
+        disabled = true;
+        return;
+    }
+
+    LOG_INFO("explain: %s %s took %.0f ms, plan saved to %s", plan->spec->table, what,
+             elapsed_ms, path);
+    num_skipped = 0;
+}
+
+void explain_capture(const LoadPlan *plan, const char *what, const char *sql, int nparams,
+                     const char *const *params, CsvRow **rows, size_t num_rows,
+                     double elapsed_ms) {
+    StrBuf explain;
+    sb_init(&explain, strlen(sql) + 64);
+    sb_appendf(&explain, "EXPLAIN (ANALYZE, BUFFERS, WAL) %s", sql);
+
+    // A failed EXPLAIN aborts only its savepoint, so the load carries on either way.
+    load_exec("SAVEPOINT eclinic_plan");
+    res = record_exec_params(conn, explain.data, nparams, params);
+    if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+        save_plan(plan, what, rows, num_rows, elapsed_ms);
+    } else {
+        LOG_ERROR("unable to explain a slow %s statement, no more plans are captured: %s",
+                  plan->spec->table, PQerrorMessage(conn));
+        disabled = true;
+    }
+    FreeResult();
+    load_exec("ROLLBACK TO SAVEPOINT eclinic_plan");
+    load_exec("RELEASE SAVEPOINT eclinic_plan");
+    sb_free(&explain);
+}
@@ -0,0 +1,395 @@
+#include "../include/export.h"
+#include "../include/strbuf.h"
+#include "../include/timing.h"
+#include <pthread.h>
+#include <string.h>
+
+#define EXPORT_MAX_JOBS 32
+#define EXPORT_SLICE_ROWS 100000 // Smallest estimated slice worth its own worker.
+
+ExportOptions export_options = {
+    .tables = "pricelist,invoices",
+    .output = ".",
+    .compress = "none",
+    .jobs = 1,
+};
+
+// Stream the result of query into path. Returns false, after logging why, if the query
+// or the file fails. Safe on worker threads: nothing here exits.
+static bool copy_to_file(PGconn *pg, const char *query, const char *path,
+                         Compression compression, size_t *rows) {
+    StrBuf sql;
+    sb_init(&sql, strlen(query) + 64);
+    sb_appendf(&sql, "COPY (%s) TO STDOUT (FORMAT csv, HEADER)", query);
+
+    // Results are local so that export workers can run this on their own connections.
+    PGresult *result = PQexec(pg, sql.data);
+    bool ok = PQresultStatus(result) == PGRES_COPY_OUT;
+    if (!ok) {
+        LOG_ERROR("%s: %s", sql.data, PQerrorMessage(pg));
+    }
+    PQclear(result);
+    sb_free(&sql);
+
+    FileSink *sink = ok ? sink_open(path, compression) : NULL;
+    if (!sink)
+        return false;
+
+    // Rows are handed to the writer thread as they arrive; nothing else is buffered.
+    char *row;
+    int len;
+    while ((len = PQgetCopyData(pg, &row, 0)) > 0) {
+        sink_write(sink, row, (size_t)len);
+        PQfreemem(row);
+    }
+
+    if (len == -2) {
+        LOG_ERROR("COPY to %s failed: %s", path, PQerrorMessage(pg));
+        ok = false;
+    } else {
+        result = PQgetResult(pg);
+        if (PQresultStatus(result) == PGRES_COMMAND_OK) {
+            *rows = strtoull(PQcmdTuples(result), NULL, 10);
+        } else {
+            LOG_ERROR("COPY to %s failed: %s", path, PQerrorMessage(pg));
+            ok = false;
+        }
+        PQclear(result);
+    }
+
+    size_t written;
+    return sink_close(sink, &written) && ok;
+}
+
+size_t export_query(PGconn *pg, const char *query, const char *path, Compression compression) {
+    size_t rows = 0;
+    if (!copy_to_file(pg, query, path, compression, &rows)) {
+        LOG_FATAL("unable to export to %s", path);
+    }
+    return rows;
+}
+
+// What an export name reads: a query without a WHERE clause and the table whose
+// integer primary key can split it into ranges, referenced as alias in the query.
+typedef struct {
+    char *query;
+    const char *table;
+    const char *alias;
+} ExportSource;
+
+static ExportSource export_source(const char *name) {
+    if (strcmp(name, "pricelist") == 0) {
+        return (ExportSource){strdup(pricelist_export_query), "inventory_items", "i"};
+    }
+
+    if (strcmp(name, "invoices") == 0) {
+        return (ExportSource){strdup(invoices_export_query), "invoices", "invoices"};
+    }
+
+    if (name[0] == '\0' || strspn(name, "abcdefghijklmnopqrstuvwxyz0123456789_.") != strlen(name)) {
+        LOG_FATAL("invalid table name: %s", name);
+    }
+
+    StrBuf sql;
+    sb_init(&sql, 64);
+    sb_appendf(&sql, "SELECT * FROM %s AS t", name);
+    return (ExportSource){sql.data, name, "t"};
+}
+
+// One output file.
+typedef struct {
+    char *name; // Export name, with the slice number for slices.
+    char *query;
+    char *path;
+} ExportTask;
+
+typedef struct {
+    ExportTask *tasks;
+    size_t num_tasks;
+    size_t cap;
+} TaskList;
+
+static void add_task(TaskList *list, char *name, char *query, Compression compression) {
+    if (list->num_tasks == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->tasks = realloc(list->tasks, list->cap * sizeof(ExportTask));
+        if (!list->tasks) {
+            LOG_FATAL("out of memory");
+        }
+    }
+
+    StrBuf path;
+    sb_init(&path, 256);
+    sb_appendf(&path, "%s/%s.csv%s", export_options.output, name,
+               compression_extension(compression));
+    list->tasks[list->num_tasks++] = (ExportTask){name, query, path.data};
+}
+
+// Integer primary key range of a table and its estimated size. Returns false if the
+// table has no single-column integer primary key.
+typedef struct {
+    char *column;
+    long long min;
+    long long max;
+    double rows;
+} KeyRange;
+
+static bool primary_key_range(const char *table, KeyRange *range) {
+    const char *query =
+        "SELECT a.attname, c.reltuples FROM pg_index x "
+        "JOIN pg_attribute a ON a.attrelid = x.indrelid AND a.attnum = x.indkey[0] "
+        "JOIN pg_class c ON c.oid = x.indrelid "
+        "WHERE x.indrelid = $1::regclass AND x.indisprimary AND x.indnatts = 1 "
+        "AND a.atttypid IN ('int2'::regtype, 'int4'::regtype, 'int8'::regtype)";
+
+    const char *const paramValues[1] = {table};
+    res = PQexecParams(conn, query, 1, NULL, paramValues, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("unable to read primary key of %s: %s", table, PQerrorMessage(conn));
+    }
+
+    if (PQntuples(res) != 1) {
+        FreeResult();
+        return false;
+    }
+
+    range->column = strdup(PQgetvalue(res, 0, 0));
+    range->rows = strtod(PQgetvalue(res, 0, 1), NULL);
+    FreeResult();
+
+    StrBuf sql;
+    sb_init(&sql, 128);
+    sb_appendf(&sql, "SELECT min(%s), max(%s) FROM %s", range->column, range->column, table);
+    res = PQexec(conn, sql.data);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("%s: %s", sql.data, PQerrorMessage(conn));
+    }
+
+    bool empty = PQgetisnull(res, 0, 0);
+    if (!empty) {
+        range->min = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+        range->max = strtoll(PQgetvalue(res, 0, 1), NULL, 10);
+    }
+    FreeResult();
+    sb_free(&sql);
+
+    if (empty) {
+        free(range->column);
+    }
+    return !empty;
+}
+
+// Add the tasks of one export name: a single file, or with jobs > 1 and a large
+// table one file per primary key slice.
+static void plan_export(TaskList *list, const char *name, int jobs, Compression compression) {
+    ExportSource source = export_source(name);
+
+    KeyRange range;
+    size_t slices = 1;
+    if (jobs > 1 && primary_key_range(source.table, &range)) {
+        slices = (size_t)(range.rows / EXPORT_SLICE_ROWS);
+        if (slices > (size_t)jobs) {
+            slices = (size_t)jobs;
+        }
+
+        if (slices < 2) {
+            slices = 1;
+            free(range.column);
+        }
+    }
+
+    if (slices == 1) {
+        add_task(list, strdup(name), source.query, compression);
+        return;
+    }
+
+    // Equal-width key ranges; the first and last are open so that nothing escapes.
+    unsigned long long step = ((unsigned long long)range.max - (unsigned long long)range.min) /
+                                  slices +
+                              1;
+    for (size_t i = 0; i < slices; i++) {
+        long long lo = range.min + (long long)(step * i);
+        long long hi = range.min + (long long)(step * (i + 1));
+
+        StrBuf query, slice;
+        sb_init(&query, strlen(source.query) + 128);
+        sb_init(&slice, 64);
+        sb_append(&query, source.query);
+        if (i == 0) {
+            sb_appendf(&query, " WHERE %s.%s < %lld", source.alias, range.column, hi);
+        } else if (i + 1 == slices) {
+            sb_appendf(&query, " WHERE %s.%s >= %lld", source.alias, range.column, lo);
+        } else {
+            sb_appendf(&query, " WHERE %s.%s >= %lld AND %s.%s < %lld", source.alias, range.column,
+                       lo, source.alias, range.column, hi);
+        }
+        sb_appendf(&slice, "%s.%03zu", name, i + 1);
+        add_task(list, slice.data, query.data, compression);
+    }
+
+    free(range.column);
+    free(source.query);
+}
+
+static bool run_task(PGconn *pg, const ExportTask *task, Compression compression) {
+    double start = now_ms();
+    size_t rows = 0;
+    if (!copy_to_file(pg, task->query, task->path, compression, &rows))
+        return false;
+
+    LOG_INFO("Exported %zu row(s) of %s to %s in %.1f ms", rows, task->name, task->path,
+             now_ms() - start);
+    return true;
+}
+
+// Shared by the export workers.
+typedef struct {
+    const TaskList *list;
+    Compression compression;
+    size_t next; // Next task to run.
+    bool failed; // A task failed, so no more are started.
+    pthread_mutex_t lock;
+} ExportQueue;
+
+typedef struct {
+    ExportQueue *queue;
+    PGconn *pg; // In the coordinator's snapshot before the thread starts.
+} ExportWorker;
+
+// Main thread only: failures are fatal.
+static void worker_exec(PGconn *pg, const char *sql) {
+    PGresult *result = PQexec(pg, sql);
+    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+        LOG_FATAL("%s: %s", sql, PQerrorMessage(pg));
+    }
+    PQclear(result);
+}
+
+// Run tasks until none are left or one fails. Returns the failed task, NULL if none.
+// Workers never exit the process: the main thread reports failures once all joined.
+static void *export_worker(void *arg) {
+    ExportWorker *worker = arg;
+    ExportQueue *queue = worker->queue;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        size_t i = queue->next++;
+        bool stop = queue->failed;
+        pthread_mutex_unlock(&queue->lock);
+        if (stop || i >= queue->list->num_tasks)
+            return NULL;
+
+        const ExportTask *task = &queue->list->tasks[i];
+        if (!run_task(worker->pg, task, queue->compression)) {
+            pthread_mutex_lock(&queue->lock);
+            queue->failed = true;
+            pthread_mutex_unlock(&queue->lock);
+            return (void *)task;
+        }
+    }
+}
+
+void export_tables(Subcommand *cmd) {
+    (void)cmd;
+
+    int jobs = export_options.jobs;
+    if (jobs <= 0 || jobs > EXPORT_MAX_JOBS) {
+        LOG_FATAL("--jobs must be between 1 and %d, got %d", EXPORT_MAX_JOBS, jobs);
+    }
+
+    Compression compression = compression_parse(export_options.compress, NULL);
+    char *tables = strdup(export_options.tables);
+    if (!tables) {
+        LOG_FATAL("out of memory");
+    }
+
+    // One snapshot for every file, so pricelist and invoices agree with each other.
+    load_exec("BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY");
+    load_exec("SET LOCAL DateStyle = ISO, YMD");
+
+    TaskList list = {0};
+    char *saveptr = NULL;
+    for (char *name = strtok_r(tables, ",", &saveptr); name;
+         name = strtok_r(NULL, ",", &saveptr)) {
+        plan_export(&list, name, jobs, compression);
+    }
+
+    double start = now_ms();
+    if (jobs == 1) {
+        for (size_t i = 0; i < list.num_tasks; i++) {
+            if (!run_task(conn, &list.tasks[i], compression)) {
+                LOG_FATAL("export of %s failed", list.tasks[i].name);
+            }
+        }
+    } else {
+        // The snapshot stays importable while this transaction is open.
+        res = PQexec(conn, "SELECT pg_export_snapshot()");
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            LOG_FATAL("unable to export snapshot: %s", PQerrorMessage(conn));
+        }
+        char *snapshot = strdup(PQgetvalue(res, 0, 0));
+        FreeResult();
+
+        ExportQueue queue = {.list = &list, .compression = compression};
+        pthread_mutex_init(&queue.lock, NULL);
+
+        // Connections are opened and set up here so that their errors can stop the run.
+        // Importing the coordinator's snapshot makes every worker see the same data.
+        size_t nworkers = (size_t)jobs < list.num_tasks ? (size_t)jobs : list.num_tasks;
+        ExportWorker workers[EXPORT_MAX_JOBS];
+        char sql[128];
+        snprintf(sql, sizeof(sql), "SET TRANSACTION SNAPSHOT '%s'", snapshot);
+        for (size_t i = 0; i < nworkers; i++) {
+            workers[i] = (ExportWorker){.queue = &queue, .pg = open_connection()};
+            worker_exec(workers[i].pg, "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY");
+            worker_exec(workers[i].pg, sql);
+            worker_exec(workers[i].pg, "SET LOCAL DateStyle = ISO, YMD");
+        }
+
+        pthread_t threads[EXPORT_MAX_JOBS];
+        size_t started = 0;
+        while (started < nworkers &&
+               pthread_create(&threads[started], NULL, export_worker, &workers[started]) == 0) {
+            started++;
+        }
+        if (started < nworkers) {
+            LOG_ERROR("unable to start export worker");
+            pthread_mutex_lock(&queue.lock);
+            queue.failed = true;
+            pthread_mutex_unlock(&queue.lock);
+        }
+
+        size_t failed = 0;
+        for (size_t i = 0; i < started; i++) {
+            void *task;
+            pthread_join(threads[i], &task);
+            if (task) {
+                LOG_ERROR("export of %s failed", ((const ExportTask *)task)->name);
+                failed++;
+            }
+        }
+
+        // The transactions are read only: closing a connection ends its own.
+        for (size_t i = 0; i < nworkers; i++) {
+            PQfinish(workers[i].pg);
+        }
+        pthread_mutex_destroy(&queue.lock);
+        free(snapshot);
+
+        if (queue.failed) {
+            LOG_FATAL("export stopped after %zu failed task(s)", failed);
+        }
+    }
+
+    load_exec("COMMIT");
+    LOG_INFO("Exported %zu file(s) in %.1f ms with %d connection(s)", list.num_tasks,
+             now_ms() - start, jobs);
+
+    for (size_t i = 0; i < list.num_tasks; i++) {
+        free(list.tasks[i].name);
+        free(list.tasks[i].query);
+        free(list.tasks[i].path);
+    }
+    free(list.tasks);
+    free(tables);
+}
@@ -0,0 +1,663 @@
+#include "../include/fakepg.h"
+#include "../include/strbuf.h"
+#include "../include/timing.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+int fakepg_port = 54329;
+
+#define FAKEPG_PROTOCOL 196608 // 3.0
+#define FAKEPG_SSL_REQUEST 80877103
+#define FAKEPG_GSS_REQUEST 80877104
+#define FAKEPG_READ_SIZE (1 << 16)
+#define FAKEPG_FLUSH_SIZE (1 << 16) // Responses are sent at Sync, Flush or this size.
+#define FAKEPG_MAX_MESSAGE (1 << 30)
+
+// What a statement returns.
+typedef enum {
+    RESULT_NONE,   // A command: only its tag.
+    RESULT_COUNTS, // Load upsert: one (inserted, updated) row.
+    RESULT_TYPE,   // Column type lookup: one text row.
+    RESULT_EMPTY,  // Any other query: one text column, no rows.
+} ResultKind;
+
+typedef struct {
+    char *name;
+    char *sql;
+    int nparams;
+} Statement;
+
+typedef struct {
+    int fd;
+    char *in;
+    size_t in_len;
+    size_t in_pos;
+    size_t in_cap;
+    StrBuf out;
+
+    Statement *statements;
+    size_t num_statements;
+    size_t portal;      // Index of the statement bound to the portal.
+    bool bound;         // A statement is bound.
+    size_t portal_rows; // Rows in the bound parameters.
+
+    bool in_transaction;
+    bool skip_to_sync; // An extended query failed: ignore messages until Sync.
+    bool in_copy;
+    bool copy_quoted; // Inside a quoted CSV field across CopyData messages.
+    size_t copy_rows;
+    size_t staged_rows; // Rows copied since the last upsert read them.
+
+    size_t rows; // Rows reported as loaded.
+    size_t statements_run;
+    size_t bytes;
+    double started;
+} Session;
+
+// ======================= Wire helpers =======================
+
+static void put_int16(StrBuf *sb, int v) {
+    uint16_t n = htons((uint16_t)v);
+    sb_appendn(sb, (const char *)&n, 2);
+}
+
+static void put_int32(StrBuf *sb, int32_t v) {
+    uint32_t n = htonl((uint32_t)v);
+    sb_appendn(sb, (const char *)&n, 4);
+}
+
+static void put_string(StrBuf *sb, const char *s) {
+    sb_appendn(sb, s, strlen(s) + 1);
+}
+
+// Start a message; msg_end fills in its length.
+static size_t msg_begin(StrBuf *sb, char type) {
+    sb_putc(sb, type);
+    size_t at = sb->len;
+    put_int32(sb, 0);
+    return at;
+}
+
+static void msg_end(StrBuf *sb, size_t at) {
+    uint32_t n = htonl((uint32_t)(sb->len - at));
+    memcpy(sb->data + at, &n, 4);
+}
+
+static int32_t get_int32(const char *p) {
+    uint32_t n;
+    memcpy(&n, p, 4);
+    return (int32_t)ntohl(n);
+}
+
+static int get_int16(const char *p) {
+    uint16_t n;
+    memcpy(&n, p, 2);
+    return (int16_t)ntohs(n);
+}
+
+static bool session_flush(Session *s) {
+    size_t sent = 0;
+    while (sent < s->out.len) {
+        ssize_t n = send(s->fd, s->out.data + sent, s->out.len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += (size_t)n;
+    }
+    sb_reset(&s->out);
+    return true;
+}
+
+// Make len bytes available at in + in_pos, with one spare byte after them.
+// Returns false when the client is gone.
+static bool session_fill(Session *s, size_t len) {
+    if (s->in_len - s->in_pos >= len)
+        return true;
+
+    // Replies must go out before waiting for more input, or both sides wait.
+    if (s->out.len > 0 && !session_flush(s))
+        return false;
+
+    memmove(s->in, s->in + s->in_pos, s->in_len - s->in_pos);
+    s->in_len -= s->in_pos;
+    s->in_pos = 0;
+
+    if (len + 1 > s->in_cap) {
+        s->in_cap = len + 1 > s->in_cap * 2 ? len + 1 : s->in_cap * 2;
+        s->in = realloc(s->in, s->in_cap);
+        if (!s->in) {
+            LOG_FATAL("out of memory");
+        }
+    }
+
+    while (s->in_len < len) {
+        ssize_t n = recv(s->fd, s->in + s->in_len, s->in_cap - s->in_len - 1, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        s->in_len += (size_t)n;
+        s->bytes += (size_t)n;
+    }
+    return true;
+}
+
+static void send_error(Session *s, const char *code, const char *message) {
+    size_t at = msg_begin(&s->out, 'E');
+    sb_putc(&s->out, 'S');
+    put_string(&s->out, "ERROR");
+    sb_putc(&s->out, 'V');
+    put_string(&s->out, "ERROR");
+    sb_putc(&s->out, 'C');
+    put_string(&s->out, code);
+    sb_putc(&s->out, 'M');
+    put_string(&s->out, message);
+    sb_putc(&s->out, '\0');
+    msg_end(&s->out, at);
+}
+
+static void send_ready(Session *s) {
+    size_t at = msg_begin(&s->out, 'Z');
+    sb_putc(&s->out, s->in_transaction ? 'T' : 'I');
+    msg_end(&s->out, at);
+}
+
+static void send_empty(Session *s, char type) {
+    msg_end(&s->out, msg_begin(&s->out, type));
+}
+
+static void send_parameter(Session *s, const char *name, const char *value) {
+    size_t at = msg_begin(&s->out, 'S');
+    put_string(&s->out, name);
+    put_string(&s->out, value);
+    msg_end(&s->out, at);
+}
+
+// ======================= Statements =======================
+
+static const char *skip_space(const char *sql) {
+    while (isspace((unsigned char)*sql) || *sql == '(') {
+        sql++;
+    }
+    return sql;
+}
+
+static bool starts_with_word(const char *sql, const char *word) {
+    size_t n = strlen(word);
+    return strncasecmp(sql, word, n) == 0 && !isalnum((unsigned char)sql[n]) && sql[n] != '_';
+}
+
+// A whole transaction rolled back, not just to a savepoint.
+static bool rolls_back(const char *sql) {
+    return starts_with_word(sql, "ROLLBACK") && !starts_with_word(skip_space(sql + 8), "TO");
+}
+
+static ResultKind classify(const char *sql) {
+    if (strstr(sql, "FILTER (WHERE inserted)"))
+        return RESULT_COUNTS;
+    if (strstr(sql, "format_type("))
+        return RESULT_TYPE;
+
+    sql = skip_space(sql);
+    if (starts_with_word(sql, "SELECT") || starts_with_word(sql, "WITH") ||
+        starts_with_word(sql, "SHOW") || starts_with_word(sql, "VALUES"))
+        return RESULT_EMPTY;
+    return RESULT_NONE;
+}
+
+// Elements of a text[] literal, i.e. the rows of a batch upsert.
+static size_t array_length(const char *p, size_t len) {
+    if (len < 2 || p[0] != '{' || (len == 2 && p[1] == '}'))
+        return 0;
+
+    size_t count = 1;
+    bool quoted = false;
+    for (size_t i = 1; i + 1 < len; i++) {
+        if (p[i] == '\\' && quoted) {
+            i++;
+        } else if (p[i] == '"') {
+            quoted = !quoted;
+        } else if (p[i] == ',' && !quoted) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Result column: name, type oid and size.
+typedef struct {
+    const char *name;
+    int32_t type;
+    int size;
+} Field;
+
+static const Field count_fields[] = {{"inserted", 20, 8}, {"updated", 20, 8}};
+static const Field type_fields[] = {{"format_type", 25, -1}};
+static const Field query_fields[] = {{"?column?", 25, -1}};
+
+static void send_row_description(Session *s, ResultKind kind) {
+    if (kind == RESULT_NONE) {
+        send_empty(s, 'n'); // NoData
+        return;
+    }
+
+    const Field *fields = kind == RESULT_COUNTS ? count_fields
+                          : kind == RESULT_TYPE ? type_fields
+                                                : query_fields;
+    int nfields = kind == RESULT_COUNTS ? 2 : 1;
+
+    size_t at = msg_begin(&s->out, 'T');
+    put_int16(&s->out, nfields);
+    for (int i = 0; i < nfields; i++) {
+        put_string(&s->out, fields[i].name);
+        put_int32(&s->out, 0); // Table.
+        put_int16(&s->out, 0); // Column number.
+        put_int32(&s->out, fields[i].type);
+        put_int16(&s->out, fields[i].size);
+        put_int32(&s->out, -1); // Type modifier.
+        put_int16(&s->out, 0);  // Text format.
+    }
+    msg_end(&s->out, at);
+}
+
+static void send_data_row(Session *s, const char *const *values, int n) {
+    size_t at = msg_begin(&s->out, 'D');
+    put_int16(&s->out, n);
+    for (int i = 0; i < n; i++) {
+        put_int32(&s->out, (int32_t)strlen(values[i]));
+        sb_append(&s->out, values[i]);
+    }
+    msg_end(&s->out, at);
+}
+
+static void send_complete(Session *s, const char *tag) {
+    size_t at = msg_begin(&s->out, 'C');
+    put_string(&s->out, tag);
+    msg_end(&s->out, at);
+}
+
+// Rows and command tag of running sql, loading rows rows.
+static void run_statement(Session *s, const char *sql, size_t rows) {
+    s->statements_run++;
+
+    char tag[64];
+    switch (classify(sql)) {
+    case RESULT_COUNTS: {
+        char inserted[24];
+        snprintf(inserted, sizeof(inserted), "%zu", rows);
+        send_data_row(s, (const char *const[]){inserted, "0"}, 2);
+        send_complete(s, "SELECT 1");
+        s->rows += rows;
+        return;
+    }
+    case RESULT_TYPE:
+        send_data_row(s, (const char *const[]){"text"}, 1);
+        send_complete(s, "SELECT 1");
+        return;
+    case RESULT_EMPTY:
+        send_complete(s, "SELECT 0");
+        return;
+    case RESULT_NONE:
+        break;
+    }
+
+    // Tag from the first word: libpq only reads the counts of INSERT, UPDATE and DELETE.
+    const char *p = skip_space(sql);
+    size_t n = 0;
+    while (isalpha((unsigned char)p[n]) && n < 31) {
+        tag[n] = (char)toupper((unsigned char)p[n]);
+        n++;
+    }
+    tag[n] = '\0';
+
+    if (strcmp(tag, "BEGIN") == 0 || strcmp(tag, "START") == 0) {
+        s->in_transaction = true;
+    } else if (strcmp(tag, "COMMIT") == 0 || strcmp(tag, "END") == 0 || rolls_back(p)) {
+        s->in_transaction = false;
+    }
+
+    if (strcmp(tag, "INSERT") == 0) {
+        snprintf(tag, sizeof(tag), "INSERT 0 0");
+    } else if (strcmp(tag, "UPDATE") == 0 || strcmp(tag, "DELETE") == 0) {
+        strcat(tag, " 0");
+    }
+    send_complete(s, tag);
+}
+
+static void simple_query(Session *s, const char *sql) {
+    const char *p = skip_space(sql);
+    if (*p == '\0' || *p == ';') {
+        send_empty(s, 'I');
+    } else if (starts_with_word(p, "COPY") && strcasestr(p, "FROM STDIN")) {
+        size_t at = msg_begin(&s->out, 'G');
+        sb_putc(&s->out, 0);
+        put_int16(&s->out, 0);
+        msg_end(&s->out, at);
+        s->in_copy = true;
+        s->copy_rows = 0;
+        s->copy_quoted = false;
+        return; // Ready again after CopyDone.
+    } else {
+        if (classify(p) != RESULT_NONE) {
+            send_row_description(s, classify(p));
+        }
+
+        // An upsert from a staging table reads the rows copied into it.
+        run_statement(s, p, s->staged_rows);
+        // Rows copied into a table that is dropped or rolled back are never read. Loads
+        // take savepoints after the COPY, so rolling back to one keeps them.
+        if (classify(p) == RESULT_COUNTS || starts_with_word(p, "DROP") || rolls_back(p)) {
+            s->staged_rows = 0;
+        }
+    }
+    send_ready(s);
+}
+
+static Statement *find_statement(Session *s, const char *name) {
+    for (size_t i = 0; i < s->num_statements; i++) {
+        if (strcmp(s->statements[i].name, name) == 0)
+            return &s->statements[i];
+    }
+    return NULL;
+}
+
+static void parse_message(Session *s, const char *body) {
+    const char *name = body;
+    const char *sql = name + strlen(name) + 1;
+    int nparams = get_int16(sql + strlen(sql) + 1);
+
+    Statement *st = find_statement(s, name);
+    if (!st) {
+        s->statements = realloc(s->statements, (s->num_statements + 1) * sizeof(Statement));
+        if (!s->statements) {
+            LOG_FATAL("out of memory");
+        }
+        st = &s->statements[s->num_statements++];
+        st->name = strdup(name);
+    } else {
+        free(st->sql);
+    }
+    st->sql = strdup(sql);
+    st->nparams = nparams;
+    send_empty(s, '1');
+}
+
+static void bind_message(Session *s, const char *body) {
+    const char *portal = body;
+    const char *name = portal + strlen(portal) + 1;
+    const char *p = name + strlen(name) + 1;
+
+    Statement *st = find_statement(s, name);
+    if (!st) {
+        send_error(s, "26000", "prepared statement does not exist");
+        s->skip_to_sync = true;
+        return;
+    }
+
+    int nformats = get_int16(p);
+    p += 2 + 2 * nformats;
+    int nparams = get_int16(p);
+    p += 2;
+
+    // A batch upsert sends each column as an array, a row upsert one value per column.
+    size_t rows = 1;
+    if (nparams > 0 && strstr(st->sql, "unnest(")) {
+        int32_t len = get_int32(p);
+        rows = len > 0 ? array_length(p + 4, (size_t)len) : 0;
+    }
+
+    s->portal = (size_t)(st - s->statements);
+    s->bound = true;
+    s->portal_rows = rows;
+    send_empty(s, '2');
+}
+
+static void describe_message(Session *s, const char *body) {
+    if (body[0] == 'S') {
+        Statement *st = find_statement(s, body + 1);
+        if (!st) {
+            send_error(s, "26000", "prepared statement does not exist");
+            s->skip_to_sync = true;
+            return;
+        }
+
+        size_t at = msg_begin(&s->out, 't');
+        put_int16(&s->out, st->nparams);
+        for (int i = 0; i < st->nparams; i++) {
+            put_int32(&s->out, 25);
+        }
+        msg_end(&s->out, at);
+        send_row_description(s, classify(st->sql));
+        return;
+    }
+
+    send_row_description(s, s->bound ? classify(s->statements[s->portal].sql) : RESULT_NONE);
+}
+
+static void execute_message(Session *s) {
+    if (!s->bound) {
+        send_error(s, "34000", "portal does not exist");
+        s->skip_to_sync = true;
+        return;
+    }
+    run_statement(s, s->statements[s->portal].sql, s->portal_rows);
+}
+
+// Count the CSV records of a CopyData message; quoted fields may hold line breaks.
+static void copy_data(Session *s, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == '"') {
+            s->copy_quoted = !s->copy_quoted;
+        } else if (data[i] == '\n' && !s->copy_quoted) {
+            s->copy_rows++;
+        }
+    }
+}
+
+// ======================= Sessions =======================
+
+// Startup packets have no type byte. Returns false if the client is not starting a session.
+static bool session_startup(Session *s) {
+    for (;;) {
+        if (!session_fill(s, 4))
+            return false;
+
+        int32_t len = get_int32(s->in + s->in_pos);
+        if (len < 8 || len > 10000 || !session_fill(s, (size_t)len))
+            return false;
+
+        int32_t code = get_int32(s->in + s->in_pos + 4);
+        s->in_pos += (size_t)len;
+
+        if (code == FAKEPG_SSL_REQUEST || code == FAKEPG_GSS_REQUEST) {
+            sb_putc(&s->out, 'N'); // Not supported, continue in plain text.
+            if (!session_flush(s))
+                return false;
+            continue;
+        }
+
+        if (code != FAKEPG_PROTOCOL)
+            return false; // Cancel requests and unknown protocols.
+        break;
+    }
+
+    size_t at = msg_begin(&s->out, 'R');
+    put_int32(&s->out, 0); // AuthenticationOk.
+    msg_end(&s->out, at);
+
+    send_parameter(s, "server_version", "16.0");
+    send_parameter(s, "server_encoding", "UTF8");
+    send_parameter(s, "client_encoding", "UTF8");
+    send_parameter(s, "DateStyle", "ISO, MDY");
+    send_parameter(s, "integer_datetimes", "on");
+    send_parameter(s, "standard_conforming_strings", "on");
+    send_parameter(s, "TimeZone", "UTC");
+
+    at = msg_begin(&s->out, 'K');
+    put_int32(&s->out, (int32_t)getpid());
+    put_int32(&s->out, 0);
+    msg_end(&s->out, at);
+
+    send_ready(s);
+    return session_flush(s);
+}
+
+static void session_run(Session *s) {
+    if (!session_startup(s))
+        return;
+
+    for (;;) {
+        if (!session_fill(s, 5))
+            return;
+
+        char type = s->in[s->in_pos];
+        int32_t len = get_int32(s->in + s->in_pos + 1);
+        if (len < 4 || len > FAKEPG_MAX_MESSAGE || !session_fill(s, (size_t)len + 1))
+            return;
+
+        // Bodies are NUL-terminated for the string parsing above. The byte after a
+        // message is the next message's type or the spare byte, restored afterwards.
+        char *body = s->in + s->in_pos + 5;
+        size_t body_len = (size_t)len - 4;
+        char *end = body + body_len;
+        char saved = *end;
+        *end = '\0';
+
+        if (s->in_copy) {
+            if (type == 'd') {
+                copy_data(s, body, body_len);
+            } else if (type == 'c') {
+                char tag[32];
+                snprintf(tag, sizeof(tag), "COPY %zu", s->copy_rows);
+                s->staged_rows += s->copy_rows;
+                s->in_copy = false;
+                send_complete(s, tag);
+                send_ready(s);
+            } else if (type == 'f') {
+                s->in_copy = false;
+                send_error(s, "57014", "COPY from stdin failed");
+                send_ready(s);
+            }
+        } else if (type == 'X') {
+            return;
+        } else if (type == 'S') {
+            s->skip_to_sync = false;
+            send_ready(s);
+            if (!session_flush(s))
+                return;
+        } else if (type == 'H') {
+            if (!session_flush(s))
+                return;
+        } else if (type == 'Q') {
+            simple_query(s, body);
+        } else if (s->skip_to_sync) {
+            // Discarded until Sync, as a server does after an error.
+        } else if (type == 'P') {
+            parse_message(s, body);
+        } else if (type == 'B') {
+            bind_message(s, body);
+        } else if (type == 'D') {
+            describe_message(s, body);
+        } else if (type == 'E') {
+            execute_message(s);
+        } else if (type == 'C') {
+            send_empty(s, '3');
+        } else {
+            send_error(s, "0A000", "message type not supported by the fake server");
+            s->skip_to_sync = true;
+        }
+
+        *end = saved;
+        s->in_pos += 1 + (size_t)len;
+
+        if (s->out.len >= FAKEPG_FLUSH_SIZE && !session_flush(s))
+            return;
+    }
+}
+
+static void *session_thread(void *arg) {
+    Session *s = arg;
+    s->started = now_ms();
+    s->in_cap = FAKEPG_READ_SIZE;
+    s->in = malloc(s->in_cap);
+    sb_init(&s->out, FAKEPG_FLUSH_SIZE);
+    if (!s->in) {
+        LOG_FATAL("out of memory");
+    }
+
+    session_run(s);
+    close(s->fd);
+
+    double seconds = (now_ms() - s->started) / 1e3;
+    LOG_INFO("fakepg: session closed after %.2f s: %zu row(s) (%.0f rows/s), %zu statement(s), "
+             "%.1f MB received",
+             seconds, s->rows, seconds > 0 ? s->rows / seconds : 0.0, s->statements_run,
+             s->bytes / 1048576.0);
+    fflush(stdout);
+
+    for (size_t i = 0; i < s->num_statements; i++) {
+        free(s->statements[i].name);
+        free(s->statements[i].sql);
+    }
+    free(s->statements);
+    sb_free(&s->out);
+    free(s->in);
+    free(s);
+    return NULL;
+}
+
+void fakepg_serve(Subcommand *cmd) {
+    (void)cmd;
+    if (fakepg_port <= 0 || fakepg_port > 65535) {
+        LOG_FATAL("invalid port %d", fakepg_port);
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        LOG_FATAL("socket: %s", strerror(errno));
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons((uint16_t)fakepg_port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        LOG_FATAL("unable to listen on 127.0.0.1:%d: %s", fakepg_port, strerror(errno));
+    }
+    LOG_INFO("fakepg: listening on 127.0.0.1:%d", fakepg_port);
+    fflush(stdout);
+
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_FATAL("accept: %s", strerror(errno));
+        }
+
+        Session *s = calloc(1, sizeof(Session));
+        if (!s) {
+            LOG_FATAL("out of memory");
+        }
+        s->fd = client;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, session_thread, s) != 0) {
+            LOG_FATAL("unable to start a session thread");
+        }
+        pthread_detach(thread);
+    }
+}
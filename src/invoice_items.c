@@ -0,0 +1,68 @@
+#include "../include/loader.h"
+
+char *invoice_lines_file = NULL;
+
+/*
+Line items, either in their own file next to the invoices file:
+invoice_no,item,type,quantity,unit_cost
+INV-001,Inj Ceftriaxone 1g,Investigation,100,2500
+
+or appended to the invoice columns, repeating the invoice on every line:
+invoice_no,purchase_date,invoice_total,amount_paid,supplier,cashier,item,type,quantity,unit_cost
+
+Invoice numbers and item names are mapped to ids by joins over the whole staged file.
+Requires a unique index on invoice_items (invoice_id, item_id).
+*/
+static const ColumnMap line_columns[] = {
+    {.column = "invoice_no",
+     .header = "invoice_no",
+     .input_only = true,
+     .type = "invoices.invoice_no%TYPE"},
+    {.column = "item", .header = "item", .input_only = true, .type = "inventory_items.name%TYPE"},
+    {.column = "type", .header = "type", .input_only = true, .type = "inventory_items.type%TYPE"},
+    {.column = "invoice_id", .expr = "v.id"},
+    {.column = "item_id", .expr = "i.id"},
+    {.column = "quantity", .header = "quantity"},
+    {.column = "unit_cost", .header = "unit_cost"},
+};
+
+// Lines are never updated, so a reloaded file adds no stock twice.
+// Lines of unknown invoices or items fail the load on the NOT NULL ids.
+static const LoadSpec lines_spec = {
+    .name = "invoice_items",
+    .table = "invoice_items",
+    .columns = line_columns,
+    .num_columns = sizeof(line_columns) / sizeof(line_columns[0]),
+    .conflict_key = (const char *const[]){"invoice_id", "item_id", NULL},
+    .joins = "LEFT JOIN invoices v ON v.invoice_no = s.invoice_no "
+             "LEFT JOIN inventory_items i ON i.name = s.item AND i.type = s.type",
+    .client_key = (const char *const[]){"invoice_no", "item", "type", NULL},
+    .returning = (const char *const[]){"item_id", "quantity", NULL},
+    .after = "UPDATE inventory_items i SET quantity = i.quantity + d.quantity "
+             "FROM (SELECT item_id, sum(quantity) AS quantity FROM w WHERE inserted "
+             "GROUP BY item_id) d WHERE i.id = d.item_id",
+};
+
+static const LoadSpec *const lines_specs[] = {&lines_spec, NULL};
+
+// Subcommand for uploading invoices with their line items.
+// Always staged with COPY: each table is loaded by one set-based statement.
+void upload_invoice_items_csv(Subcommand *cmd) {
+    (void)cmd;
+    load_options.strategy = "copy";
+
+    if (invoice_lines_file) {
+        const LoadSource sources[] = {
+            {.path = filename, .specs = invoices_specs, .num_specs = 1},
+            {.path = invoice_lines_file, .specs = lines_specs, .num_specs = 1},
+        };
+        load_sources("invoice-items", sources, 2);
+        return;
+    }
+
+    // Both specs read the combined file. The invoice columns come first.
+    LoadSpec headers = *invoices_specs[0];
+    headers.expected_fields = 10;
+    const LoadSpec *const specs[] = {&headers, &lines_spec};
+    load_csv("invoice-items", filename, specs, 2);
+}
@@ -0,0 +1,255 @@
+#include "../include/ledger.h"
+#include "../include/hash.h"
+#include "../include/record.h"
+#include "../include/strbuf.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Gear-hash content-defined chunking: a boundary is declared where the rolling hash
+// has the CHUNK_MASK bits clear, then moved forward to the end of the current record so
+// chunks map onto whole rows. Boundaries depend only on nearby content, so appending
+// to or editing a file only changes the chunks around the change.
+#define CHUNK_MIN (16 << 10)
+#define CHUNK_MAX (256 << 10)
+#define CHUNK_MASK 0xffff000000000000ull // Top 16 bits: ~64KB average over a 64 byte window.
+
+static uint64_t gear[256];
+
+// The gear table must never change or every recorded chunk hash goes stale.
+static void gear_init(void) {
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+static void ensure_ledger_table(void) {
+    load_exec("CREATE TABLE IF NOT EXISTS eclinic_load_ledger ("
+              "subcommand text NOT NULL, "
+              "target_table text NOT NULL, "
+              "kind char(1) NOT NULL, " // f: whole file, c: chunk
+              "hash bigint NOT NULL, "
+              "rows integer NOT NULL, "
+              "loaded_at timestamptz NOT NULL DEFAULT now(), "
+              "PRIMARY KEY (subcommand, target_table, kind, hash))");
+}
+
+// Split data into chunks ending on record boundaries (newlines outside quotes).
+static void chunk_file(Ledger *ledger, const uint8_t *data, size_t size) {
+    gear_init();
+
+    size_t cap = size / CHUNK_MIN + 2;
+    ledger->chunks = calloc(cap, sizeof(LedgerChunk));
+    if (!ledger->chunks) {
+        LOG_FATAL("out of memory");
+    }
+
+    bool in_quotes = false, header = true, boundary = false;
+    size_t start = 0, records = 0;
+    uint64_t h = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        uint8_t c = data[i];
+        h = (h << 1) + gear[c];
+        if (i + 1 - start >= CHUNK_MIN && (h & CHUNK_MASK) == 0) {
+            boundary = true;
+        }
+
+        if (c == '"') {
+            in_quotes = !in_quotes;
+        }
+
+        bool record_end = (c == '\n' && !in_quotes) || i + 1 == size;
+        if (!record_end)
+            continue;
+
+        if (header) {
+            header = false; // The header row is hashed with the first chunk.
+        } else {
+            records++;
+        }
+
+        size_t len = i + 1 - start;
+        if ((boundary || len >= CHUNK_MAX || i + 1 == size) && ledger->num_chunks < cap) {
+            LedgerChunk *chunk = &ledger->chunks[ledger->num_chunks++];
+            chunk->offset = start;
+            chunk->length = len;
+            chunk->hash = hash64(data + start, len, 0);
+            chunk->first_row = ledger->num_rows;
+            chunk->num_rows = records;
+            ledger->num_rows += records;
+            records = 0;
+            start = i + 1;
+            boundary = false;
+        }
+    }
+}
+
+// Mark chunks already recorded for this subcommand and tables.
+static void mark_loaded_chunks(Ledger *ledger) {
+    if (ledger->num_chunks == 0)
+        return;
+
+    StrBuf hashes;
+    sb_init(&hashes, ledger->num_chunks * 21 + 2);
+    sb_putc(&hashes, '{');
+    for (size_t i = 0; i < ledger->num_chunks; i++) {
+        sb_appendf(&hashes, "%s%lld", i ? "," : "", (long long)ledger->chunks[i].hash);
+    }
+    sb_putc(&hashes, '}');
+
+    const char *query = "SELECT hash FROM eclinic_load_ledger WHERE subcommand = $1 "
+                        "AND target_table = $2 AND kind = 'c' AND hash = ANY($3::bigint[])";
+    const char *const paramValues[3] = {ledger->subcommand, ledger->tables, hashes.data};
+    res = record_exec_params(conn, query, 3, paramValues);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("unable to read load ledger: %s", PQerrorMessage(conn));
+    }
+
+    for (int r = 0; r < PQntuples(res); r++) {
+        uint64_t hash = (uint64_t)strtoll(PQgetvalue(res, r, 0), NULL, 10);
+        for (size_t i = 0; i < ledger->num_chunks; i++) {
+            if (ledger->chunks[i].hash == hash) {
+                ledger->chunks[i].loaded = true;
+            }
+        }
+    }
+    FreeResult();
+    sb_free(&hashes);
+}
+
+bool ledger_open(Ledger *ledger, const char *subcommand, const char *path,
+                 const LoadSpec *const *specs, size_t num_specs) {
+    *ledger = (Ledger){.subcommand = subcommand};
+
+    StrBuf tables;
+    sb_init(&tables, 64);
+    for (size_t i = 0; i < num_specs; i++) {
+        sb_appendf(&tables, "%s%s", i ? "," : "", specs[i]->table);
+    }
+    ledger->tables = tables.data;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        LOG_FATAL("unable to open %s", path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        LOG_FATAL("unable to stat %s", path);
+    }
+
+    size_t size = (size_t)st.st_size;
+    const uint8_t *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            LOG_FATAL("unable to map %s", path);
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    ledger->file_hash = hash64(data, size, 0);
+    ensure_ledger_table();
+
+    char file_hash[24];
+    snprintf(file_hash, sizeof(file_hash), "%lld", (long long)ledger->file_hash);
+    const char *query = "SELECT loaded_at FROM eclinic_load_ledger WHERE subcommand = $1 "
+                        "AND target_table = $2 AND kind = 'f' AND hash = $3::bigint";
+    const char *const paramValues[3] = {subcommand, ledger->tables, file_hash};
+    res = record_exec_params(conn, query, 3, paramValues);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("unable to read load ledger: %s", PQerrorMessage(conn));
+    }
+
+    if (PQntuples(res) > 0) {
+        LOG_INFO("%s is unchanged since it was loaded at %s (%016llx), nothing to do", path,
+                 PQgetvalue(res, 0, 0), (unsigned long long)ledger->file_hash);
+        FreeResult();
+        if (data) {
+            munmap((void *)data, size);
+        }
+        return false;
+    }
+    FreeResult();
+
+    chunk_file(ledger, data, size);
+    if (data) {
+        munmap((void *)data, size);
+    }
+    mark_loaded_chunks(ledger);
+    return true;
+}
+
+size_t ledger_filter_rows(const Ledger *ledger, CsvRow **rows, size_t num_rows) {
+    // Rows are mapped to chunks by counting records, which only holds if the parser
+    // saw the same records. Anything else (e.g blank lines) loads the whole file.
+    if (ledger->num_rows != num_rows) {
+        LOG_INFO("ledger: %zu records in chunks but %zu parsed rows, loading every row",
+                 ledger->num_rows, num_rows);
+        return num_rows;
+    }
+
+    size_t n = 0, skipped_chunks = 0;
+    for (size_t c = 0; c < ledger->num_chunks; c++) {
+        const LedgerChunk *chunk = &ledger->chunks[c];
+        if (chunk->loaded) {
+            skipped_chunks++;
+            continue;
+        }
+
+        memmove(rows + n, rows + chunk->first_row, chunk->num_rows * sizeof(CsvRow *));
+        n += chunk->num_rows;
+    }
+
+    LOG_INFO("ledger: %zu of %zu chunk(s) already loaded, %zu of %zu row(s) to load",
+             skipped_chunks, ledger->num_chunks, n, num_rows);
+    return n;
+}
+
+void ledger_record(const Ledger *ledger) {
+    StrBuf hashes, counts;
+    sb_init(&hashes, ledger->num_chunks * 21 + 2);
+    sb_init(&counts, ledger->num_chunks * 11 + 2);
+    sb_putc(&hashes, '{');
+    sb_putc(&counts, '{');
+    for (size_t i = 0; i < ledger->num_chunks; i++) {
+        sb_appendf(&hashes, "%s%lld", i ? "," : "", (long long)ledger->chunks[i].hash);
+        sb_appendf(&counts, "%s%zu", i ? "," : "", ledger->chunks[i].num_rows);
+    }
+    sb_putc(&hashes, '}');
+    sb_putc(&counts, '}');
+
+    char file_hash[24], file_rows[24];
+    snprintf(file_hash, sizeof(file_hash), "%lld", (long long)ledger->file_hash);
+    snprintf(file_rows, sizeof(file_rows), "%zu", ledger->num_rows);
+
+    const char *query =
+        "INSERT INTO eclinic_load_ledger (subcommand, target_table, kind, hash, rows) "
+        "SELECT $1, $2, 'c', u.hash, u.rows FROM unnest($3::bigint[], $4::int[]) AS u(hash, rows) "
+        "UNION ALL SELECT $1, $2, 'f', $5::bigint, $6::int "
+        "ON CONFLICT DO NOTHING";
+    const char *const paramValues[6] = {ledger->subcommand, ledger->tables, hashes.data,
+                                        counts.data,        file_hash,      file_rows};
+    res = record_exec_params(conn, query, 6, paramValues);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        LOG_FATAL("unable to record load ledger: %s", PQerrorMessage(conn));
+    }
+    FreeResult();
+
+    sb_free(&hashes);
+    sb_free(&counts);
+}
+
+void ledger_close(Ledger *ledger) {
+    free(ledger->tables);
+    free(ledger->chunks);
+    *ledger = (Ledger){0};
+}
@@ -0,0 +1,1250 @@
+#include "../include/loader.h"
+#include "../include/autotune.h"
+#include "../include/bulk.h"
+#include "../include/dedup.h"
+#include "../include/explain.h"
+#include "../include/hash.h"
+#include "../include/ledger.h"
+#include "../include/partition.h"
+#include "../include/probe.h"
+#include "../include/record.h"
+#include "../include/sort.h"
+#include "../include/strbuf.h"
+#include "../include/throttle.h"
+#include "../include/timing.h"
+#include "../include/trace.h"
+#include <string.h>
+#include <strings.h>
+
+LoadOptions load_options = {
+    .strategy = "pipeline",
+    .batch_size = 1000,
+    .dedup = "auto",
+    .memory_mb = 256,
+    .order = "none",
+    .stats = false,
+    .bulk = false,
+    .drop_indexes = false,
+    .maintenance_mb = 1024,
+    .index_workers = 4,
+    .gentle = false,
+    .max_rate = 500,
+    .target_ms = 200,
+    .max_lag_ms = 5000,
+    .ledger = false,
+    .trace = NULL,
+    .record = NULL,
+    .explain_slow = 0,
+    .explain_file = "slow-plans.txt",
+};
+
+LoadStrategy load_strategy_parse(const char *name) {
+    if (strcmp(name, "row") == 0)
+        return LOAD_ROW;
+    if (strcmp(name, "pipeline") == 0)
+        return LOAD_PIPELINE;
+    if (strcmp(name, "batch") == 0)
+        return LOAD_BATCH;
+    if (strcmp(name, "copy") == 0)
+        return LOAD_COPY;
+    if (strcmp(name, "auto") == 0)
+        return LOAD_AUTO;
+
+    LOG_FATAL("unknown load strategy: %s (expected row, pipeline, batch, copy or auto)", name);
+}
+
+const char *load_strategy_name(LoadStrategy strategy) {
+    static const char *const names[] = {"row", "pipeline", "batch", "copy", "auto"};
+    return names[strategy];
+}
+
+// ======================= Plan compilation =======================
+
+bool load_type_is_text(const char *type) {
+    return strcmp(type, "text") == 0 || strncmp(type, "character", 9) == 0 ||
+           strncmp(type, "varchar", 7) == 0 || strcmp(type, "citext") == 0;
+}
+
+bool load_type_is_numeric(const char *type) {
+    static const char *const names[] = {"smallint", "integer", "bigint", "int",    "int2",
+                                        "int4",     "int8",    "real",   "float4", "float8",
+                                        "double precision"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(type, names[i]) == 0)
+            return true;
+    }
+    return strncmp(type, "numeric", 7) == 0 || strncmp(type, "decimal", 7) == 0;
+}
+
+char *load_column_type(const char *table, const char *column) {
+    const char *query = "SELECT format_type(a.atttypid, a.atttypmod) FROM pg_attribute a "
+                        "WHERE a.attrelid = $1::regclass AND a.attname = $2 "
+                        "AND a.attnum > 0 AND NOT a.attisdropped";
+
+    const char *const paramValues[2] = {table, column};
+    res = record_exec_params(conn, query, 2, paramValues);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("unable to read columns of %s: %s", table, PQerrorMessage(conn));
+    }
+
+    char *type = NULL;
+    if (PQntuples(res) == 1) {
+        type = strdup(PQgetvalue(res, 0, 0));
+    }
+    FreeResult();
+    return type;
+}
+
+// Resolve the type an input is cast to before it reaches the target table.
+static char *resolve_type(const LoadSpec *spec, const ColumnMap *col) {
+    if (col->type == NULL) {
+        if (col->input_only) {
+            return strdup("text");
+        }
+
+        char *type = load_column_type(spec->table, col->column);
+        if (!type) {
+            LOG_FATAL("column %s does not exist in table %s", col->column, spec->table);
+        }
+        return type;
+    }
+
+    // "table.column%TYPE" borrows the type of another column.
+    size_t len = strlen(col->type);
+    if (len > 5 && strcasecmp(col->type + len - 5, "%TYPE") == 0) {
+        char *ref = strndup(col->type, len - 5);
+        char *dot = strchr(ref, '.');
+        if (!dot) {
+            LOG_FATAL("invalid type reference %s for column %s", col->type, col->column);
+        }
+        *dot = '\0';
+
+        char *type = load_column_type(ref, dot + 1);
+        if (!type) {
+            LOG_FATAL("type reference %s for column %s not found", col->type, col->column);
+        }
+        free(ref);
+        return type;
+    }
+    return strdup(col->type);
+}
+
+// Index of the header field named name, ignoring case and surrounding spaces.
+// Returns false if there is none.
+static bool lookup_header(CsvRow *header, const char *name, size_t *index) {
+    for (size_t i = 0; header && i < header->numFields; i++) {
+        const char *field = header->fields[i];
+        while (*field == ' ') {
+            field++;
+        }
+
+        size_t len = strlen(field);
+        while (len > 0 && field[len - 1] == ' ') {
+            len--;
+        }
+
+        if (len == strlen(name) && strncasecmp(field, name, len) == 0) {
+            *index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t find_header(CsvRow *header, const char *name) {
+    if (header == NULL) {
+        LOG_FATAL("column %s is mapped by header but the file has no header", name);
+    }
+
+    size_t index;
+    if (!lookup_header(header, name, &index)) {
+        LOG_FATAL("CSV header has no column named \"%s\"", name);
+    }
+    return index;
+}
+
+// Whether an optional column is missing from the header.
+static bool column_missing(const ColumnMap *col, CsvRow *header) {
+    size_t index;
+    return col->if_missing && col->header && !col->expr && !col->compute &&
+           !lookup_header(header, col->header, &index);
+}
+
+// Whether an update column is mapped to a column missing from the header.
+static bool update_missing(const LoadSpec *spec, CsvRow *header, const char *column) {
+    for (size_t i = 0; i < spec->num_columns; i++) {
+        if (strcmp(spec->columns[i].column, column) == 0) {
+            return column_missing(&spec->columns[i], header);
+        }
+    }
+    return false;
+}
+
+static void append_list(StrBuf *sb, const char *const *names) {
+    for (size_t i = 0; names[i]; i++) {
+        sb_appendf(sb, "%s%s", i ? ", " : "", names[i]);
+    }
+}
+
+LoadPlan *load_plan_compile(const LoadSpec *spec, CsvRow *header) {
+    LoadPlan *plan = calloc(1, sizeof(LoadPlan));
+    if (!plan) {
+        LOG_FATAL("out of memory");
+    }
+
+    plan->spec = spec;
+    plan->inputs = calloc(spec->num_columns, sizeof(*plan->inputs));
+    plan->input_fields = calloc(spec->num_columns, sizeof(*plan->input_fields));
+    plan->key_inputs = calloc(spec->num_columns, sizeof(*plan->key_inputs));
+    plan->key_numeric = calloc(spec->num_columns, sizeof(*plan->key_numeric));
+    plan->input_types = calloc(spec->num_columns, sizeof(*plan->input_types));
+    if (!plan->inputs || !plan->input_fields || !plan->key_inputs || !plan->key_numeric ||
+        !plan->input_types) {
+        LOG_FATAL("out of memory");
+    }
+
+    snprintf(plan->stmt_name, sizeof(plan->stmt_name), "load_%s", spec->name);
+    snprintf(plan->batch_stmt_name, sizeof(plan->batch_stmt_name), "load_%s_batch", spec->name);
+    snprintf(plan->stage_table, sizeof(plan->stage_table), "_stage_%s", spec->name);
+
+    // Resolve inputs. Expression columns are computed on the server and take no input.
+    StrBuf casts, aliases;
+    sb_init(&casts, 256);
+    sb_init(&aliases, 128);
+
+    for (size_t i = 0; i < spec->num_columns; i++) {
+        const ColumnMap *col = &spec->columns[i];
+        if (col->expr || column_missing(col, header))
+            continue;
+
+        size_t field = col->index;
+        if (!col->compute && col->header) {
+            field = find_header(header, col->header);
+        }
+
+        if (!col->compute && spec->expected_fields && field >= spec->expected_fields) {
+            LOG_FATAL("%s: column %s maps to field %zu but rows have %zu fields", spec->name,
+                      col->column, field, spec->expected_fields);
+        }
+
+        if (!col->compute && field + 1 > plan->min_fields) {
+            plan->min_fields = field + 1;
+        }
+
+        size_t n = plan->num_inputs++;
+        plan->inputs[n] = col;
+        plan->input_fields[n] = field;
+
+        char *type = resolve_type(spec, col);
+        if (load_type_is_text(type)) {
+            sb_appendf(&casts, "%sr.%s AS %s", n ? ", " : "", col->column, col->column);
+        } else {
+            // Empty spreadsheet cells load as NULL rather than failing the cast.
+            sb_appendf(&casts, "%sNULLIF(r.%s, '')::%s AS %s", n ? ", " : "", col->column, type,
+                       col->column);
+        }
+        sb_appendf(&aliases, "%s%s", n ? ", " : "", col->column);
+        plan->input_types[n] = type;
+    }
+
+    // Rows can only be keyed on the client if every key column is an input.
+    const char *const *key = spec->client_key ? spec->client_key : spec->conflict_key;
+    for (size_t k = 0; key && key[k]; k++) {
+        size_t i = 0;
+        while (i < plan->num_inputs && strcmp(plan->inputs[i]->column, key[k]) != 0) {
+            i++;
+        }
+
+        if (i == plan->num_inputs) {
+            plan->num_keys = 0;
+            break;
+        }
+        plan->key_numeric[plan->num_keys] = load_type_is_numeric(plan->input_types[i]);
+        plan->key_inputs[plan->num_keys++] = i;
+    }
+
+    // Shared parts of every statement.
+    StrBuf head, tail;
+    sb_init(&head, 512);
+    sb_init(&tail, 512);
+
+    // The upsert is wrapped so that every statement returns one (inserted, updated) row.
+    // xmax is 0 only on row versions created by an INSERT.
+    StrBuf cols, exprs;
+    sb_init(&cols, 256);
+    sb_init(&exprs, 512);
+    for (size_t i = 0; i < spec->num_columns; i++) {
+        const ColumnMap *col = &spec->columns[i];
+        if (col->input_only)
+            continue;
+
+        const char *sep = cols.len ? ", " : "";
+        sb_appendf(&cols, "%s%s", sep, col->column);
+        if (col->expr) {
+            sb_appendf(&exprs, "%s(%s) AS %s", sep, col->expr, col->column);
+        } else if (column_missing(col, header)) {
+            sb_appendf(&exprs, "%s(%s) AS %s", sep, col->if_missing, col->column);
+        } else {
+            sb_appendf(&exprs, "%ss.%s", sep, col->column);
+        }
+    }
+
+    if (spec->where || spec->joins) {
+        // Rows that survive the joins and filter are kept apart so the statement can also
+        // return how many there were: the rest were dropped, not left unchanged.
+        sb_appendf(&head, "WITH k AS (SELECT %s FROM (SELECT %s FROM ", exprs.data, casts.data);
+
+        sb_appendf(&tail, " AS r(%s)) AS s", aliases.data);
+        if (spec->joins) {
+            sb_appendf(&tail, " %s", spec->joins);
+        }
+        if (spec->where) {
+            sb_appendf(&tail, " WHERE %s", spec->where);
+        }
+        sb_appendf(&tail, "), w AS (INSERT INTO %s AS t (%s) SELECT %s FROM k", spec->table,
+                   cols.data, cols.data);
+    } else {
+        sb_appendf(&head, "WITH w AS (INSERT INTO %s AS t (%s) SELECT %s FROM (SELECT %s FROM ",
+                   spec->table, cols.data, exprs.data, casts.data);
+        sb_appendf(&tail, " AS r(%s)) AS s", aliases.data);
+    }
+    sb_free(&cols);
+    sb_free(&exprs);
+
+    if (spec->conflict_key) {
+        sb_append(&tail, " ON CONFLICT (");
+        append_list(&tail, spec->conflict_key);
+        sb_append(&tail, ")");
+
+        if (spec->update_columns) {
+            // Only the columns present in the file are updated.
+            const char **update = calloc(spec->num_columns + 1, sizeof(char *));
+            if (!update) {
+                LOG_FATAL("out of memory");
+            }
+
+            size_t nupdate = 0;
+            for (size_t i = 0; spec->update_columns[i]; i++) {
+                if (!update_missing(spec, header, spec->update_columns[i])) {
+                    update[nupdate++] = spec->update_columns[i];
+                }
+            }
+
+            if (nupdate == 0) {
+                LOG_FATAL("%s: the file has none of the columns updated on conflict",
+                          spec->name);
+            }
+
+            sb_append(&tail, " DO UPDATE SET ");
+            for (size_t i = 0; i < nupdate; i++) {
+                sb_appendf(&tail, "%s%s = EXCLUDED.%s", i ? ", " : "", update[i], update[i]);
+            }
+
+            // Skip no-op updates: they would still write a new tuple version, WAL and
+            // index entries.
+            sb_append(&tail, " WHERE (");
+            for (size_t i = 0; i < nupdate; i++) {
+                sb_appendf(&tail, "%st.%s", i ? ", " : "", update[i]);
+            }
+            sb_append(&tail, ") IS DISTINCT FROM (");
+            for (size_t i = 0; i < nupdate; i++) {
+                sb_appendf(&tail, "%sEXCLUDED.%s", i ? ", " : "", update[i]);
+            }
+            sb_append(&tail, ")");
+            free(update);
+        } else {
+            sb_append(&tail, " DO NOTHING");
+        }
+    }
+
+    sb_append(&tail, " RETURNING (t.xmax = 0) AS inserted");
+    for (size_t i = 0; spec->returning && spec->returning[i]; i++) {
+        sb_appendf(&tail, ", t.%s", spec->returning[i]);
+    }
+    sb_append(&tail, ")");
+
+    // Runs in the same statement, so it sees exactly the rows this upsert wrote.
+    if (spec->after) {
+        sb_appendf(&tail, ", a AS (%s)", spec->after);
+    }
+
+    sb_append(&tail, " SELECT count(*) FILTER (WHERE inserted), "
+                     "count(*) FILTER (WHERE NOT inserted)");
+    if (spec->where || spec->joins) {
+        sb_append(&tail, ", (SELECT count(*) FROM k)");
+    }
+    sb_append(&tail, " FROM w");
+
+    StrBuf sql;
+    sb_init(&sql, head.len + tail.len + 256);
+    sb_appendf(&sql, "%s(VALUES (", head.data);
+    for (size_t i = 0; i < plan->num_inputs; i++) {
+        sb_appendf(&sql, "%s$%zu::text", i ? ", " : "", i + 1);
+    }
+    sb_appendf(&sql, "))%s", tail.data);
+    plan->row_sql = sql.data;
+
+    sb_init(&sql, head.len + tail.len + 256);
+    sb_appendf(&sql, "%sunnest(", head.data);
+    for (size_t i = 0; i < plan->num_inputs; i++) {
+        sb_appendf(&sql, "%s$%zu::text[]", i ? ", " : "", i + 1);
+    }
+    sb_appendf(&sql, ")%s", tail.data);
+    plan->batch_sql = sql.data;
+
+    sb_init(&sql, head.len + tail.len + 64);
+    sb_appendf(&sql, "%s%s%s", head.data, plan->stage_table, tail.data);
+    plan->merge_sql = sql.data;
+
+    sb_init(&sql, 256);
+    sb_appendf(&sql, "CREATE TEMP TABLE %s (", plan->stage_table);
+    for (size_t i = 0; i < plan->num_inputs; i++) {
+        sb_appendf(&sql, "%s%s text", i ? ", " : "", plan->inputs[i]->column);
+    }
+    sb_append(&sql, ")");
+    plan->stage_sql = sql.data;
+
+    sb_init(&sql, 128);
+    sb_appendf(&sql, "COPY %s FROM STDIN (FORMAT csv)", plan->stage_table);
+    plan->copy_sql = sql.data;
+
+    sb_free(&casts);
+    sb_free(&aliases);
+    sb_free(&head);
+    sb_free(&tail);
+    return plan;
+}
+
+void load_plan_free(LoadPlan *plan) {
+    if (!plan)
+        return;
+
+    free(plan->inputs);
+    free(plan->input_fields);
+    free(plan->key_inputs);
+    free(plan->key_numeric);
+    for (size_t i = 0; i < plan->num_inputs; i++) {
+        free(plan->input_types[i]);
+    }
+    free(plan->input_types);
+    free(plan->row_sql);
+    free(plan->batch_sql);
+    free(plan->stage_sql);
+    free(plan->copy_sql);
+    free(plan->merge_sql);
+    free(plan);
+}
+
+// Sign, integer digits and fraction digits of a plain decimal such as " -012.50 ", with
+// leading zeros of the integer and trailing zeros of the fraction dropped.
+typedef struct {
+    bool negative;
+    const char *digits;
+    size_t num_digits;
+    const char *fraction;
+    size_t num_fraction;
+} Decimal;
+
+// Split value into a Decimal. Returns false if it is not one, e.g. "", "1e3" or "NaN".
+static bool parse_decimal(const char *value, Decimal *d) {
+    *d = (Decimal){0};
+    while (*value == ' ') {
+        value++;
+    }
+    if (*value == '-' || *value == '+') {
+        d->negative = *value++ == '-';
+    }
+
+    size_t n = strspn(value, "0123456789");
+    size_t m = value[n] == '.' ? strspn(value + n + 1, "0123456789") : 0;
+    if (n + m == 0)
+        return false;
+
+    d->digits = value;
+    d->num_digits = n;
+    d->fraction = value + n + 1;
+    d->num_fraction = m;
+
+    value += n + (value[n] == '.' ? m + 1 : 0);
+    while (*value == ' ') {
+        value++;
+    }
+    if (*value != '\0')
+        return false;
+
+    while (d->num_digits > 0 && *d->digits == '0') {
+        d->digits++;
+        d->num_digits--;
+    }
+    while (d->num_fraction > 0 && d->fraction[d->num_fraction - 1] == '0') {
+        d->num_fraction--;
+    }
+    if (d->num_digits == 0 && d->num_fraction == 0) {
+        d->negative = false; // -0 is 0.
+    }
+    return true;
+}
+
+// Compare two numbers by value. Values that are not plain decimals sort first, bytewise,
+// so that the order stays total.
+static int compare_numbers(const char *a, const char *b) {
+    Decimal x, y;
+    bool x_ok = parse_decimal(a, &x), y_ok = parse_decimal(b, &y);
+    if (!x_ok || !y_ok)
+        return x_ok == y_ok ? strcmp(a, b) : x_ok - y_ok;
+
+    if (x.negative != y.negative)
+        return x.negative ? -1 : 1;
+
+    int cmp = (x.num_digits > y.num_digits) - (x.num_digits < y.num_digits);
+    if (cmp == 0) {
+        cmp = memcmp(x.digits, y.digits, x.num_digits);
+    }
+    if (cmp == 0) {
+        size_t n = x.num_fraction < y.num_fraction ? x.num_fraction : y.num_fraction;
+        cmp = memcmp(x.fraction, y.fraction, n);
+        if (cmp == 0) {
+            cmp = (x.num_fraction > y.num_fraction) - (x.num_fraction < y.num_fraction);
+        }
+    }
+    return x.negative ? -cmp : cmp;
+}
+
+// Hash a number so that values compare_numbers finds equal, e.g "7", "007" and "7.0",
+// hash equal.
+static uint64_t hash_number(const char *value, uint64_t seed) {
+    Decimal d;
+    if (!parse_decimal(value, &d))
+        return hash64(value, strlen(value), seed);
+
+    seed = hash64(d.negative ? "-" : "+", 1, seed);
+    seed = hash64(d.digits, d.num_digits, seed);
+    return hash64(d.fraction, d.num_fraction, seed + 1);
+}
+
+uint64_t load_key_hash(const LoadPlan *plan, CsvRow *row) {
+    uint64_t h = 0;
+    for (size_t k = 0; k < plan->num_keys; k++) {
+        const char *value = load_input_value(plan, row, plan->key_inputs[k]);
+        h = plan->key_numeric[k] ? hash_number(value, h + k) : hash64(value, strlen(value), h + k);
+    }
+    return h;
+}
+
+int load_key_compare(const LoadPlan *plan, CsvRow *a, CsvRow *b) {
+    for (size_t k = 0; k < plan->num_keys; k++) {
+        const char *x = load_input_value(plan, a, plan->key_inputs[k]);
+        const char *y = load_input_value(plan, b, plan->key_inputs[k]);
+        int cmp = plan->key_numeric[k] ? compare_numbers(x, y) : strcmp(x, y);
+        if (cmp != 0) {
+            return cmp;
+        }
+    }
+    return 0;
+}
+
+// ======================= Plan execution =======================
+
+// Add the (inserted, updated) counts every load statement returns. Statements of specs
+// with joins or a filter also return how many of the sent rows they kept.
+static void add_counts(LoadCounts *counts, PGresult *result, size_t sent) {
+    counts->inserted += strtoull(PQgetvalue(result, 0, 0), NULL, 10);
+    counts->updated += strtoull(PQgetvalue(result, 0, 1), NULL, 10);
+    if (PQnfields(result) > 2) {
+        counts->filtered += sent - strtoull(PQgetvalue(result, 0, 2), NULL, 10);
+    }
+}
+
+// Prepare a statement once per connection. Plans may run many times, e.g once per batch.
+static void prepare_statement(const char *name, const char *sql, size_t nparams, bool *prepared) {
+    if (*prepared)
+        return;
+
+    double start = trace_begin();
+    res = record_prepare(conn, name, sql, (int)nparams);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        LOG_FATAL("Failed to prepare statement: %s", PQerrorMessage(conn));
+    }
+    FreeResult();
+    trace_end("prepare", name, (int64_t)nparams, start);
+    *prepared = true;
+}
+
+void load_exec(const char *sql) {
+    res = record_exec(conn, sql);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        LOG_FATAL("%s: %s", sql, PQerrorMessage(conn));
+    }
+    FreeResult();
+}
+
+// Run the row statement, leaving its result in res.
+static void exec_row(LoadPlan *plan, const char *const *params) {
+    res = record_exec_prepared(conn, plan->stmt_name, (int)plan->num_inputs, params);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("%s", PQerrorMessage(conn));
+    }
+}
+
+static void execute_rows(LoadPlan *plan, CsvRow **rows, size_t num_rows, LoadCounts *counts) {
+    prepare_statement(plan->stmt_name, plan->row_sql, plan->num_inputs, &plan->row_prepared);
+
+    const char **params = calloc(plan->num_inputs, sizeof(char *));
+    for (size_t i = 0; i < num_rows; i++) {
+        for (size_t j = 0; j < plan->num_inputs; j++) {
+            params[j] = load_input_value(plan, rows[i], j);
+        }
+
+        double start = trace_begin();
+        double sent = now_ms();
+        PROBE(batch_sent, plan->spec->table, 1);
+        exec_row(plan, params);
+        PROBE(statement_complete, plan->spec->table, 1);
+        trace_end("execute", plan->spec->table, 1, start);
+        add_counts(counts, res, 1);
+        FreeResult();
+
+        double elapsed = now_ms() - sent;
+        if (explain_due(elapsed)) {
+            explain_capture(plan, "row", plan->row_sql, (int)plan->num_inputs, params, rows + i, 1,
+                            elapsed);
+            explain_release();
+        }
+    }
+    free(params);
+}
+
+// Read results up to and including the next pipeline sync point. done, if not NULL,
+// receives the time each statement's result arrived.
+static void pipeline_drain(LoadCounts *counts, double *done) {
+    for (size_t n = 0;;) {
+        res = record_get_result(conn);
+        if (res == NULL)
+            continue; // End of one statement's results.
+
+        ExecStatusType status = PQresultStatus(res);
+        if (status == PGRES_PIPELINE_SYNC) {
+            FreeResult();
+            return;
+        }
+
+        if (status != PGRES_TUPLES_OK) {
+            LOG_FATAL("%s", PQerrorMessage(conn));
+        }
+        if (done) {
+            done[n++] = now_ms();
+        }
+        add_counts(counts, res, 1);
+        FreeResult();
+    }
+}
+
+static void pipeline_enter(void) {
+    if (record_enter_pipeline(conn) != 1) {
+        LOG_FATAL("unable to enter pipeline mode: %s", PQerrorMessage(conn));
+    }
+}
+
+static void pipeline_exit(void) {
+    if (record_exit_pipeline(conn) != 1) {
+        LOG_FATAL("unable to exit pipeline mode: %s", PQerrorMessage(conn));
+    }
+}
+
+// Send the row statement for each of rows, then a sync point.
+static void pipeline_send(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                          const char **params) {
+    for (size_t i = 0; i < num_rows; i++) {
+        for (size_t j = 0; j < plan->num_inputs; j++) {
+            params[j] = load_input_value(plan, rows[i], j);
+        }
+
+        if (!record_send_prepared(conn, plan->stmt_name, (int)plan->num_inputs, params)) {
+            LOG_FATAL("%s", PQerrorMessage(conn));
+        }
+    }
+
+    if (!record_pipeline_sync(conn)) {
+        LOG_FATAL("%s", PQerrorMessage(conn));
+    }
+}
+
+// Explain the slowest statement of a window. The server runs pipelined statements one
+// after another, so a statement took about the time between its result and the
+// previous one's.
+static void pipeline_explain(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                             const char **params, const double *done, double sent) {
+    size_t slow = 0;
+    double slow_ms = done[0] - sent;
+    for (size_t i = 1; i < num_rows; i++) {
+        if (done[i] - done[i - 1] > slow_ms) {
+            slow = i;
+            slow_ms = done[i] - done[i - 1];
+        }
+    }
+
+    for (size_t j = 0; j < plan->num_inputs; j++) {
+        params[j] = load_input_value(plan, rows[slow], j);
+    }
+    explain_capture(plan, "pipelined row", plan->row_sql, (int)plan->num_inputs, params,
+                    rows + slow, 1, slow_ms);
+}
+
+static void execute_pipeline(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                             size_t batch_size, LoadCounts *counts) {
+    prepare_statement(plan->stmt_name, plan->row_sql, plan->num_inputs, &plan->row_prepared);
+
+    const char **params = calloc(plan->num_inputs, sizeof(char *));
+    double *done = load_options.explain_slow > 0 ? malloc(batch_size * sizeof(double)) : NULL;
+
+    // Each window leaves pipeline mode, which needs no round trip, so that its slowest
+    // statement can be explained.
+    for (size_t first = 0; first < num_rows; first += batch_size) {
+        size_t n = num_rows - first < batch_size ? num_rows - first : batch_size;
+
+        pipeline_enter();
+        double start = trace_begin();
+        double sent = now_ms();
+        pipeline_send(plan, rows + first, n, params);
+        PROBE(batch_sent, plan->spec->table, n);
+        trace_end("send", plan->spec->table, (int64_t)n, start);
+
+        start = trace_begin();
+        pipeline_drain(counts, done);
+        PROBE(statement_complete, plan->spec->table, n);
+        trace_end("wait", plan->spec->table, (int64_t)n, start);
+        pipeline_exit();
+
+        if (explain_due(now_ms() - sent)) {
+            pipeline_explain(plan, rows + first, n, params, done, sent);
+            explain_release();
+        }
+    }
+
+    free(done);
+    free(params);
+}
+
+// Run the batch statement for rows start to end, leaving its result in res.
+static void exec_batch(LoadPlan *plan, const char *const *params, size_t start, size_t end) {
+    res = record_exec_prepared(conn, plan->batch_stmt_name, (int)plan->num_inputs, params);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("batch at rows %zu-%zu failed: %s", start + 1, end, PQerrorMessage(conn));
+    }
+}
+
+static void execute_batch(LoadPlan *plan, CsvRow **rows, size_t num_rows, size_t batch_size,
+                          LoadCounts *counts) {
+    prepare_statement(plan->batch_stmt_name, plan->batch_sql, plan->num_inputs,
+                      &plan->batch_prepared);
+
+    size_t n = plan->num_inputs;
+    StrBuf *arrays = calloc(n, sizeof(StrBuf));
+    const char **params = calloc(n, sizeof(char *));
+    for (size_t j = 0; j < n; j++) {
+        sb_init(&arrays[j], 4096);
+    }
+
+    for (size_t start = 0; start < num_rows; start += batch_size) {
+        size_t end = start + batch_size < num_rows ? start + batch_size : num_rows;
+        double span = trace_begin();
+
+        for (size_t j = 0; j < n; j++) {
+            sb_reset(&arrays[j]);
+            sb_putc(&arrays[j], '{');
+        }
+
+        for (size_t i = start; i < end; i++) {
+            for (size_t j = 0; j < n; j++) {
+                if (i > start) {
+                    sb_putc(&arrays[j], ',');
+                }
+                sb_append_array_element(&arrays[j], load_input_value(plan, rows[i], j));
+            }
+        }
+
+        for (size_t j = 0; j < n; j++) {
+            sb_putc(&arrays[j], '}');
+            params[j] = arrays[j].data;
+        }
+        trace_end("build", plan->spec->table, (int64_t)(end - start), span);
+
+        explain_savepoint();
+        span = trace_begin();
+        double sent = now_ms();
+        PROBE(batch_sent, plan->spec->table, end - start);
+        exec_batch(plan, params, start, end);
+        PROBE(statement_complete, plan->spec->table, end - start);
+        trace_end("execute", plan->spec->table, (int64_t)(end - start), span);
+
+        double elapsed = now_ms() - sent;
+        if (explain_due(elapsed)) {
+            FreeResult();
+            explain_capture(plan, "batch", plan->batch_sql, (int)n, params, rows + start,
+                            end - start, elapsed);
+            exec_batch(plan, params, start, end);
+        }
+        add_counts(counts, res, end - start);
+        FreeResult();
+        explain_release();
+    }
+
+    for (size_t j = 0; j < n; j++) {
+        sb_free(&arrays[j]);
+    }
+    free(arrays);
+    free(params);
+}
+
+// Append value as a quoted CSV field so empty strings are not read as NULL.
+static void append_csv_field(StrBuf *sb, const char *value) {
+    sb_putc(sb, '"');
+    while (*value) {
+        size_t span = strcspn(value, "\"");
+        sb_appendn(sb, value, span);
+        value += span;
+        if (*value) {
+            sb_appendn(sb, "\"\"", 2);
+            value++;
+        }
+    }
+    sb_putc(sb, '"');
+}
+
+static void copy_flush(StrBuf *sb) {
+    if (sb->len == 0)
+        return;
+
+    if (record_put_copy_data(conn, sb->data, (int)sb->len) != 1) {
+        LOG_FATAL("COPY failed: %s", PQerrorMessage(conn));
+    }
+    sb_reset(sb);
+}
+
+// Merge the staged rows into the table, leaving the result in res.
+static void exec_merge(LoadPlan *plan) {
+    res = record_exec(conn, plan->merge_sql);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("%s", PQerrorMessage(conn));
+    }
+}
+
+static void execute_copy(LoadPlan *plan, CsvRow **rows, size_t num_rows, size_t batch_size,
+                         LoadCounts *counts) {
+    load_exec(plan->stage_sql);
+
+    res = record_exec(conn, plan->copy_sql);
+    if (PQresultStatus(res) != PGRES_COPY_IN) {
+        LOG_FATAL("%s: %s", plan->copy_sql, PQerrorMessage(conn));
+    }
+    FreeResult();
+
+    StrBuf buf;
+    sb_init(&buf, 1 << 16);
+
+    for (size_t i = 0; i < num_rows; i++) {
+        for (size_t j = 0; j < plan->num_inputs; j++) {
+            if (j > 0) {
+                sb_putc(&buf, ',');
+            }
+            append_csv_field(&buf, load_input_value(plan, rows[i], j));
+        }
+        sb_putc(&buf, '\n');
+
+        if ((i + 1) % batch_size == 0) {
+            double start = trace_begin();
+            copy_flush(&buf);
+            PROBE(batch_sent, plan->spec->table, batch_size);
+            trace_end("send", plan->spec->table, (int64_t)batch_size, start);
+        }
+    }
+    if (buf.len > 0) {
+        double start = trace_begin();
+        copy_flush(&buf);
+        PROBE(batch_sent, plan->spec->table, num_rows % batch_size);
+        trace_end("send", plan->spec->table, (int64_t)(num_rows % batch_size), start);
+    }
+    sb_free(&buf);
+
+    double start = trace_begin();
+    if (record_put_copy_end(conn) != 1) {
+        LOG_FATAL("COPY failed: %s", PQerrorMessage(conn));
+    }
+
+    res = record_get_result(conn);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        LOG_FATAL("COPY failed: %s", PQerrorMessage(conn));
+    }
+    FreeResult();
+
+    while ((res = record_get_result(conn)) != NULL) {
+        FreeResult();
+    }
+    trace_end("wait", plan->spec->table, (int64_t)num_rows, start);
+
+    // The savepoint keeps the staged rows, so only the merge is rolled back and run again.
+    explain_savepoint();
+    start = trace_begin();
+    double sent = now_ms();
+    exec_merge(plan);
+    PROBE(statement_complete, plan->spec->table, num_rows);
+    trace_end("merge", plan->spec->table, (int64_t)num_rows, start);
+
+    double elapsed = now_ms() - sent;
+    if (explain_due(elapsed)) {
+        FreeResult();
+        explain_capture(plan, "copy merge", plan->merge_sql, 0, NULL, rows, num_rows, elapsed);
+        exec_merge(plan);
+    }
+    add_counts(counts, res, num_rows);
+    FreeResult();
+    explain_release();
+
+    char drop[96];
+    snprintf(drop, sizeof(drop), "DROP TABLE %s", plan->stage_table);
+    load_exec(drop);
+}
+
+LoadCounts load_plan_execute(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                             LoadStrategy strategy) {
+    return load_plan_execute_sized(plan, rows, num_rows, strategy,
+                                   (size_t)load_options.batch_size);
+}
+
+LoadCounts load_plan_execute_sized(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                                   LoadStrategy strategy, size_t batch_size) {
+    LoadCounts counts = {0};
+    if (num_rows == 0)
+        return counts;
+
+    switch (strategy) {
+    case LOAD_ROW:
+        execute_rows(plan, rows, num_rows, &counts);
+        break;
+    case LOAD_PIPELINE:
+        execute_pipeline(plan, rows, num_rows, batch_size, &counts);
+        break;
+    case LOAD_BATCH:
+        execute_batch(plan, rows, num_rows, batch_size, &counts);
+        break;
+    case LOAD_COPY:
+        execute_copy(plan, rows, num_rows, batch_size, &counts);
+        break;
+    case LOAD_AUTO:
+        LOG_FATAL("auto is resolved by autotune_execute");
+    }
+
+    // Kept rows that were neither inserted nor updated matched an identical row or hit
+    // ON CONFLICT DO NOTHING.
+    counts.unchanged = num_rows - counts.inserted - counts.updated - counts.filtered;
+    return counts;
+}
+
+void load_counts_add(LoadCounts *total, LoadCounts counts) {
+    total->inserted += counts.inserted;
+    total->updated += counts.updated;
+    total->unchanged += counts.unchanged;
+    total->filtered += counts.filtered;
+}
+
+// ======================= CSV loading =======================
+
+void load_validate_rows(const LoadPlan *plan, CsvRow **rows, size_t num_rows) {
+    const LoadSpec *spec = plan->spec;
+    for (size_t i = 0; i < num_rows; i++) {
+        size_t nfields = rows[i]->numFields;
+        PROBE(row_parsed, spec->table, i + 2, nfields);
+        if (spec->expected_fields && nfields != spec->expected_fields) {
+            LOG_FATAL("CSV is expected to have %zu columns, line %zu has %zu",
+                      spec->expected_fields, i + 2, nfields);
+        }
+
+        if (nfields < plan->min_fields) {
+            LOG_FATAL("CSV line %zu has %zu columns, %s needs at least %zu", i + 2, nfields,
+                      spec->name, plan->min_fields);
+        }
+    }
+}
+
+// Shared buffer hits and reads of a table and its indexes in the current transaction.
+typedef struct {
+    size_t hit;
+    size_t read;
+} BlockStats;
+
+static BlockStats table_block_stats(const char *table) {
+    const char *query =
+        "SELECT sum(pg_stat_get_xact_blocks_hit(c.oid)), "
+        "sum(pg_stat_get_xact_blocks_fetched(c.oid) - pg_stat_get_xact_blocks_hit(c.oid)) "
+        "FROM pg_class c WHERE c.oid = $1::regclass "
+        "OR c.oid IN (SELECT indexrelid FROM pg_index WHERE indrelid = $1::regclass)";
+
+    const char *const paramValues[1] = {table};
+    res = record_exec_params(conn, query, 1, paramValues);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("unable to read block stats of %s: %s", table, PQerrorMessage(conn));
+    }
+
+    BlockStats stats = {
+        .hit = strtoull(PQgetvalue(res, 0, 0), NULL, 10),
+        .read = strtoull(PQgetvalue(res, 0, 1), NULL, 10),
+    };
+    FreeResult();
+    return stats;
+}
+
+CsvParser *load_csv_parse(const char *path, CsvRow **header, CsvRow ***rows, size_t *num_rows) {
+    PROBE(parse_start, path);
+    double start = trace_begin();
+    CsvParser *parser = csvparser_new(path);
+    if (!parser) {
+        LOG_FATAL("failed to initialize csv parser");
+    }
+    trace_end("open", path, 0, start);
+
+    // Keep the header row so columns can be mapped by name.
+    start = trace_begin();
+    csvparser_setconfig(parser, (CsvParserConfig){.has_header = true, .skip_header = false});
+    CsvRow **all = csvparser_parse(parser);
+    if (!all) {
+        LOG_FATAL("csvparser_parse() failed");
+    }
+
+    size_t n = csvparser_numrows(parser);
+    trace_end("parse", path, (int64_t)n, start);
+    *header = n > 0 ? all[0] : NULL;
+    *rows = n > 0 ? all + 1 : all;
+    *num_rows = n > 0 ? n - 1 : 0;
+    PROBE(parse_done, path, *num_rows);
+    return parser;
+}
+
+void load_csv(const char *subcommand, const char *path, const LoadSpec *const *specs,
+              size_t num_specs) {
+    const LoadSource source = {.path = path, .specs = specs, .num_specs = num_specs};
+    load_sources(subcommand, &source, 1);
+}
+
+// A parsed source file and its plans.
+typedef struct {
+    const LoadSource *source;
+    CsvParser *parser;
+    CsvRow *header;
+    CsvRow **rows;
+    size_t num_rows;
+    LoadPlan **plans;
+    Ledger ledger;
+    ExplainSource explain;
+    bool skip; // Empty, or unchanged since it was last loaded.
+} ParsedSource;
+
+void load_sources(const char *subcommand, const LoadSource *sources, size_t num_sources) {
+    LoadStrategy strategy = load_strategy_parse(load_options.strategy);
+    if (load_options.batch_size <= 0) {
+        LOG_FATAL("batch size must be positive, got %d", load_options.batch_size);
+    }
+
+    if (load_options.memory_mb <= 0) {
+        LOG_FATAL("memory budget must be positive, got %d MB", load_options.memory_mb);
+    }
+
+    if (load_options.gentle && load_options.bulk) {
+        LOG_FATAL("--gentle and --bulk cannot be combined");
+    }
+
+    if (load_options.gentle && (load_options.max_rate <= 0 || load_options.target_ms <= 0)) {
+        LOG_FATAL("--max-rate and --target-ms must be positive");
+    }
+
+    // Gentle loads size their own batches.
+    if (strategy == LOAD_AUTO && load_options.gentle) {
+        LOG_FATAL("--strategy auto cannot be combined with --gentle");
+    }
+
+    if (strategy == LOAD_AUTO && load_options.target_ms <= 0) {
+        LOG_FATAL("--target-ms must be positive");
+    }
+
+    if (load_options.explain_slow < 0) {
+        LOG_FATAL("--explain-slow must not be negative, got %d ms", load_options.explain_slow);
+    }
+
+    if (load_options.trace) {
+        trace_open(load_options.trace);
+    }
+
+    if (load_options.record) {
+        record_open(load_options.record);
+    }
+
+    // Every file is parsed and checked before the transaction starts.
+    ParsedSource *parsed = calloc(num_sources, sizeof(ParsedSource));
+    const LoadSpec **all_specs = NULL;
+    size_t num_all_specs = 0, max_rows = 0;
+    for (size_t s = 0; s < num_sources; s++) {
+        ParsedSource *p = &parsed[s];
+        const LoadSource *source = p->source = &sources[s];
+        assert(source->path);
+
+        // An unchanged file is skipped before it is even parsed.
+        if (load_options.ledger && !ledger_open(&p->ledger, subcommand, source->path,
+                                                source->specs, source->num_specs)) {
+            p->skip = true;
+            continue;
+        }
+
+        p->parser = load_csv_parse(source->path, &p->header, &p->rows, &p->num_rows);
+        explain_source_init(&p->explain, source->path, p->rows, p->num_rows);
+        if (p->num_rows == 0) {
+            LOG_INFO("%s has no rows to upload", source->path);
+            p->skip = true;
+            continue;
+        }
+
+        if (load_options.ledger) {
+            p->num_rows = ledger_filter_rows(&p->ledger, p->rows, p->num_rows);
+        }
+
+        p->plans = calloc(source->num_specs, sizeof(LoadPlan *));
+        all_specs = realloc(all_specs, (num_all_specs + source->num_specs) * sizeof(LoadSpec *));
+        if (!p->plans || !all_specs) {
+            LOG_FATAL("out of memory");
+        }
+
+        for (size_t i = 0; i < source->num_specs; i++) {
+            // Partitions are created and rows moved outside the batch transactions.
+            if (load_options.gentle && partition_enabled(source->specs[i])) {
+                LOG_FATAL("%s is partitioned, --gentle cannot load it", source->specs[i]->table);
+            }
+            p->plans[i] = load_plan_compile(source->specs[i], p->header);
+            load_validate_rows(p->plans[i], p->rows, p->num_rows);
+            all_specs[num_all_specs++] = source->specs[i];
+        }
+
+        if (p->num_rows > max_rows) {
+            max_rows = p->num_rows;
+        }
+    }
+
+    DedupMode dedup = dedup_mode_parse(load_options.dedup);
+    RowOrder order = row_order_parse(load_options.order);
+    size_t memory_budget = (size_t)load_options.memory_mb << 20;
+    CsvRow **plan_rows = malloc((max_rows ? max_rows : 1) * sizeof(CsvRow *));
+    if (!plan_rows) {
+        LOG_FATAL("out of memory");
+    }
+
+    // Gentle loads commit every batch instead of holding one long transaction.
+    bool gentle = load_options.gentle;
+    if (num_all_specs > 0 && !gentle) {
+        load_exec("BEGIN");
+    }
+
+    if (num_all_specs > 0 && load_options.bulk) {
+        bulk_begin(all_specs, num_all_specs);
+    }
+
+    for (size_t s = 0; s < num_sources; s++) {
+        ParsedSource *p = &parsed[s];
+        if (p->skip)
+            continue;
+
+        const LoadSpec *const *specs = p->source->specs;
+        explain_use_source(&p->explain);
+        for (size_t i = 0; i < p->source->num_specs; i++) {
+            memcpy(plan_rows, p->rows, p->num_rows * sizeof(CsvRow *));
+            double span = trace_begin();
+            size_t n = dedup_rows(p->plans[i], plan_rows, p->num_rows, dedup, memory_budget);
+            trace_end("dedup", specs[i]->table, (int64_t)n, span);
+
+            // Key order keeps index writes local and takes row locks in a consistent order.
+            span = trace_begin();
+            if (order == ORDER_FILE) {
+                sort_rows(p->plans[i], plan_rows, n);
+            } else if (order == ORDER_BATCH) {
+                sort_batches(p->plans[i], plan_rows, n, (size_t)load_options.batch_size);
+            }
+            if (order != ORDER_NONE) {
+                trace_end("sort", specs[i]->table, (int64_t)n, span);
+            }
+
+            BlockStats before = {0};
+            double start = now_ms();
+            if (load_options.stats && !gentle) {
+                before = table_block_stats(specs[i]->table);
+            }
+
+            LoadExecutor execute = load_plan_execute;
+            if (gentle) {
+                execute = throttle_execute;
+            } else if (strategy == LOAD_AUTO) {
+                execute = autotune_execute;
+            }
+            span = trace_begin();
+            LoadCounts counts =
+                partition_enabled(specs[i])
+                    ? partition_execute(p->plans[i], p->header, plan_rows, n, strategy, execute)
+                    : execute(p->plans[i], plan_rows, n, strategy);
+            trace_end("load", specs[i]->table, (int64_t)n, span);
+            LOG_INFO("Uploaded %zu row(s) into %s: %zu inserted, %zu updated, %zu unchanged, "
+                     "%zu filtered",
+                     n, specs[i]->table, counts.inserted, counts.updated, counts.unchanged,
+                     counts.filtered);
+
+            if (load_options.stats && gentle) {
+                double elapsed = now_ms() - start;
+                LOG_INFO("%s: %zu rows in %.1f ms (%.0f rows/s)", specs[i]->table, n, elapsed,
+                         elapsed > 0 ? n * 1e3 / elapsed : 0.0);
+            } else if (load_options.stats) {
+                double elapsed = now_ms() - start;
+                BlockStats after = table_block_stats(specs[i]->table);
+                size_t hit = after.hit - before.hit, read = after.read - before.read;
+                LOG_INFO(
+                    "%s: %zu rows in %.1f ms (%.0f rows/s), buffers hit %zu read %zu (%.1f%% hit)",
+                    specs[i]->table, n, elapsed, elapsed > 0 ? n * 1e3 / elapsed : 0.0, hit, read,
+                    hit + read ? 100.0 * hit / (hit + read) : 100.0);
+            }
+        }
+    }
+
+    explain_use_source(NULL);
+
+    if (num_all_specs > 0 && load_options.bulk) {
+        bulk_finish();
+    }
+
+    // Recorded in the load transaction so the ledger never claims rows that rolled back.
+    for (size_t s = 0; s < num_sources && load_options.ledger; s++) {
+        if (!parsed[s].skip) {
+            ledger_record(&parsed[s].ledger);
+        }
+    }
+
+    if (num_all_specs > 0 && !gentle) {
+        double start = trace_begin();
+        PROBE(commit_start, subcommand);
+        load_exec("COMMIT");
+        PROBE(commit_done, subcommand);
+        trace_end("commit", subcommand, 0, start);
+    }
+    free(plan_rows);
+
+    for (size_t s = 0; s < num_sources; s++) {
+        ParsedSource *p = &parsed[s];
+        if (load_options.ledger) {
+            ledger_close(&p->ledger);
+        }
+
+        for (size_t i = 0; p->plans && i < p->source->num_specs; i++) {
+            load_plan_free(p->plans[i]);
+        }
+        free(p->plans);
+
+        explain_source_free(&p->explain);
+        if (p->parser) {
+            csvparser_free(p->parser);
+        }
+    }
+    free(parsed);
+    free(all_specs);
+}
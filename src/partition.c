@@ -0,0 +1,402 @@
+#include "../include/partition.h"
+#include "../include/record.h"
+#include "../include/strbuf.h"
+#include <stdarg.h>
+#include <string.h>
+
+// Run a query that returns rows. The caller clears the result.
+static PGresult *query(const char *sql, int nparams, const char *const *params) {
+    PGresult *result = record_exec_params(conn, sql, nparams, params);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        LOG_FATAL("%s: %s", sql, PQerrorMessage(conn));
+    }
+    return result;
+}
+
+static void execf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void execf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    char *sql = NULL;
+    if (vasprintf(&sql, fmt, args) < 0) {
+        LOG_FATAL("out of memory");
+    }
+    va_end(args);
+
+    load_exec(sql);
+    free(sql);
+}
+
+bool partition_enabled(const LoadSpec *spec) {
+    if (!spec->partition_column)
+        return false;
+
+    const char *const params[1] = {spec->table};
+    PGresult *result =
+        query("SELECT 1 FROM pg_partitioned_table WHERE partrelid = to_regclass($1)", 1, params);
+    bool partitioned = PQntuples(result) == 1;
+    PQclear(result);
+    return partitioned;
+}
+
+// Create the partition for the month starting at from unless it exists, with its local
+// unique index on the conflict key.
+static void create_partition(const LoadSpec *spec, const char *suffix, const char *from) {
+    execf("CREATE TABLE IF NOT EXISTS %s_%s PARTITION OF %s "
+          "FOR VALUES FROM ('%s') TO (('%s'::date + interval '1 month')::date)",
+          spec->table, suffix, spec->table, from, from);
+    execf("CREATE UNIQUE INDEX IF NOT EXISTS %s_%s_%s_key ON %s_%s (%s)", spec->table, suffix,
+          spec->conflict_key[0], spec->table, suffix, spec->conflict_key[0]);
+}
+
+// ======================= Routing loads =======================
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static size_t find_input(const LoadPlan *plan, const char *column) {
+    for (size_t i = 0; i < plan->num_inputs; i++) {
+        if (strcmp(plan->inputs[i]->column, column) == 0) {
+            return i;
+        }
+    }
+    LOG_FATAL("%s: partition column %s is not loaded from the file", plan->spec->name, column);
+}
+
+// Move the rows whose key is stored in another month than the file puts it in to the
+// new partition, so that the upsert into it does not collide in <table>_keys. Updating
+// the partition column through the parent moves the row and keeps its other columns.
+// Sets moved[i] for each row whose stored row moved and returns their number.
+static size_t move_keys(const LoadPlan *plan, CsvRow **rows, size_t num_rows, size_t key_input,
+                        size_t part_input, bool *moved) {
+    const LoadSpec *spec = plan->spec;
+    StrBuf keys, values;
+    sb_init(&keys, num_rows * 16 + 2);
+    sb_init(&values, num_rows * 16 + 2);
+    sb_putc(&keys, '{');
+    sb_putc(&values, '{');
+    for (size_t i = 0; i < num_rows; i++) {
+        if (i > 0) {
+            sb_putc(&keys, ',');
+            sb_putc(&values, ',');
+        }
+        sb_append_array_element(&keys, load_input_value(plan, rows[i], key_input));
+        sb_append_array_element(&values, load_input_value(plan, rows[i], part_input));
+    }
+    sb_putc(&keys, '}');
+    sb_putc(&values, '}');
+
+    const char *key = spec->conflict_key[0], *part = spec->partition_column;
+    StrBuf sql;
+    sb_init(&sql, 512);
+    sb_appendf(&sql,
+               "UPDATE %s t SET %s = NULLIF(s.value, '')::date FROM %s_keys k, "
+               "unnest($1::text[], $2::text[]) WITH ORDINALITY AS s(key, value, i) "
+               "WHERE k.%s = s.key::%s AND date_trunc('month', k.%s) "
+               "<> date_trunc('month', NULLIF(s.value, '')::date) "
+               "AND t.%s = k.%s AND t.%s = k.%s RETURNING s.i",
+               spec->table, part, spec->table, key, plan->input_types[key_input], part, key,
+               key, part, part);
+
+    const char *const params[2] = {keys.data, values.data};
+    PGresult *result = record_exec_params(conn, sql.data, 2, params);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        LOG_FATAL("moving rows between partitions of %s failed: %s", spec->table,
+                  PQerrorMessage(conn));
+    }
+
+    size_t num_moved = (size_t)PQntuples(result);
+    for (size_t r = 0; r < num_moved; r++) {
+        moved[strtoull(PQgetvalue(result, (int)r, 0), NULL, 10) - 1] = true;
+    }
+    PQclear(result);
+
+    sb_free(&sql);
+    sb_free(&keys);
+    sb_free(&values);
+    return num_moved;
+}
+
+LoadCounts partition_execute(const LoadPlan *plan, CsvRow *header, CsvRow **rows,
+                             size_t num_rows, LoadStrategy strategy, LoadExecutor execute) {
+    LoadCounts total = {0};
+    if (num_rows == 0)
+        return total;
+
+    const LoadSpec *spec = plan->spec;
+    if (plan->num_keys != 1 || spec->client_key) {
+        LOG_FATAL("%s: partitioned loads need a single-column conflict key", spec->name);
+    }
+    size_t key_input = plan->key_inputs[0];
+    size_t part_input = find_input(plan, spec->partition_column);
+
+    // Distinct partition column values, sorted for lookup.
+    const char **values = malloc(num_rows * sizeof(char *));
+    if (!values) {
+        LOG_FATAL("out of memory");
+    }
+    for (size_t i = 0; i < num_rows; i++) {
+        values[i] = load_input_value(plan, rows[i], part_input);
+    }
+    qsort(values, num_rows, sizeof(char *), compare_strings);
+
+    size_t num_values = 0;
+    for (size_t i = 0; i < num_rows; i++) {
+        if (num_values == 0 || strcmp(values[num_values - 1], values[i]) != 0) {
+            values[num_values++] = values[i];
+        }
+    }
+
+    // The server parses the dates, so every format it accepts routes the same way.
+    StrBuf array;
+    sb_init(&array, num_values * 12 + 2);
+    sb_putc(&array, '{');
+    for (size_t i = 0; i < num_values; i++) {
+        if (i > 0) {
+            sb_putc(&array, ',');
+        }
+        sb_append_array_element(&array, values[i]);
+    }
+    sb_putc(&array, '}');
+
+    const char *const params[1] = {array.data};
+    PGresult *months =
+        query("SELECT to_char(m, '\"y\"YYYY\"m\"MM'), m FROM (SELECT date_trunc('month', "
+              "NULLIF(v, '')::date)::date AS m, i FROM unnest($1::text[]) WITH ORDINALITY AS u(v, i)) "
+              "AS s ORDER BY i",
+              1, params);
+
+    // Partition of each distinct value, as an index into the distinct months.
+    size_t *value_part = malloc(num_values * sizeof(size_t));
+    const char **suffixes = malloc(num_values * sizeof(char *));
+    if (!value_part || !suffixes) {
+        LOG_FATAL("out of memory");
+    }
+
+    size_t num_parts = 0;
+    for (size_t i = 0; i < num_values; i++) {
+        if (PQgetisnull(months, (int)i, 0)) {
+            LOG_FATAL("%s: every row needs a %s to be routed to a partition", spec->name,
+                      spec->partition_column);
+        }
+
+        const char *suffix = PQgetvalue(months, (int)i, 0);
+        size_t p = 0;
+        while (p < num_parts && strcmp(suffixes[p], suffix) != 0) {
+            p++;
+        }
+
+        if (p == num_parts) {
+            suffixes[num_parts++] = suffix;
+            create_partition(spec, suffix, PQgetvalue(months, (int)i, 1));
+        }
+        value_part[i] = p;
+    }
+
+    bool *moved = calloc(num_rows, sizeof(bool));
+    if (!moved) {
+        LOG_FATAL("out of memory");
+    }
+    size_t num_moved = move_keys(plan, rows, num_rows, key_input, part_input, moved);
+
+    // Bucket the rows by partition, moved rows after the others of their partition,
+    // keeping their order within each bucket.
+    size_t num_buckets = 2 * num_parts;
+    size_t *row_bucket = malloc(num_rows * sizeof(size_t));
+    size_t *offsets = calloc(num_buckets + 1, sizeof(size_t));
+    CsvRow **routed = malloc(num_rows * sizeof(CsvRow *));
+    if (!row_bucket || !offsets || !routed) {
+        LOG_FATAL("out of memory");
+    }
+
+    for (size_t i = 0; i < num_rows; i++) {
+        const char *value = load_input_value(plan, rows[i], part_input);
+        const char **found = bsearch(&value, values, num_values, sizeof(char *), compare_strings);
+        row_bucket[i] = 2 * value_part[found - values] + moved[i];
+        offsets[row_bucket[i] + 1]++;
+    }
+
+    for (size_t b = 0; b < num_buckets; b++) {
+        offsets[b + 1] += offsets[b];
+    }
+
+    for (size_t i = 0; i < num_rows; i++) {
+        routed[offsets[row_bucket[i]]++] = rows[i];
+    }
+
+    // Each partition gets its own plan so that ON CONFLICT uses its local unique index.
+    size_t start = 0;
+    for (size_t p = 0; p < num_parts; p++) {
+        char name[128];
+        snprintf(name, sizeof(name), "%s_%s", spec->table, suffixes[p]);
+
+        LoadSpec part = *spec;
+        part.name = name;
+        part.table = name;
+        part.partition_column = NULL;
+
+        LoadPlan *part_plan = load_plan_compile(&part, header);
+        size_t n = offsets[2 * p] - start;
+        load_counts_add(&total, execute(part_plan, routed + start, n, strategy));
+        start = offsets[2 * p];
+
+        // Moved rows changed month even when the upsert finds nothing else to change.
+        n = offsets[2 * p + 1] - start;
+        if (n > 0) {
+            LoadCounts counts = execute(part_plan, routed + start, n, strategy);
+            counts.updated += counts.unchanged;
+            counts.unchanged = 0;
+            load_counts_add(&total, counts);
+        }
+        start = offsets[2 * p + 1];
+        load_plan_free(part_plan);
+    }
+
+    LOG_INFO("%s: routed %zu row(s) into %zu partition(s), %zu moved between partitions",
+             spec->table, num_rows, num_parts, num_moved);
+
+    PQclear(months);
+    sb_free(&array);
+    free(values);
+    free(value_part);
+    free(suffixes);
+    free(moved);
+    free(row_bucket);
+    free(offsets);
+    free(routed);
+    return total;
+}
+
+// ======================= Conversion =======================
+
+static void partition_convert(const LoadSpec *spec) {
+    const char *table = spec->table, *key = spec->conflict_key[0], *part = spec->partition_column;
+    if (partition_enabled(spec)) {
+        LOG_INFO("%s is already partitioned by %s", table, part);
+        return;
+    }
+
+    // Foreign keys to a partitioned table must include the partition column.
+    const char *const table_param[1] = {table};
+    PGresult *result = query("SELECT conname, conrelid::regclass FROM pg_constraint "
+                             "WHERE confrelid = $1::regclass AND contype = 'f'",
+                             1, table_param);
+    if (PQntuples(result) > 0) {
+        for (int i = 0; i < PQntuples(result); i++) {
+            LOG_ERROR("%s references %s through %s", PQgetvalue(result, i, 1), table,
+                      PQgetvalue(result, i, 0));
+        }
+        LOG_FATAL("drop the foreign keys referencing %s before partitioning it", table);
+    }
+    PQclear(result);
+
+    char *key_type = load_column_type(table, key);
+    char *part_type = load_column_type(table, part);
+    if (!key_type || !part_type) {
+        LOG_FATAL("%s needs the columns %s and %s", table, key, part);
+    }
+
+    load_exec("BEGIN");
+    execf("LOCK TABLE %s IN ACCESS EXCLUSIVE MODE", table);
+    execf("ALTER TABLE %s RENAME TO %s_unpartitioned", table, table);
+
+    char old_table[128];
+    snprintf(old_table, sizeof(old_table), "%s_unpartitioned", table);
+    const char *const old_param[1] = {old_table};
+
+    // Primary key columns and secondary index definitions, rewritten for the new table.
+    const char *const key_params[2] = {old_table, part};
+    result = query("SELECT string_agg(quote_ident(a.attname), ', '), bool_or(a.attname = $2) "
+                   "FROM pg_index x JOIN pg_attribute a ON a.attrelid = x.indrelid "
+                   "AND a.attnum = ANY(x.indkey) WHERE x.indrelid = $1::regclass AND x.indisprimary",
+                   2, key_params);
+    char *primary_key = PQgetisnull(result, 0, 0) ? NULL : strdup(PQgetvalue(result, 0, 0));
+    bool key_has_part = strcmp(PQgetvalue(result, 0, 1), "t") == 0;
+    PQclear(result);
+
+    const char *const index_params[2] = {old_table, table};
+    PGresult *indexes = query("SELECT regexp_replace(pg_get_indexdef(indexrelid), "
+                              "' ON (ONLY )?\\S+ USING ', ' ON ' || $2 || ' USING ') "
+                              "FROM pg_index WHERE indrelid = $1::regclass "
+                              "AND NOT indisunique AND NOT indisprimary",
+                              2, index_params);
+
+    execf("CREATE TABLE %s (LIKE %s INCLUDING DEFAULTS INCLUDING CONSTRAINTS "
+          "INCLUDING GENERATED INCLUDING STORAGE INCLUDING COMMENTS) PARTITION BY RANGE (%s)",
+          table, old_table, part);
+
+    // One partition per month between the oldest and newest rows.
+    char *sql = NULL;
+    asprintf(&sql,
+             "SELECT to_char(m, '\"y\"YYYY\"m\"MM'), m::date, b.nulls FROM "
+             "(SELECT min(%s) AS lo, max(%s) AS hi, count(*) FILTER (WHERE %s IS NULL) AS nulls "
+             "FROM %s) AS b, generate_series(date_trunc('month', coalesce(b.lo, now())), "
+             "date_trunc('month', coalesce(b.hi, now())), interval '1 month') AS m",
+             part, part, part, old_table);
+    PGresult *months = query(sql, 0, NULL);
+    free(sql);
+
+    if (strcmp(PQgetvalue(months, 0, 2), "0") != 0) {
+        LOG_FATAL("%s rows of %s have no %s", PQgetvalue(months, 0, 2), table, part);
+    }
+
+    for (int i = 0; i < PQntuples(months); i++) {
+        create_partition(spec, PQgetvalue(months, i, 0), PQgetvalue(months, i, 1));
+    }
+
+    execf("INSERT INTO %s SELECT * FROM %s", table, old_table);
+    execf("CREATE TABLE %s_keys (%s %s PRIMARY KEY, %s %s NOT NULL)", table, key, key_type, part,
+          part_type);
+    execf("INSERT INTO %s_keys SELECT %s, %s FROM %s", table, key, part, table);
+
+    // Serial sequences would be dropped with the old table.
+    result = query("SELECT quote_ident(attname), pg_get_serial_sequence($1, attname) "
+                   "FROM pg_attribute WHERE attrelid = $1::regclass AND attnum > 0 "
+                   "AND NOT attisdropped AND pg_get_serial_sequence($1, attname) IS NOT NULL",
+                   1, old_param);
+    for (int i = 0; i < PQntuples(result); i++) {
+        execf("ALTER SEQUENCE %s OWNED BY %s.%s", PQgetvalue(result, i, 1), table,
+              PQgetvalue(result, i, 0));
+    }
+    PQclear(result);
+
+    execf("DROP TABLE %s", old_table);
+
+    if (primary_key) {
+        execf("ALTER TABLE %s ADD PRIMARY KEY (%s%s%s)", table, primary_key,
+              key_has_part ? "" : ", ", key_has_part ? "" : part);
+    }
+
+    for (int i = 0; i < PQntuples(indexes); i++) {
+        load_exec(PQgetvalue(indexes, i, 0));
+    }
+
+    // Writers outside eclinic get the same guarantee: a key lives in one partition.
+    execf("CREATE FUNCTION %s_keys_sync() RETURNS trigger LANGUAGE plpgsql AS $$ BEGIN "
+          "IF TG_OP <> 'INSERT' THEN DELETE FROM %s_keys WHERE %s = OLD.%s; END IF; "
+          "IF TG_OP <> 'DELETE' THEN INSERT INTO %s_keys VALUES (NEW.%s, NEW.%s); END IF; "
+          "RETURN NULL; END $$",
+          table, table, key, key, table, key, part);
+    execf("CREATE TRIGGER %s_keys_sync AFTER INSERT OR DELETE OR UPDATE OF %s, %s ON %s "
+          "FOR EACH ROW EXECUTE FUNCTION %s_keys_sync()",
+          table, key, part, table, table);
+
+    execf("ANALYZE %s", table);
+    load_exec("COMMIT");
+
+    LOG_INFO("Partitioned %s by %s into %d monthly partition(s)", table, part,
+             PQntuples(months));
+
+    PQclear(months);
+    PQclear(indexes);
+    free(primary_key);
+    free(key_type);
+    free(part_type);
+}
+
+void partition_invoices(Subcommand *cmd) {
+    (void)cmd;
+    partition_convert(invoices_specs[0]);
+}
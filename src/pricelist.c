@@ -1,120 +1,95 @@
-#include "../include/common.h"
+#include "../include/loader.h"
+#include "../include/similar.h"
 
 /*
 NAME,RATE,SELLING PRICE,Quantity,Expiry Date,Billable Type,Department
 Inj Ceftriaxone 1g,2500,5000,100,2024-01-31,Investigation,pharmacy
 Inj Dynapar 75mg,2500,5000,50,2023-06-30,Investigation,pharmacy
 */
-void upload_invoices(CsvRow **rows, size_t num_rows) {
-    if (num_rows == 0)
-        return;
-
-    size_t nfields = rows[0]->numFields;
-    if (nfields != 7) {
-        fprintf(stderr, "CVS is expected to have 7 columns\n");
-        exit(1);
-    }
-
-    //  ================= start a transaction ===================
-    res = PQexec(conn, "BEGIN");
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        LOG_FATAL("begin transaction failed");
-    }
-    FreeResult();
-
-    char *stmt = "INSERT INTO inventory_items (name, type, cost_price, dept, quantity,"
-                 "expiry_date, created_at)"
-                 "VALUES ($1, $2, $3, $4, $5, $6, NOW())"
-                 "  ON CONFLICT (name, type) DO UPDATE "
-                 "SET "
-                 "  cost_price = EXCLUDED.cost_price,"
-                 "  dept = EXCLUDED.dept,"
-                 "  quantity = EXCLUDED.quantity,"
-                 "  expiry_date = EXCLUDED.expiry_date"
-                 "  RETURNING id";
-
-    res = PQprepare(conn, "insert_inventory_items", stmt, 6, NULL);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        LOG_FATAL("Failed to prepare statement: %s", PQerrorMessage(conn));
-    }
-    FreeResult();
-
-    // Create prepared statement for prices table
-    char *pstmt = "INSERT INTO prices (item_id, cash, uap,san_care, jubilee, prudential, aar,"
-                  " saint_catherine, icea, liberty) VALUES ($1, $2, 0,0,0,0,0,0,0,0) "
-                  " ON CONFLICT (item_id) DO UPDATE SET cash = $2 WHERE prices.item_id = $1;";
-
-    res = PQprepare(conn, "insert_prices", pstmt, 2, NULL);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        LOG_FATAL("Failed to prepare statement: %s", PQerrorMessage(conn));
-    }
-    FreeResult();
-
-    ExecStatusType status;
-    for (size_t i = 0; i < num_rows; i++) {
-        char **fields = rows[i]->fields;
-        const char *name = fields[0];
-        const char *type = fields[5];
-        const char *cost_price = fields[1];
-        const char *dept = fields[6];
-        const char *quantity = fields[3];
-        const char *expiry_date = fields[4];
-
-        // name, type, cost_price, dept, quantity, expiry_date
-        // NAME,RATE,SELLING PRICE,Quantity,Expiry Date,Billable Type,Department
-        const char *const paramValues[6] = {
-            name, type, cost_price, dept, quantity, expiry_date,
-        };
-
-        res = PQexecPrepared(conn, "insert_inventory_items", 6, paramValues, NULL, NULL, 0);
-        status = PQresultStatus(res);
-        if (status != PGRES_TUPLES_OK) {
-            LOG_FATAL("%s", PQerrorMessage(conn));
-        }
-
-        // Get the id of the item to use when setting price.
-        char *itemId = PQgetvalue(res, 0, 0);
-        LOG_INFO("%s :ID: %s", name, itemId);
-
-        // Insert price
-        FreeResult();
-
-        char *cashPrice = fields[2];
-        if (atoi(cashPrice) > 0) {
-            const char *const paramValuesPrice[2] = {itemId, cashPrice};
-            res = PQexecPrepared(conn, "insert_prices", 2, paramValuesPrice, NULL, NULL, 0);
-            status = PQresultStatus(res);
-            if (status != PGRES_COMMAND_OK) {
-                LOG_FATAL("%s", PQerrorMessage(conn));
-            }
-            FreeResult();
-            LOG_INFO("Set price for %s to %s\n", name, cashPrice);
-        }
-    }
+static const ColumnMap item_columns[] = {
+    {.column = "name", .index = 0},
+    {.column = "cost_price", .index = 1},
+    {.column = "quantity", .index = 3},
+    {.column = "expiry_date", .index = 4},
+    {.column = "type", .index = 5},
+    {.column = "dept", .index = 6},
+    {.column = "created_at", .expr = "NOW()"},
+};
+
+static const LoadSpec items_spec = {
+    .name = "inventory_items",
+    .table = "inventory_items",
+    .columns = item_columns,
+    .num_columns = sizeof(item_columns) / sizeof(item_columns[0]),
+    .expected_fields = 7,
+    .conflict_key = (const char *const[]){"name", "type", NULL},
+    .update_columns =
+        (const char *const[]){"cost_price", "dept", "quantity", "expiry_date", NULL},
+};
+
+// The selling price is the cash price of the item upserted above.
+// Insurer prices start at zero and are left alone on update.
+static const ColumnMap price_columns[] = {
+    {.column = "name", .index = 0, .input_only = true},
+    {.column = "type", .index = 5, .input_only = true, .type = "inventory_items.type%TYPE"},
+    {.column = "item_id",
+     .expr = "(SELECT i.id FROM inventory_items i WHERE i.name = s.name AND i.type = s.type)"},
+    {.column = "cash", .index = 2},
+    {.column = "uap", .expr = "0"},
+    {.column = "san_care", .expr = "0"},
+    {.column = "jubilee", .expr = "0"},
+    {.column = "prudential", .expr = "0"},
+    {.column = "aar", .expr = "0"},
+    {.column = "saint_catherine", .expr = "0"},
+    {.column = "icea", .expr = "0"},
+    {.column = "liberty", .expr = "0"},
+};
+
+static const LoadSpec prices_spec = {
+    .name = "prices",
+    .table = "prices",
+    .columns = price_columns,
+    .num_columns = sizeof(price_columns) / sizeof(price_columns[0]),
+    .expected_fields = 7,
+    .conflict_key = (const char *const[]){"item_id", NULL},
+    .update_columns = (const char *const[]){"cash", NULL},
+    .where = "s.cash > 0",
+    .client_key = (const char *const[]){"name", "type", NULL},
+    .client_key_from = "prices t JOIN inventory_items k ON k.id = t.item_id",
+};
+
+// Items without a price export an empty SELLING PRICE, which the prices filter skips.
+const char *const pricelist_export_query =
+    "SELECT i.name AS \"NAME\", i.cost_price AS \"RATE\", p.cash AS \"SELLING PRICE\", "
+    "i.quantity AS \"Quantity\", i.expiry_date AS \"Expiry Date\", "
+    "i.type AS \"Billable Type\", i.dept AS \"Department\" "
+    "FROM inventory_items i LEFT JOIN prices p ON p.item_id = i.id";
+
+const LoadSpec *const pricelist_specs[] = {&items_spec, &prices_spec, NULL};
+
+// Stop before anything is written if an incoming name looks like an existing item.
+static void check_similar_items(void) {
+    CsvRow *header, **rows;
+    size_t num_rows;
+    CsvParser *parser = load_csv_parse(filename, &header, &rows, &num_rows);
+    LoadPlan *plan = load_plan_compile(&items_spec, header);
+    load_validate_rows(plan, rows, num_rows);
+
+    // NAME and Billable Type, see item_columns.
+    size_t found = similar_report(rows, num_rows, 0, 5);
+    load_plan_free(plan);
+    csvparser_free(parser);
 
-    // Commit the transaction
-    res = PQexec(conn, "COMMIT");
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        LOG_FATAL("commit transaction failed");
+    if (found > 0) {
+        LOG_FATAL("%zu item(s) look like existing items, nothing was loaded", found);
     }
+    LOG_INFO("No incoming item looks like an existing item");
 }
 
 void upload_pricelist_csv(Subcommand *cmd) {
     (void)cmd;
-    assert(filename);
-
-    CsvParser *parser = csvparser_new(filename);
-    if (!parser) {
-        LOG_FATAL("failed to initialize csv parser");
-    }
-
-    csvparser_setconfig(parser, (CsvParserConfig){.has_header = true, .skip_header = true});
-    CsvRow **rows = csvparser_parse(parser);
-    if (!rows) {
-        LOG_FATAL("csvparser_parse() failed");
+    if (check_similar) {
+        check_similar_items();
     }
-
-    size_t numrows = csvparser_numrows(parser);
-    upload_invoices(rows, numrows);
-    csvparser_free(parser);
+    load_csv("pricelist", filename, pricelist_specs, 2);
 }
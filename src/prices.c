@@ -0,0 +1,46 @@
+#include "../include/loader.h"
+
+/*
+Insurer tariffs, with any subset of the price columns:
+name,type,cash,uap,jubilee,aar
+Inj Ceftriaxone 1g,Investigation,5000,5500,5200,5400
+
+Only the price columns in the header are set. Rows of unknown items are skipped.
+*/
+static const ColumnMap tariff_columns[] = {
+    {.column = "name", .header = "name", .input_only = true},
+    {.column = "type", .header = "type", .input_only = true, .type = "inventory_items.type%TYPE"},
+    {.column = "item_id", .expr = "i.id"},
+    {.column = "cash", .header = "cash", .if_missing = "0"},
+    {.column = "uap", .header = "uap", .if_missing = "0"},
+    {.column = "san_care", .header = "san_care", .if_missing = "0"},
+    {.column = "jubilee", .header = "jubilee", .if_missing = "0"},
+    {.column = "prudential", .header = "prudential", .if_missing = "0"},
+    {.column = "aar", .header = "aar", .if_missing = "0"},
+    {.column = "saint_catherine", .header = "saint_catherine", .if_missing = "0"},
+    {.column = "icea", .header = "icea", .if_missing = "0"},
+    {.column = "liberty", .header = "liberty", .if_missing = "0"},
+};
+
+static const LoadSpec tariffs_spec = {
+    .name = "tariffs",
+    .table = "prices",
+    .columns = tariff_columns,
+    .num_columns = sizeof(tariff_columns) / sizeof(tariff_columns[0]),
+    .conflict_key = (const char *const[]){"item_id", NULL},
+    .update_columns = (const char *const[]){"cash", "uap", "san_care", "jubilee", "prudential",
+                                            "aar", "saint_catherine", "icea", "liberty", NULL},
+    .joins = "LEFT JOIN inventory_items i ON i.name = s.name AND i.type = s.type",
+    .where = "i.id IS NOT NULL",
+    .client_key = (const char *const[]){"name", "type", NULL},
+};
+
+const LoadSpec *const tariffs_specs[] = {&tariffs_spec, NULL};
+
+// Subcommand for uploading insurer price sheets.
+// Always staged with COPY: the whole sheet is merged by one set-based statement.
+void upload_prices_csv(Subcommand *cmd) {
+    (void)cmd;
+    load_options.strategy = "copy";
+    load_csv("prices", filename, tariffs_specs, 1);
+}
@@ -0,0 +1,671 @@
+#include "../include/profile.h"
+#include "../include/hash.h"
+#include "../include/loader.h"
+#include "../include/strbuf.h"
+#include "../include/timing.h"
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+int profile_top = 10;
+
+#define PROFILE_READ_SIZE (1 << 20)
+#define PROFILE_HLL_BITS 14 // 16K registers per column: about 0.8% standard error.
+#define PROFILE_HLL_REGISTERS (1 << PROFILE_HLL_BITS)
+#define PROFILE_MAX_FIELDS 64 // Field counts tracked one by one; larger ones share a bucket.
+
+// Types a value is checked against, narrowest first.
+typedef enum {
+    TYPE_BOOLEAN,
+    TYPE_INTEGER,
+    TYPE_NUMERIC,
+    TYPE_DATE,
+    NUM_TYPES,
+} ValueType;
+
+static const char *const type_names[NUM_TYPES] = {"boolean", "integer", "numeric", "date"};
+
+#define PROFILE_NONE SIZE_MAX // End of a list, or a free hash slot.
+
+// Space-saving counter: a monitored value, its count and its overestimate. Counters
+// with the same count are linked in their bucket.
+typedef struct {
+    uint64_t hash;
+    StrBuf value; // Reused when the counter is taken over by another value.
+    size_t count;
+    size_t error;
+    size_t bucket;
+    size_t prev;
+    size_t next;
+} TopCounter;
+
+// Counters sharing a count. Buckets are linked by increasing count, so the counter a
+// new value takes over is the first of the first bucket.
+typedef struct {
+    size_t count;
+    size_t first;
+    size_t prev;
+    size_t next;
+} TopBucket;
+
+// Stream-summary of the space-saving counters of a column: a hash table finds the
+// counter of a value and the buckets keep the counters ordered, so that each value
+// is counted in constant time.
+typedef struct {
+    TopCounter *counters;
+    size_t num_counters;
+    size_t cap;
+    TopBucket *buckets; // cap + 1: a bucket is taken before the one it replaces is freed.
+    size_t min_bucket;
+    size_t free_buckets; // Unused buckets, linked through next.
+    size_t *slots;       // Counter of each value by hash, linear probing.
+    size_t mask;
+} TopSummary;
+
+typedef struct {
+    char *name;
+    size_t nulls; // Missing from short rows, or \N or NULL.
+    size_t empty; // Empty or only spaces.
+    size_t values;
+    size_t matches[NUM_TYPES]; // Values that parse as each type.
+
+    // Smallest and largest value bytewise, and numerically among the numbers. Empty
+    // until a value is seen.
+    StrBuf min;
+    StrBuf max;
+    StrBuf num_min;
+    StrBuf num_max;
+    double num_min_value;
+    double num_max_value;
+
+    uint8_t *registers; // HyperLogLog.
+    TopSummary top;
+} ColumnProfile;
+
+typedef struct {
+    ColumnProfile *columns;
+    size_t num_columns;
+    size_t rows;
+    size_t field_counts[PROFILE_MAX_FIELDS + 1];
+    size_t top_slots; // Space-saving counters per column.
+} Profile;
+
+// ======================= Value checks =======================
+
+static bool is_integer(const char *s, size_t len) {
+    size_t i = len > 0 && (s[0] == '-' || s[0] == '+');
+    if (i == len)
+        return false;
+    for (; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9')
+            return false;
+    }
+    return true;
+}
+
+static bool is_numeric(const char *s, size_t len) {
+    size_t i = len > 0 && (s[0] == '-' || s[0] == '+'), digits = 0;
+    while (i < len && s[i] >= '0' && s[i] <= '9') {
+        i++, digits++;
+    }
+    if (i < len && s[i] == '.') {
+        i++;
+        while (i < len && s[i] >= '0' && s[i] <= '9') {
+            i++, digits++;
+        }
+    }
+    if (digits == 0)
+        return false;
+
+    if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+        i++;
+        if (i < len && (s[i] == '-' || s[i] == '+')) {
+            i++;
+        }
+        if (i == len)
+            return false;
+        while (i < len && s[i] >= '0' && s[i] <= '9') {
+            i++;
+        }
+    }
+    return i == len;
+}
+
+// ISO dates, YYYY-MM-DD.
+static bool is_date(const char *s, size_t len) {
+    if (len != 10 || s[4] != '-' || s[7] != '-')
+        return false;
+    for (size_t i = 0; i < len; i++) {
+        if (i != 4 && i != 7 && (s[i] < '0' || s[i] > '9'))
+            return false;
+    }
+
+    int month = (s[5] - '0') * 10 + (s[6] - '0'), day = (s[8] - '0') * 10 + (s[9] - '0');
+    return month >= 1 && month <= 12 && day >= 1 && day <= 31;
+}
+
+static bool is_boolean(const char *s, size_t len) {
+    static const char *const words[] = {"true", "false", "t", "f", "yes", "no"};
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        if (len == strlen(words[i]) && strncasecmp(s, words[i], len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// ======================= Sketches =======================
+
+static void hll_add(uint8_t *registers, uint64_t hash) {
+    size_t index = hash >> (64 - PROFILE_HLL_BITS);
+    uint64_t rest = (hash << PROFILE_HLL_BITS) | (1ULL << (PROFILE_HLL_BITS - 1));
+    uint8_t rank = (uint8_t)(__builtin_clzll(rest) + 1);
+    if (rank > registers[index]) {
+        registers[index] = rank;
+    }
+}
+
+static double hll_estimate(const uint8_t *registers) {
+    double m = PROFILE_HLL_REGISTERS, sum = 0;
+    size_t zeros = 0;
+    for (size_t i = 0; i < PROFILE_HLL_REGISTERS; i++) {
+        sum += ldexp(1.0, -registers[i]);
+        zeros += registers[i] == 0;
+    }
+
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+    // Small cardinalities are counted more precisely from the empty registers.
+    if (estimate <= 2.5 * m && zeros > 0) {
+        estimate = m * log(m / zeros);
+    }
+    return estimate;
+}
+
+static void top_init(TopSummary *t, size_t cap) {
+    size_t size = 16;
+    while (size < 2 * cap) {
+        size <<= 1;
+    }
+
+    *t = (TopSummary){.cap = cap, .min_bucket = PROFILE_NONE, .mask = size - 1};
+    t->counters = calloc(cap, sizeof(TopCounter));
+    t->buckets = malloc((cap + 1) * sizeof(TopBucket));
+    t->slots = malloc(size * sizeof(size_t));
+    if (!t->counters || !t->buckets || !t->slots) {
+        LOG_FATAL("out of memory");
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        t->slots[i] = PROFILE_NONE;
+    }
+    for (size_t i = 0; i <= cap; i++) {
+        t->buckets[i].next = i < cap ? i + 1 : PROFILE_NONE;
+    }
+}
+
+static void top_free(TopSummary *t) {
+    for (size_t i = 0; i < t->num_counters; i++) {
+        sb_free(&t->counters[i].value);
+    }
+    free(t->counters);
+    free(t->buckets);
+    free(t->slots);
+}
+
+// Slot of the counter of a value, or the free slot it would take.
+static size_t top_find(const TopSummary *t, uint64_t hash, const char *value, size_t len) {
+    size_t i = hash & t->mask;
+    while (t->slots[i] != PROFILE_NONE) {
+        const TopCounter *c = &t->counters[t->slots[i]];
+        if (c->hash == hash && c->value.len == len && memcmp(c->value.data, value, len) == 0)
+            return i;
+        i = (i + 1) & t->mask;
+    }
+    return i;
+}
+
+// Free a slot, moving back the later slots of its run that may not be left behind it.
+static void top_unslot(TopSummary *t, size_t i) {
+    for (size_t j = (i + 1) & t->mask; t->slots[j] != PROFILE_NONE; j = (j + 1) & t->mask) {
+        size_t home = t->counters[t->slots[j]].hash & t->mask;
+        if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i] = PROFILE_NONE;
+}
+
+// Unlink a counter from its bucket, freeing the bucket if it is left empty.
+static void top_detach(TopSummary *t, size_t c) {
+    TopCounter *counter = &t->counters[c];
+    TopBucket *b = &t->buckets[counter->bucket];
+    if (counter->prev != PROFILE_NONE) {
+        t->counters[counter->prev].next = counter->next;
+    } else {
+        b->first = counter->next;
+    }
+    if (counter->next != PROFILE_NONE) {
+        t->counters[counter->next].prev = counter->prev;
+    }
+
+    if (b->first == PROFILE_NONE) {
+        if (b->prev != PROFILE_NONE) {
+            t->buckets[b->prev].next = b->next;
+        } else {
+            t->min_bucket = b->next;
+        }
+        if (b->next != PROFILE_NONE) {
+            t->buckets[b->next].prev = b->prev;
+        }
+        b->next = t->free_buckets;
+        t->free_buckets = counter->bucket;
+    }
+}
+
+// Add one to a counter, moving it to the bucket after its own, which is created if
+// it does not hold the new count. A new counter has no bucket yet.
+static void top_increment(TopSummary *t, size_t c) {
+    TopCounter *counter = &t->counters[c];
+    size_t from = counter->bucket;
+    size_t next = from == PROFILE_NONE ? t->min_bucket : t->buckets[from].next;
+    counter->count++;
+
+    size_t to = next;
+    if (to == PROFILE_NONE || t->buckets[to].count != counter->count) {
+        to = t->free_buckets;
+        t->free_buckets = t->buckets[to].next;
+        t->buckets[to] = (TopBucket){
+            .count = counter->count, .first = PROFILE_NONE, .prev = from, .next = next};
+        if (from != PROFILE_NONE) {
+            t->buckets[from].next = to;
+        } else {
+            t->min_bucket = to;
+        }
+        if (next != PROFILE_NONE) {
+            t->buckets[next].prev = to;
+        }
+    }
+
+    if (from != PROFILE_NONE) {
+        top_detach(t, c);
+    }
+
+    TopBucket *b = &t->buckets[to];
+    counter->bucket = to;
+    counter->prev = PROFILE_NONE;
+    counter->next = b->first;
+    if (b->first != PROFILE_NONE) {
+        t->counters[b->first].prev = c;
+    }
+    b->first = c;
+}
+
+// Count a value in the space-saving summary: a monitored value is incremented; a new
+// one takes over the smallest counter and inherits its count as overestimate.
+static void top_add(TopSummary *t, uint64_t hash, const char *value, size_t len) {
+    size_t slot = top_find(t, hash, value, len);
+    if (t->slots[slot] != PROFILE_NONE) {
+        top_increment(t, t->slots[slot]);
+        return;
+    }
+
+    size_t c;
+    if (t->num_counters < t->cap) {
+        c = t->num_counters++;
+        t->counters[c] = (TopCounter){
+            .bucket = PROFILE_NONE, .prev = PROFILE_NONE, .next = PROFILE_NONE};
+        sb_init(&t->counters[c].value, len + 1);
+    } else {
+        c = t->buckets[t->min_bucket].first;
+        TopCounter *old = &t->counters[c];
+        top_unslot(t, top_find(t, old->hash, old->value.data, old->value.len));
+        old->error = old->count;
+        slot = top_find(t, hash, value, len);
+    }
+
+    TopCounter *counter = &t->counters[c];
+    counter->hash = hash;
+    sb_reset(&counter->value);
+    sb_appendn(&counter->value, value, len);
+    t->slots[slot] = c;
+    top_increment(t, c);
+}
+
+static void set_string(StrBuf *dst, const char *value, size_t len) {
+    sb_reset(dst);
+    sb_appendn(dst, value, len);
+}
+
+// Compare a value with a string bytewise.
+static int compare_value(const char *value, size_t len, const StrBuf *s) {
+    int c = memcmp(value, s->data, len < s->len ? len : s->len);
+    return c != 0 ? c : (len > s->len) - (len < s->len);
+}
+
+static void profile_value(ColumnProfile *col, const char *value, size_t len) {
+    while (len > 0 && *value == ' ') {
+        value++, len--;
+    }
+    while (len > 0 && value[len - 1] == ' ') {
+        len--;
+    }
+
+    if (len == 0) {
+        col->empty++;
+        return;
+    }
+
+    if ((len == 2 && memcmp(value, "\\N", 2) == 0) ||
+        (len == 4 && strncasecmp(value, "null", 4) == 0)) {
+        col->nulls++;
+        return;
+    }
+
+    col->values++;
+    col->matches[TYPE_BOOLEAN] += is_boolean(value, len);
+    col->matches[TYPE_INTEGER] += is_integer(value, len);
+    col->matches[TYPE_DATE] += is_date(value, len);
+
+    if (is_numeric(value, len)) {
+        col->matches[TYPE_NUMERIC]++;
+        char buf[64];
+        double number = len < sizeof(buf) ? (memcpy(buf, value, len), buf[len] = '\0',
+                                             strtod(buf, NULL))
+                                          : NAN;
+        if (!isnan(number) && (col->num_min.len == 0 || number < col->num_min_value)) {
+            col->num_min_value = number;
+            set_string(&col->num_min, value, len);
+        }
+        if (!isnan(number) && (col->num_max.len == 0 || number > col->num_max_value)) {
+            col->num_max_value = number;
+            set_string(&col->num_max, value, len);
+        }
+    }
+
+    if (col->min.len == 0 || compare_value(value, len, &col->min) < 0) {
+        set_string(&col->min, value, len);
+    }
+    if (col->max.len == 0 || compare_value(value, len, &col->max) > 0) {
+        set_string(&col->max, value, len);
+    }
+
+    uint64_t hash = hash64(value, len, 0);
+    hll_add(col->registers, hash);
+    top_add(&col->top, hash, value, len);
+}
+
+// ======================= Streaming CSV =======================
+
+// One record: field values stored back to back, each NUL-terminated.
+typedef struct {
+    StrBuf text;
+    size_t *starts;
+    size_t num_fields;
+    size_t cap_fields;
+} Record;
+
+static void record_end_field(Record *r) {
+    sb_putc(&r->text, '\0');
+    if (r->num_fields + 1 >= r->cap_fields) {
+        r->cap_fields = r->cap_fields ? r->cap_fields * 2 : 64;
+        r->starts = realloc(r->starts, r->cap_fields * sizeof(size_t));
+        if (!r->starts) {
+            LOG_FATAL("out of memory");
+        }
+    }
+    r->starts[++r->num_fields] = r->text.len;
+}
+
+static void record_reset(Record *r) {
+    sb_reset(&r->text);
+    r->num_fields = 0;
+    if (r->starts) {
+        r->starts[0] = 0;
+    }
+}
+
+static void profile_header(Profile *p, const Record *r) {
+    p->num_columns = r->num_fields;
+    p->columns = calloc(p->num_columns ? p->num_columns : 1, sizeof(ColumnProfile));
+    if (!p->columns) {
+        LOG_FATAL("out of memory");
+    }
+
+    for (size_t i = 0; i < p->num_columns; i++) {
+        ColumnProfile *col = &p->columns[i];
+        col->name = strdup(r->text.data + r->starts[i]);
+        col->registers = calloc(PROFILE_HLL_REGISTERS, 1);
+        if (!col->name || !col->registers) {
+            LOG_FATAL("out of memory");
+        }
+        top_init(&col->top, p->top_slots);
+        sb_init(&col->min, 32);
+        sb_init(&col->max, 32);
+        sb_init(&col->num_min, 32);
+        sb_init(&col->num_max, 32);
+    }
+}
+
+static void profile_record(Profile *p, const Record *r) {
+    // A line with nothing on it is not a row.
+    if (r->num_fields == 1 && r->starts[1] == 1)
+        return;
+
+    if (!p->columns) {
+        profile_header(p, r);
+        return;
+    }
+
+    p->rows++;
+    p->field_counts[r->num_fields < PROFILE_MAX_FIELDS ? r->num_fields : PROFILE_MAX_FIELDS]++;
+    for (size_t i = 0; i < p->num_columns; i++) {
+        ColumnProfile *col = &p->columns[i];
+        if (i >= r->num_fields) {
+            col->nulls++;
+            continue;
+        }
+
+        size_t start = r->starts[i], len = r->starts[i + 1] - start - 1;
+        profile_value(col, r->text.data + start, len);
+    }
+}
+
+// Split the file into records (RFC 4180: quoted fields may hold commas, quotes
+// doubled, and line breaks) and profile each one as soon as it ends.
+static void profile_stream(Profile *p, FILE *f) {
+    char *buf = malloc(PROFILE_READ_SIZE);
+    Record r = {0};
+    sb_init(&r.text, 4096);
+    r.cap_fields = 64;
+    r.starts = calloc(r.cap_fields, sizeof(size_t));
+    if (!buf || !r.starts) {
+        LOG_FATAL("out of memory");
+    }
+
+    bool quoted = false, quote_seen = false, pending = false;
+    size_t n;
+    while ((n = fread(buf, 1, PROFILE_READ_SIZE, f)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            char c = buf[i];
+            if (quoted) {
+                if (c == '"') {
+                    quoted = false;
+                    quote_seen = true;
+                } else {
+                    sb_putc(&r.text, c);
+                }
+                continue;
+            }
+
+            if (c == '"') {
+                // A doubled quote inside a quoted field is a literal quote.
+                if (quote_seen) {
+                    sb_putc(&r.text, '"');
+                }
+                quoted = true;
+                quote_seen = false;
+                pending = true;
+                continue;
+            }
+            quote_seen = false;
+
+            if (c == ',') {
+                record_end_field(&r);
+                pending = true;
+            } else if (c == '\n') {
+                record_end_field(&r);
+                profile_record(p, &r);
+                record_reset(&r);
+                pending = false;
+            } else if (c != '\r') {
+                sb_putc(&r.text, c);
+                pending = true;
+            }
+        }
+    }
+
+    if (ferror(f)) {
+        LOG_FATAL("read failed: %s", strerror(errno));
+    }
+
+    // Last record without a line break.
+    if (pending || r.text.len > 0) {
+        record_end_field(&r);
+        profile_record(p, &r);
+    }
+
+    sb_free(&r.text);
+    free(r.starts);
+    free(buf);
+}
+
+// ======================= Report =======================
+
+static int compare_counters(const void *a, const void *b) {
+    const TopCounter *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+static void report_column(ColumnProfile *col) {
+    const char *type = col->values == 0 ? "empty" : "text";
+    ValueType found = NUM_TYPES;
+    for (ValueType t = 0; t < NUM_TYPES && col->values > 0; t++) {
+        if (col->matches[t] == col->values) {
+            type = type_names[t];
+            found = t;
+            break;
+        }
+    }
+
+    bool numeric = found == TYPE_INTEGER || found == TYPE_NUMERIC;
+    const StrBuf *min = numeric ? &col->num_min : &col->min;
+    const StrBuf *max = numeric ? &col->num_max : &col->max;
+    printf("%s: %s, %zu null, %zu empty, ~%.0f distinct", col->name, type, col->nulls, col->empty,
+           col->values ? hll_estimate(col->registers) : 0.0);
+    if (min->len > 0) {
+        printf(", min \"%s\", max \"%s\"", min->data, max->data);
+    }
+    putchar('\n');
+
+    // Why a column is text: the closest type and how many values miss it.
+    if (found == NUM_TYPES && col->values > 0) {
+        ValueType closest = TYPE_BOOLEAN;
+        for (ValueType t = 1; t < NUM_TYPES; t++) {
+            if (col->matches[t] > col->matches[closest]) {
+                closest = t;
+            }
+        }
+        if (col->matches[closest] > 0) {
+            printf("  %zu value(s) are not %s\n", col->values - col->matches[closest],
+                   type_names[closest]);
+        }
+    }
+
+    // Sorting breaks the bucket links, which are not needed any more.
+    TopSummary *top = &col->top;
+    qsort(top->counters, top->num_counters, sizeof(TopCounter), compare_counters);
+    size_t shown = top->num_counters < (size_t)profile_top ? top->num_counters
+                                                           : (size_t)profile_top;
+    for (size_t i = 0; i < shown; i++) {
+        // Values that may have been seen only once are not frequent, just late.
+        const TopCounter *c = &top->counters[i];
+        if (c->count - c->error < 2)
+            continue;
+        if (c->error > 0) {
+            printf("  %zu-%zu  \"%s\"\n", c->count - c->error, c->count, c->value.data);
+        } else {
+            printf("  %zu  \"%s\"\n", c->count, c->value.data);
+        }
+    }
+}
+
+static void report(const Profile *p) {
+    printf("%zu row(s), %zu column(s)\n", p->rows, p->num_columns);
+    for (size_t n = 0; n <= PROFILE_MAX_FIELDS; n++) {
+        if (p->field_counts[n] > 0 && n != p->num_columns) {
+            printf("%zu row(s) with %s%zu field(s)\n", p->field_counts[n],
+                   n == PROFILE_MAX_FIELDS ? "at least " : "", n);
+        }
+    }
+
+    // The field count check of each loader.
+    const struct {
+        const char *name;
+        const LoadSpec *spec;
+    } loaders[] = {
+        {"pricelist", pricelist_specs[0]},
+        {"invoices", invoices_specs[0]},
+        {"users", users_specs[0]},
+    };
+    for (size_t i = 0; i < sizeof(loaders) / sizeof(loaders[0]); i++) {
+        size_t expected = loaders[i].spec->expected_fields;
+        size_t matching = expected < PROFILE_MAX_FIELDS ? p->field_counts[expected] : 0;
+        printf("%s expects %zu fields: %zu row(s) would fail\n", loaders[i].name, expected,
+               p->rows - matching);
+    }
+
+    for (size_t i = 0; i < p->num_columns; i++) {
+        report_column(&p->columns[i]);
+    }
+}
+
+void profile_csv(Subcommand *cmd) {
+    (void)cmd;
+    if (profile_top <= 0) {
+        LOG_FATAL("--top must be positive, got %d", profile_top);
+    }
+
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        LOG_FATAL("unable to open %s: %s", filename, strerror(errno));
+    }
+
+    // Space-saving finds every value more frequent than rows / slots; extra slots
+    // make the counts of the top values exact more often.
+    Profile p = {.top_slots = (size_t)profile_top * 8 < 64 ? 64 : (size_t)profile_top * 8};
+    double start = now_ms();
+    profile_stream(&p, f);
+    fclose(f);
+
+    if (!p.columns) {
+        LOG_FATAL("%s is empty", filename);
+    }
+    report(&p);
+    LOG_INFO("Profiled %s in %.1f ms", filename, now_ms() - start);
+
+    for (size_t i = 0; i < p.num_columns; i++) {
+        ColumnProfile *col = &p.columns[i];
+        top_free(&col->top);
+        free(col->registers);
+        free(col->name);
+        sb_free(&col->min);
+        sb_free(&col->max);
+        sb_free(&col->num_min);
+        sb_free(&col->num_max);
+    }
+    free(p.columns);
+}
@@ -0,0 +1,494 @@
+#include "../include/record.h"
+#include "../include/timing.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+// File layout: the magic, then entries of
+//   u8 op, u32 number of arguments, u64 microseconds since record_open,
+//   per argument an i32 length (-1 for NULL) and its bytes.
+// Calls are followed by an OP_RESULT entry when they return a result: status, tuples,
+// affected rows, microseconds spent waiting, then the values of the first row.
+#define RECORD_MAGIC "ECREC1\n"
+#define REPLAY_MAX_MISMATCHES 10 // Mismatching results described one by one.
+
+typedef enum {
+    OP_EXEC = 1,
+    OP_EXEC_PARAMS,
+    OP_PREPARE,
+    OP_EXEC_PREPARED,
+    OP_SEND_PREPARED,
+    OP_ENTER_PIPELINE,
+    OP_EXIT_PIPELINE,
+    OP_PIPELINE_SYNC,
+    OP_GET_RESULT,
+    OP_PUT_COPY_DATA,
+    OP_PUT_COPY_END,
+    OP_RESULT,
+    OP_SEND_PARAMS, // After OP_RESULT so that earlier recordings keep their codes.
+    NUM_OPS,
+} RecordOp;
+
+static const char *const op_names[NUM_OPS] = {
+    [OP_EXEC] = "exec",
+    [OP_EXEC_PARAMS] = "exec_params",
+    [OP_PREPARE] = "prepare",
+    [OP_EXEC_PREPARED] = "exec_prepared",
+    [OP_SEND_PREPARED] = "send_prepared",
+    [OP_ENTER_PIPELINE] = "enter_pipeline",
+    [OP_EXIT_PIPELINE] = "exit_pipeline",
+    [OP_PIPELINE_SYNC] = "pipeline_sync",
+    [OP_GET_RESULT] = "get_result",
+    [OP_PUT_COPY_DATA] = "put_copy_data",
+    [OP_PUT_COPY_END] = "put_copy_end",
+    [OP_RESULT] = "result",
+    [OP_SEND_PARAMS] = "send_params",
+};
+
+static FILE *recording = NULL;
+static const char *recording_path = NULL;
+static double record_origin = 0;
+
+bool replay_fast = false;
+
+// ======================= Recording =======================
+
+static void record_close(void) {
+    if (fclose(recording) != 0) {
+        LOG_ERROR("unable to write recording %s: %s", recording_path, strerror(errno));
+    }
+    recording = NULL;
+}
+
+void record_open(const char *path) {
+    if (recording)
+        return;
+
+    recording = fopen(path, "wb");
+    if (!recording) {
+        LOG_FATAL("unable to create recording %s: %s", path, strerror(errno));
+    }
+
+    recording_path = path;
+    record_origin = now_ms();
+    fwrite(RECORD_MAGIC, 1, sizeof(RECORD_MAGIC), recording);
+    if (atexit(record_close) != 0) {
+        LOG_FATAL("unable to register the recording writer");
+    }
+}
+
+static void write_string(const char *s, int32_t len) {
+    if (s && len < 0) {
+        len = (int32_t)strlen(s);
+    } else if (!s) {
+        len = -1;
+    }
+
+    fwrite(&len, sizeof(len), 1, recording);
+    if (len > 0) {
+        fwrite(s, 1, (size_t)len, recording);
+    }
+}
+
+// Entry header; nargs counts the arguments written after it.
+static void write_entry(RecordOp op, double at, uint32_t nargs) {
+    uint8_t code = (uint8_t)op;
+    uint64_t t = (uint64_t)((at - record_origin) * 1e3);
+    fwrite(&code, sizeof(code), 1, recording);
+    fwrite(&nargs, sizeof(nargs), 1, recording);
+    fwrite(&t, sizeof(t), 1, recording);
+}
+
+// A call with up to two fixed arguments followed by its parameters.
+static void write_call(RecordOp op, double at, const char *a, const char *b, int nparams,
+                       const char *const *values) {
+    write_entry(op, at, (a != NULL) + (b != NULL) + (uint32_t)nparams);
+    if (a) {
+        write_string(a, -1);
+    }
+    if (b) {
+        write_string(b, -1);
+    }
+    for (int i = 0; i < nparams; i++) {
+        write_string(values[i], -1);
+    }
+}
+
+static void write_result(const PGresult *r, double start) {
+    double end = now_ms();
+    int nfields = r && PQntuples(r) > 0 ? PQnfields(r) : 0;
+
+    char tuples[24], elapsed[24];
+    snprintf(tuples, sizeof(tuples), "%d", r ? PQntuples(r) : 0);
+    snprintf(elapsed, sizeof(elapsed), "%.0f", (end - start) * 1e3);
+
+    write_entry(OP_RESULT, end, 4 + (uint32_t)nfields);
+    write_string(r ? PQresStatus(PQresultStatus(r)) : NULL, -1);
+    write_string(tuples, -1);
+    write_string(r ? PQcmdTuples((PGresult *)r) : NULL, -1);
+    write_string(elapsed, -1);
+    for (int i = 0; i < nfields; i++) {
+        write_string(PQgetisnull(r, 0, i) ? NULL : PQgetvalue(r, 0, i), -1);
+    }
+}
+
+PGresult *record_exec(PGconn *c, const char *sql) {
+    if (!recording)
+        return PQexec(c, sql);
+
+    double start = now_ms();
+    write_call(OP_EXEC, start, sql, NULL, 0, NULL);
+    PGresult *r = PQexec(c, sql);
+    write_result(r, start);
+    return r;
+}
+
+PGresult *record_exec_params(PGconn *c, const char *sql, int nparams,
+                             const char *const *values) {
+    if (!recording)
+        return PQexecParams(c, sql, nparams, NULL, values, NULL, NULL, 0);
+
+    double start = now_ms();
+    write_call(OP_EXEC_PARAMS, start, sql, NULL, nparams, values);
+    PGresult *r = PQexecParams(c, sql, nparams, NULL, values, NULL, NULL, 0);
+    write_result(r, start);
+    return r;
+}
+
+PGresult *record_prepare(PGconn *c, const char *name, const char *sql, int nparams) {
+    if (!recording)
+        return PQprepare(c, name, sql, nparams, NULL);
+
+    char count[16];
+    snprintf(count, sizeof(count), "%d", nparams);
+    const char *const values[1] = {count};
+
+    double start = now_ms();
+    write_call(OP_PREPARE, start, name, sql, 1, values);
+    PGresult *r = PQprepare(c, name, sql, nparams, NULL);
+    write_result(r, start);
+    return r;
+}
+
+PGresult *record_exec_prepared(PGconn *c, const char *name, int nparams,
+                               const char *const *values) {
+    if (!recording)
+        return PQexecPrepared(c, name, nparams, values, NULL, NULL, 0);
+
+    double start = now_ms();
+    write_call(OP_EXEC_PREPARED, start, name, NULL, nparams, values);
+    PGresult *r = PQexecPrepared(c, name, nparams, values, NULL, NULL, 0);
+    write_result(r, start);
+    return r;
+}
+
+int record_send_prepared(PGconn *c, const char *name, int nparams, const char *const *values) {
+    if (recording) {
+        write_call(OP_SEND_PREPARED, now_ms(), name, NULL, nparams, values);
+    }
+    return PQsendQueryPrepared(c, name, nparams, values, NULL, NULL, 0);
+}
+
+int record_send_params(PGconn *c, const char *sql, int nparams, const char *const *values) {
+    if (recording) {
+        write_call(OP_SEND_PARAMS, now_ms(), sql, NULL, nparams, values);
+    }
+    return PQsendQueryParams(c, sql, nparams, NULL, values, NULL, NULL, 0);
+}
+
+int record_enter_pipeline(PGconn *c) {
+    if (recording) {
+        write_entry(OP_ENTER_PIPELINE, now_ms(), 0);
+    }
+    return PQenterPipelineMode(c);
+}
+
+int record_exit_pipeline(PGconn *c) {
+    if (recording) {
+        write_entry(OP_EXIT_PIPELINE, now_ms(), 0);
+    }
+    return PQexitPipelineMode(c);
+}
+
+int record_pipeline_sync(PGconn *c) {
+    if (recording) {
+        write_entry(OP_PIPELINE_SYNC, now_ms(), 0);
+    }
+    return PQpipelineSync(c);
+}
+
+PGresult *record_get_result(PGconn *c) {
+    if (!recording)
+        return PQgetResult(c);
+
+    double start = now_ms();
+    write_entry(OP_GET_RESULT, start, 0);
+    PGresult *r = PQgetResult(c);
+    write_result(r, start);
+    return r;
+}
+
+int record_put_copy_data(PGconn *c, const char *data, int len) {
+    if (recording) {
+        write_entry(OP_PUT_COPY_DATA, now_ms(), 1);
+        write_string(data, len);
+    }
+    return PQputCopyData(c, data, len);
+}
+
+int record_put_copy_end(PGconn *c) {
+    if (recording) {
+        write_entry(OP_PUT_COPY_END, now_ms(), 0);
+    }
+    return PQputCopyEnd(c, NULL);
+}
+
+// ======================= Replay =======================
+
+typedef struct {
+    RecordOp op;
+    uint64_t t;
+    uint32_t nargs;
+    char **args; // NUL-terminated copies; NULL for SQL NULL.
+    int32_t *lens;
+    uint32_t cap;
+} Entry;
+
+static void read_exact(FILE *f, void *buf, size_t len) {
+    if (fread(buf, 1, len, f) != len) {
+        LOG_FATAL("recording %s is truncated", filename);
+    }
+}
+
+// Read the next entry over the previous one. Returns false at the end of the file.
+static bool read_entry(FILE *f, Entry *e) {
+    for (uint32_t i = 0; i < e->nargs; i++) {
+        free(e->args[i]);
+    }
+
+    uint8_t code;
+    if (fread(&code, sizeof(code), 1, f) != 1) {
+        e->nargs = 0;
+        return false;
+    }
+
+    read_exact(f, &e->nargs, sizeof(e->nargs));
+    read_exact(f, &e->t, sizeof(e->t));
+    if (code == 0 || code >= NUM_OPS) {
+        LOG_FATAL("recording %s has an unknown entry %u", filename, code);
+    }
+    e->op = (RecordOp)code;
+
+    if (e->nargs > e->cap) {
+        e->cap = e->nargs;
+        e->args = realloc(e->args, e->cap * sizeof(char *));
+        e->lens = realloc(e->lens, e->cap * sizeof(int32_t));
+        if (!e->args || !e->lens) {
+            LOG_FATAL("out of memory");
+        }
+    }
+
+    for (uint32_t i = 0; i < e->nargs; i++) {
+        read_exact(f, &e->lens[i], sizeof(int32_t));
+        e->args[i] = NULL;
+        if (e->lens[i] < 0)
+            continue;
+
+        e->args[i] = malloc((size_t)e->lens[i] + 1);
+        if (!e->args[i]) {
+            LOG_FATAL("out of memory");
+        }
+        read_exact(f, e->args[i], (size_t)e->lens[i]);
+        e->args[i][e->lens[i]] = '\0';
+    }
+    return true;
+}
+
+typedef struct {
+    size_t calls;
+    double recorded_ms; // Waits for the results of these calls, as recorded and replayed.
+    double replayed_ms;
+} OpStats;
+
+typedef struct {
+    OpStats ops[NUM_OPS];
+    size_t results;
+    size_t mismatches;
+    size_t failures; // Calls that libpq refused, e.g. sends on a broken pipeline.
+    RecordOp last_op;
+    PGresult *pending; // Result of the last call, compared with the next OP_RESULT.
+    double pending_ms;
+    char *last_sql;
+} Replay;
+
+static bool same(const char *a, const char *b) {
+    return (a == NULL && b == NULL) || (a && b && strcmp(a, b) == 0);
+}
+
+// e.g "PGRES_TUPLES_OK, 1 row(s)" or "PGRES_COMMAND_OK, 20 affected".
+static void describe(char *buf, size_t size, const char *status, const char *tuples,
+                     const char *affected) {
+    if (!status) {
+        snprintf(buf, size, "no result");
+    } else if (affected && *affected) {
+        snprintf(buf, size, "%s, %s affected", status, affected);
+    } else {
+        snprintf(buf, size, "%s, %s row(s)", status, tuples ? tuples : "0");
+    }
+}
+
+// Compare the replayed result with the recorded one: status, tuples and affected rows.
+static void replay_compare(Replay *rp, const Entry *e) {
+    if (e->nargs < 4) {
+        LOG_FATAL("recording %s has a malformed result", filename);
+    }
+
+    const PGresult *r = rp->pending;
+    OpStats *stats = &rp->ops[rp->last_op];
+    stats->recorded_ms += e->args[3] ? atof(e->args[3]) / 1e3 : 0;
+    stats->replayed_ms += rp->pending_ms;
+    rp->results++;
+
+    char tuples[24];
+    snprintf(tuples, sizeof(tuples), "%d", r ? PQntuples(r) : 0);
+    const char *status = r ? PQresStatus(PQresultStatus(r)) : NULL;
+    const char *affected = r ? PQcmdTuples(rp->pending) : NULL;
+    if (same(status, e->args[0]) && same(tuples, e->args[1]) && same(affected, e->args[2]))
+        return;
+
+    if (++rp->mismatches <= REPLAY_MAX_MISMATCHES) {
+        char recorded[96], replayed[96];
+        describe(recorded, sizeof(recorded), e->args[0], e->args[1], e->args[2]);
+        describe(replayed, sizeof(replayed), status, tuples, affected);
+        LOG_ERROR("%s at %.3f s (%.120s): recorded %s, replayed %s %s", op_names[rp->last_op],
+                  e->t / 1e6, rp->last_sql ? rp->last_sql : "", recorded, replayed,
+                  r ? PQresultErrorMessage(r) : "");
+    }
+}
+
+static void set_pending(Replay *rp, PGresult *r, double start) {
+    PQclear(rp->pending);
+    rp->pending = r;
+    rp->pending_ms = now_ms() - start;
+}
+
+static void set_sql(Replay *rp, const char *sql) {
+    free(rp->last_sql);
+    rp->last_sql = sql ? strdup(sql) : NULL;
+}
+
+static void replay_call(Replay *rp, const Entry *e) {
+    const char *const *a = (const char *const *)e->args;
+    int n = (int)e->nargs;
+    double start = now_ms();
+    int ok = 1;
+
+    switch (e->op) {
+    case OP_EXEC:
+        set_sql(rp, a[0]);
+        set_pending(rp, PQexec(conn, a[0]), start);
+        break;
+    case OP_EXEC_PARAMS:
+        set_sql(rp, a[0]);
+        set_pending(rp, PQexecParams(conn, a[0], n - 1, NULL, a + 1, NULL, NULL, 0), start);
+        break;
+    case OP_PREPARE:
+        set_sql(rp, a[1]);
+        set_pending(rp, PQprepare(conn, a[0], a[1], atoi(a[2]), NULL), start);
+        break;
+    case OP_EXEC_PREPARED:
+        set_sql(rp, a[0]);
+        set_pending(rp, PQexecPrepared(conn, a[0], n - 1, a + 1, NULL, NULL, 0), start);
+        break;
+    case OP_SEND_PREPARED:
+        set_sql(rp, a[0]);
+        ok = PQsendQueryPrepared(conn, a[0], n - 1, a + 1, NULL, NULL, 0);
+        break;
+    case OP_SEND_PARAMS:
+        set_sql(rp, a[0]);
+        ok = PQsendQueryParams(conn, a[0], n - 1, NULL, a + 1, NULL, NULL, 0);
+        break;
+    case OP_ENTER_PIPELINE:
+        ok = PQenterPipelineMode(conn);
+        break;
+    case OP_EXIT_PIPELINE:
+        ok = PQexitPipelineMode(conn);
+        break;
+    case OP_PIPELINE_SYNC:
+        ok = PQpipelineSync(conn);
+        break;
+    case OP_GET_RESULT:
+        set_pending(rp, PQgetResult(conn), start);
+        break;
+    case OP_PUT_COPY_DATA:
+        ok = PQputCopyData(conn, a[0], e->lens[0]) == 1;
+        break;
+    case OP_PUT_COPY_END:
+        ok = PQputCopyEnd(conn, NULL) == 1;
+        break;
+    case OP_RESULT:
+    case NUM_OPS:
+        break;
+    }
+
+    rp->ops[e->op].calls++;
+    rp->last_op = e->op;
+    if (!ok && ++rp->failures <= REPLAY_MAX_MISMATCHES) {
+        LOG_ERROR("%s at %.3f s failed: %s", op_names[e->op], e->t / 1e6, PQerrorMessage(conn));
+    }
+}
+
+void replay_recording(Subcommand *cmd) {
+    (void)cmd;
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        LOG_FATAL("unable to open %s: %s", filename, strerror(errno));
+    }
+
+    char magic[sizeof(RECORD_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0) {
+        LOG_FATAL("%s is not an eclinic recording", filename);
+    }
+
+    Replay rp = {0};
+    Entry e = {0};
+    uint64_t last_t = 0;
+    double start = now_ms();
+    while (read_entry(f, &e)) {
+        last_t = e.t;
+        if (e.op == OP_RESULT) {
+            replay_compare(&rp, &e);
+            continue;
+        }
+
+        // At the recorded pace, each call waits for its offset from the start.
+        if (!replay_fast) {
+            sleep_ms(e.t / 1e3 - (now_ms() - start));
+        }
+        replay_call(&rp, &e);
+    }
+    double elapsed = now_ms() - start;
+
+    PQclear(rp.pending);
+    free(rp.last_sql);
+    free(e.args);
+    free(e.lens);
+    fclose(f);
+
+    printf("%-16s %10s %14s %14s\n", "call", "count", "recorded ms", "replayed ms");
+    for (int op = OP_EXEC; op < NUM_OPS; op++) {
+        const OpStats *s = &rp.ops[op];
+        if (s->calls > 0) {
+            printf("%-16s %10zu %14.1f %14.1f\n", op_names[op], s->calls, s->recorded_ms,
+                   s->replayed_ms);
+        }
+    }
+
+    LOG_INFO("Replayed %s in %.1f ms (recorded %.1f ms): %zu result(s), %zu mismatch(es), "
+             "%zu failed call(s)",
+             filename, elapsed, last_t / 1e3, rp.results, rp.mismatches, rp.failures);
+    if (rp.mismatches > 0 || rp.failures > 0) {
+        LOG_FATAL("the replay of %s did not match the recording", filename);
+    }
+}
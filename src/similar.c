@@ -0,0 +1,523 @@
+#include "../include/similar.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+bool check_similar = false;
+
+#define SIMILAR_MAX_THREADS 16
+#define SIMILAR_ROWS_PER_THREAD 1024
+#define SIMILAR_CHARS_PER_EDIT 10 // Name length that allows one more edit.
+#define SIMILAR_MAX_EDITS 3
+#define SIMILAR_CHEAP_LIST 16 // Lists of up to 1/16 of the names are always read.
+#define NO_MATCH SIZE_MAX
+
+// An item name prepared for comparison.
+typedef struct {
+    const char *name; // As written.
+    const char *type;
+    const char *id; // Existing items only.
+    char *norm;     // Lowercase letters and digits, words separated by one space.
+    size_t len;
+} Name;
+
+static void normalize_name(Name *n) {
+    size_t len = strlen(n->name);
+    n->norm = malloc(len + 1);
+    if (!n->norm) {
+        LOG_FATAL("out of memory");
+    }
+
+    size_t j = 0;
+    bool gap = false;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)n->name[i];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+
+        // Bytes of multibyte characters are kept as they are.
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) {
+            if (gap && j > 0) {
+                n->norm[j++] = ' ';
+            }
+            n->norm[j++] = (char)c;
+            gap = false;
+        } else {
+            gap = true;
+        }
+    }
+    n->norm[j] = '\0';
+    n->len = j;
+}
+
+// Order of a name relative to the names of a type and length.
+static int name_order(const Name *n, const char *type, size_t len) {
+    int c = strcasecmp(n->type, type);
+    if (c != 0)
+        return c;
+    return (n->len > len) - (n->len < len);
+}
+
+static int compare_names(const void *a, const void *b) {
+    const Name *y = b;
+    return name_order(a, y->type, y->len);
+}
+
+// ======================= 3-gram index =======================
+
+typedef struct {
+    uint32_t gram;
+    uint32_t name;
+} Posting;
+
+// Inverted index from the 3-grams of the existing names to the names containing them.
+// Names are sorted by type and length so that each list can be cut to the names of
+// the same type and the lengths in reach.
+typedef struct {
+    const Name *names;
+    size_t num_names;
+    uint32_t *grams; // Distinct grams, sorted.
+    size_t *offsets; // Names containing grams[i] are items[offsets[i]..offsets[i + 1]).
+    uint32_t *items; // Name indexes, ascending within each gram.
+    size_t num_grams;
+} GramIndex;
+
+// Distinct 3-grams of s, sorted. Names shorter than a gram have one short gram.
+// out must have room for max(len - 2, 1) grams.
+static size_t name_grams(const char *s, size_t len, uint32_t *out) {
+    const unsigned char *u = (const unsigned char *)s;
+    if (len < 3) {
+        out[0] = (len > 0 ? (uint32_t)u[0] << 16 : 0) | (len > 1 ? (uint32_t)u[1] << 8 : 0);
+        return 1;
+    }
+
+    size_t n = len - 2;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (uint32_t)u[i] << 16 | (uint32_t)u[i + 1] << 8 | u[i + 2];
+    }
+
+    // Insertion sort: names are short.
+    for (size_t i = 1; i < n; i++) {
+        uint32_t g = out[i];
+        size_t j = i;
+        while (j > 0 && out[j - 1] > g) {
+            out[j] = out[j - 1];
+            j--;
+        }
+        out[j] = g;
+    }
+
+    size_t distinct = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (distinct == 0 || out[distinct - 1] != out[i]) {
+            out[distinct++] = out[i];
+        }
+    }
+    return distinct;
+}
+
+static int compare_postings(const void *a, const void *b) {
+    const Posting *x = a, *y = b;
+    if (x->gram != y->gram)
+        return x->gram < y->gram ? -1 : 1;
+    return (x->name > y->name) - (x->name < y->name);
+}
+
+static void index_build(GramIndex *index, const Name *names, size_t num_names) {
+    *index = (GramIndex){.names = names, .num_names = num_names};
+
+    size_t total = 0, longest = 0;
+    for (size_t i = 0; i < num_names; i++) {
+        total += names[i].len > 2 ? names[i].len - 2 : 1;
+        if (names[i].len > longest) {
+            longest = names[i].len;
+        }
+    }
+
+    Posting *postings = malloc((total ? total : 1) * sizeof(Posting));
+    uint32_t *grams = malloc((longest + 1) * sizeof(uint32_t));
+    if (!postings || !grams) {
+        LOG_FATAL("out of memory");
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < num_names; i++) {
+        size_t ng = name_grams(names[i].norm, names[i].len, grams);
+        for (size_t g = 0; g < ng; g++) {
+            postings[n++] = (Posting){.gram = grams[g], .name = (uint32_t)i};
+        }
+    }
+    qsort(postings, n, sizeof(Posting), compare_postings);
+
+    index->grams = malloc((n ? n : 1) * sizeof(uint32_t));
+    index->offsets = malloc((n + 1) * sizeof(size_t));
+    index->items = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (!index->grams || !index->offsets || !index->items) {
+        LOG_FATAL("out of memory");
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (i == 0 || postings[i].gram != postings[i - 1].gram) {
+            index->grams[index->num_grams] = postings[i].gram;
+            index->offsets[index->num_grams++] = i;
+        }
+        index->items[i] = postings[i].name;
+    }
+    index->offsets[index->num_grams] = n;
+
+    free(postings);
+    free(grams);
+}
+
+static void index_free(GramIndex *index) {
+    free(index->grams);
+    free(index->offsets);
+    free(index->items);
+}
+
+static size_t list_size(const GramIndex *index, size_t pos) {
+    return index->offsets[pos + 1] - index->offsets[pos];
+}
+
+// Position of gram in the index, or num_grams.
+static size_t index_find(const GramIndex *index, uint32_t gram) {
+    size_t lo = 0, hi = index->num_grams;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->grams[mid] < gram) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < index->num_grams && index->grams[lo] == gram ? lo : index->num_grams;
+}
+
+// ======================= Edit distance =======================
+
+// Pattern compiled for bit-parallel edit distance (Myers, Hyyrö): bit i of peq[c]
+// is set where the pattern has byte c at position i, so one text byte updates a
+// whole column of the dynamic programming matrix with a few word operations.
+typedef struct {
+    const char *s;
+    size_t len;
+    uint64_t peq[256];
+} Pattern;
+
+static void pattern_init(Pattern *p, const char *s, size_t len) {
+    p->s = s;
+    p->len = len;
+    memset(p->peq, 0, sizeof(p->peq));
+    for (size_t i = 0; i < len && i < 64; i++) {
+        p->peq[(unsigned char)s[i]] |= 1ULL << i;
+    }
+}
+
+// Row by row Levenshtein distance for patterns longer than a word.
+static size_t distance_rows(const Pattern *p, const char *t, size_t n, size_t k) {
+    size_t *row = malloc((n + 1) * sizeof(size_t));
+    if (!row) {
+        LOG_FATAL("out of memory");
+    }
+
+    for (size_t j = 0; j <= n; j++) {
+        row[j] = j;
+    }
+
+    size_t result = k + 1;
+    for (size_t i = 1; i <= p->len; i++) {
+        size_t diag = row[0], lowest = i;
+        row[0] = i;
+        for (size_t j = 1; j <= n; j++) {
+            size_t up = row[j];
+            size_t best = diag + (p->s[i - 1] != t[j - 1]);
+            if (up + 1 < best) {
+                best = up + 1;
+            }
+            if (row[j - 1] + 1 < best) {
+                best = row[j - 1] + 1;
+            }
+            row[j] = best;
+            diag = up;
+            if (best < lowest) {
+                lowest = best;
+            }
+        }
+
+        // The smallest distance in a row never decreases in the rows below it.
+        if (lowest > k) {
+            free(row);
+            return k + 1;
+        }
+    }
+
+    if (row[n] <= k) {
+        result = row[n];
+    }
+    free(row);
+    return result;
+}
+
+// Levenshtein distance between the pattern and t, or k + 1 if it is larger than k.
+static size_t edit_distance(const Pattern *p, const char *t, size_t n, size_t k) {
+    size_t m = p->len;
+    if (m == 0) {
+        return n <= k ? n : k + 1;
+    }
+
+    if (m > 64) {
+        return distance_rows(p, t, n, k);
+    }
+
+    uint64_t pv = ~0ULL, mv = 0, last = 1ULL << (m - 1);
+    size_t score = m;
+    for (size_t j = 0; j < n; j++) {
+        uint64_t eq = p->peq[(unsigned char)t[j]];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & last) {
+            score++;
+        } else if (mh & last) {
+            score--;
+        }
+
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+
+        // Each remaining byte lowers the distance by at most one.
+        if (score > k + (n - j - 1)) {
+            return k + 1;
+        }
+    }
+    return score <= k ? score : k + 1;
+}
+
+// ======================= Matching =======================
+
+typedef struct {
+    const GramIndex *index;
+    const Name *incoming;
+    size_t start;
+    size_t end;
+    size_t *match;    // Closest existing name of each incoming name, or NO_MATCH.
+    size_t *distance; // Its edit distance.
+} MatchTask;
+
+static void *match_names(void *arg) {
+    MatchTask *task = arg;
+    const GramIndex *index = task->index;
+
+    size_t longest = 0;
+    for (size_t i = task->start; i < task->end; i++) {
+        if (task->incoming[i].len > longest) {
+            longest = task->incoming[i].len;
+        }
+    }
+
+    // Lists each candidate of the current name was found in, cleared as they are compared.
+    uint16_t *counts = calloc(index->num_names ? index->num_names : 1, sizeof(uint16_t));
+    uint32_t *touched = malloc((index->num_names ? index->num_names : 1) * sizeof(uint32_t));
+    uint32_t *grams = malloc((longest + 1) * sizeof(uint32_t));
+    size_t *lists = malloc((longest + 1) * sizeof(size_t));
+    Pattern *pattern = malloc(sizeof(Pattern));
+    if (!counts || !touched || !grams || !lists || !pattern) {
+        LOG_FATAL("out of memory");
+    }
+
+    for (size_t i = task->start; i < task->end; i++) {
+        const Name *a = &task->incoming[i];
+        task->match[i] = NO_MATCH;
+
+        size_t k = a->len / SIMILAR_CHARS_PER_EDIT;
+        k = k < 1 ? 1 : k > SIMILAR_MAX_EDITS ? SIMILAR_MAX_EDITS : k;
+
+        // An edit removes at most 3 grams, so a name within k edits contains all but 3k
+        // of the grams of a. Reading the rarest lists first, any 3k + 1 of them find it;
+        // every further list read raises the number of lists it must be found in.
+        size_t ng = name_grams(a->norm, a->len, grams), nlists = 0;
+        for (size_t g = 0; g < ng; g++) {
+            size_t pos = index_find(index, grams[g]);
+            if (pos < index->num_grams) {
+                lists[nlists++] = pos;
+            }
+        }
+
+        for (size_t x = 1; x < nlists; x++) {
+            size_t pos = lists[x], size = list_size(index, pos);
+            size_t y = x;
+            while (y > 0 && list_size(index, lists[y - 1]) > size) {
+                lists[y] = lists[y - 1];
+                y--;
+            }
+            lists[y] = pos;
+        }
+
+        size_t nread = nlists < 3 * k + 1 ? nlists : 3 * k + 1;
+        size_t cheap = index->num_names / SIMILAR_CHEAP_LIST;
+        if (nread > 0 && list_size(index, lists[nread - 1]) > cheap) {
+            cheap = list_size(index, lists[nread - 1]);
+        }
+        while (nread < nlists && list_size(index, lists[nread]) <= cheap) {
+            nread++;
+        }
+        size_t need = nread > 3 * k ? nread - 3 * k : 1;
+
+        size_t ntouched = 0;
+        size_t min_len = a->len > k ? a->len - k : 0, max_len = a->len + k;
+        for (size_t l = 0; l < nread; l++) {
+            size_t from = index->offsets[lists[l]], to = index->offsets[lists[l] + 1];
+
+            // Skip to the names of the same type long enough to be within k edits.
+            while (from < to) {
+                size_t mid = from + (to - from) / 2;
+                if (name_order(&index->names[index->items[mid]], a->type, min_len) < 0) {
+                    from = mid + 1;
+                } else {
+                    to = mid;
+                }
+            }
+
+            to = index->offsets[lists[l] + 1];
+            for (size_t j = from;
+                 j < to && name_order(&index->names[index->items[j]], a->type, max_len) <= 0; j++) {
+                uint32_t item = index->items[j];
+                if (counts[item]++ == 0) {
+                    touched[ntouched++] = item;
+                }
+            }
+        }
+
+        pattern_init(pattern, a->norm, a->len);
+        size_t best = k + 1, match = NO_MATCH;
+        bool exists = false;
+        for (size_t t = 0; t < ntouched; t++) {
+            uint32_t item = touched[t];
+            size_t found = counts[item];
+            counts[item] = 0;
+
+            const Name *b = &index->names[item];
+            if (found < need)
+                continue;
+
+            // Same conflict key: the row updates this item.
+            if (strcmp(a->name, b->name) == 0 && strcmp(a->type, b->type) == 0) {
+                exists = true;
+                continue;
+            }
+
+            size_t d = edit_distance(pattern, b->norm, b->len, k);
+            if (d < best || (d == best && d <= k && item < match)) {
+                best = d;
+                match = item;
+            }
+        }
+
+        if (!exists) {
+            task->match[i] = match;
+            task->distance[i] = best;
+        }
+    }
+
+    free(counts);
+    free(touched);
+    free(grams);
+    free(lists);
+    free(pattern);
+    return NULL;
+}
+
+size_t similar_report(CsvRow **rows, size_t num_rows, size_t name_field, size_t type_field) {
+    res = PQexec(conn, "SELECT id::text, name, type::text FROM inventory_items "
+                       "WHERE name IS NOT NULL AND type IS NOT NULL ORDER BY id");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("unable to read inventory items: %s", PQerrorMessage(conn));
+    }
+
+    size_t num_existing = (size_t)PQntuples(res);
+    Name *existing = calloc(num_existing ? num_existing : 1, sizeof(Name));
+    Name *incoming = calloc(num_rows ? num_rows : 1, sizeof(Name));
+    size_t *match = malloc((num_rows ? num_rows : 1) * sizeof(size_t));
+    size_t *distance = malloc((num_rows ? num_rows : 1) * sizeof(size_t));
+    if (!existing || !incoming || !match || !distance) {
+        LOG_FATAL("out of memory");
+    }
+
+    for (size_t i = 0; i < num_existing; i++) {
+        existing[i].id = PQgetvalue(res, (int)i, 0);
+        existing[i].name = PQgetvalue(res, (int)i, 1);
+        existing[i].type = PQgetvalue(res, (int)i, 2);
+        normalize_name(&existing[i]);
+    }
+
+    for (size_t i = 0; i < num_rows; i++) {
+        incoming[i].name = rows[i]->fields[name_field];
+        incoming[i].type = rows[i]->fields[type_field];
+        normalize_name(&incoming[i]);
+    }
+
+    qsort(existing, num_existing, sizeof(Name), compare_names);
+    GramIndex index;
+    index_build(&index, existing, num_existing);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cpus > 0 ? (size_t)cpus : 1;
+    if (nthreads > SIMILAR_MAX_THREADS) {
+        nthreads = SIMILAR_MAX_THREADS;
+    }
+    if (nthreads > num_rows / SIMILAR_ROWS_PER_THREAD + 1) {
+        nthreads = num_rows / SIMILAR_ROWS_PER_THREAD + 1;
+    }
+
+    pthread_t threads[SIMILAR_MAX_THREADS];
+    MatchTask tasks[SIMILAR_MAX_THREADS];
+    size_t per_thread = (num_rows + nthreads - 1) / nthreads;
+    for (size_t t = 0; t < nthreads; t++) {
+        size_t start = t * per_thread < num_rows ? t * per_thread : num_rows;
+        size_t end = start + per_thread < num_rows ? start + per_thread : num_rows;
+        tasks[t] = (MatchTask){.index = &index, .incoming = incoming, .start = start,
+                               .end = end, .match = match, .distance = distance};
+    }
+
+    // The calling thread takes the first share.
+    for (size_t t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, match_names, &tasks[t]) != 0) {
+            LOG_FATAL("unable to start matching thread");
+        }
+    }
+    match_names(&tasks[0]);
+    for (size_t t = 1; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    size_t reported = 0;
+    for (size_t i = 0; i < num_rows; i++) {
+        if (match[i] == NO_MATCH)
+            continue;
+
+        const Name *b = &existing[match[i]];
+        LOG_INFO("line %zu: \"%s\" (%s) looks like item %s \"%s\" (%s), %zu edit(s) apart", i + 2,
+                 incoming[i].name, incoming[i].type, b->id, b->name, b->type, distance[i]);
+        reported++;
+    }
+
+    index_free(&index);
+    for (size_t i = 0; i < num_existing; i++) {
+        free(existing[i].norm);
+    }
+    for (size_t i = 0; i < num_rows; i++) {
+        free(incoming[i].norm);
+    }
+    free(existing);
+    free(incoming);
+    free(match);
+    free(distance);
+    FreeResult();
+    return reported;
+}
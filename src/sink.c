@@ -0,0 +1,338 @@
+#include "../include/sink.h"
+#include "../include/log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define SINK_CHUNK_SIZE (1 << 20)
+#define SINK_CHUNKS 4
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Chunk;
+
+struct FileSink {
+    const char *path;
+    FILE *file;
+    Compression compression;
+    size_t written;
+    bool failed; // A write failed. Only the writer sets it; later output is dropped.
+
+    // Ring of chunks: [head, head + filled) wait for the writer and tail is being filled
+    // by the producer. A chunk stays counted until the writer is done with it.
+    Chunk chunks[SINK_CHUNKS];
+    size_t head;
+    size_t tail; // Only touched by the producer.
+    size_t filled;
+    bool closing;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t writer;
+
+    char *out; // Compressed output buffer.
+    size_t out_cap;
+#ifdef HAVE_ZLIB
+    z_stream gz;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+};
+
+Compression compression_parse(const char *name, const char *path) {
+    Compression compression;
+    if (strcmp(name, "auto") == 0) {
+        const char *ext = path ? strrchr(path, '.') : NULL;
+        if (ext && strcmp(ext, ".gz") == 0) {
+            compression = COMPRESS_GZIP;
+        } else if (ext && strcmp(ext, ".zst") == 0) {
+            compression = COMPRESS_ZSTD;
+        } else {
+            compression = COMPRESS_NONE;
+        }
+    } else if (strcmp(name, "none") == 0) {
+        compression = COMPRESS_NONE;
+    } else if (strcmp(name, "gzip") == 0) {
+        compression = COMPRESS_GZIP;
+    } else if (strcmp(name, "zstd") == 0) {
+        compression = COMPRESS_ZSTD;
+    } else {
+        LOG_FATAL("unknown compression: %s (expected auto, none, gzip or zstd)", name);
+    }
+
+#ifndef HAVE_ZLIB
+    if (compression == COMPRESS_GZIP) {
+        LOG_FATAL("gzip compression is not available: eclinic was built without zlib");
+    }
+#endif
+#ifndef HAVE_ZSTD
+    if (compression == COMPRESS_ZSTD) {
+        LOG_FATAL("zstd compression is not available: eclinic was built without libzstd");
+    }
+#endif
+    return compression;
+}
+
+const char *compression_extension(Compression compression) {
+    switch (compression) {
+    case COMPRESS_GZIP:
+        return ".gz";
+    case COMPRESS_ZSTD:
+        return ".zst";
+    case COMPRESS_NONE:
+        break;
+    }
+    return "";
+}
+
+static void write_file(FileSink *sink, const void *data, size_t len) {
+    if (len > 0 && fwrite(data, 1, len, sink->file) != len) {
+        LOG_ERROR("error writing %s: %s", sink->path, strerror(errno));
+        sink->failed = true;
+        return;
+    }
+    sink->written += len;
+}
+
+#ifdef HAVE_ZLIB
+static void compress_gzip(FileSink *sink, const char *data, size_t len, bool finish) {
+    sink->gz.next_in = (Bytef *)data;
+    sink->gz.avail_in = (uInt)len;
+    int status;
+    do {
+        sink->gz.next_out = (Bytef *)sink->out;
+        sink->gz.avail_out = (uInt)sink->out_cap;
+        status = deflate(&sink->gz, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (status == Z_STREAM_ERROR) {
+            LOG_ERROR("gzip compression of %s failed", sink->path);
+            sink->failed = true;
+            return;
+        }
+        write_file(sink, sink->out, sink->out_cap - sink->gz.avail_out);
+    } while (sink->gz.avail_out == 0 || (finish && status != Z_STREAM_END));
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static void compress_zstd(FileSink *sink, const char *data, size_t len, bool finish) {
+    ZSTD_inBuffer in = {data, len, 0};
+    size_t remaining;
+    do {
+        ZSTD_outBuffer out = {sink->out, sink->out_cap, 0};
+        remaining =
+            ZSTD_compressStream2(sink->zstd, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(remaining)) {
+            LOG_ERROR("zstd compression of %s failed: %s", sink->path,
+                      ZSTD_getErrorName(remaining));
+            sink->failed = true;
+            return;
+        }
+        write_file(sink, sink->out, out.pos);
+    } while (finish ? remaining != 0 : in.pos < in.size);
+}
+#endif
+
+// Compress data, or finish the stream when finish is set, and write the output.
+static void compress_chunk(FileSink *sink, const char *data, size_t len, bool finish) {
+    if (sink->failed)
+        return;
+
+    switch (sink->compression) {
+    case COMPRESS_NONE:
+        write_file(sink, data, len);
+        break;
+    case COMPRESS_GZIP:
+#ifdef HAVE_ZLIB
+        compress_gzip(sink, data, len, finish);
+#endif
+        break;
+    case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+        compress_zstd(sink, data, len, finish);
+#endif
+        break;
+    }
+    (void)finish;
+}
+
+static void *sink_writer(void *arg) {
+    FileSink *sink = arg;
+    for (;;) {
+        pthread_mutex_lock(&sink->lock);
+        while (sink->filled == 0 && !sink->closing) {
+            pthread_cond_wait(&sink->changed, &sink->lock);
+        }
+
+        if (sink->filled == 0) {
+            pthread_mutex_unlock(&sink->lock);
+            break;
+        }
+        Chunk *chunk = &sink->chunks[sink->head];
+        pthread_mutex_unlock(&sink->lock);
+
+        compress_chunk(sink, chunk->data, chunk->len, false);
+        chunk->len = 0;
+
+        pthread_mutex_lock(&sink->lock);
+        sink->head = (sink->head + 1) % SINK_CHUNKS;
+        sink->filled--;
+        pthread_cond_signal(&sink->changed);
+        pthread_mutex_unlock(&sink->lock);
+    }
+
+    compress_chunk(sink, NULL, 0, true);
+    return NULL;
+}
+
+static void sink_free(FileSink *sink) {
+    for (size_t i = 0; i < SINK_CHUNKS; i++) {
+        free(sink->chunks[i].data);
+    }
+    free(sink->out);
+    free(sink);
+}
+
+FileSink *sink_open(const char *path, Compression compression) {
+    FileSink *sink = calloc(1, sizeof(FileSink));
+    if (!sink) {
+        LOG_FATAL("out of memory");
+    }
+
+    sink->path = path;
+    sink->compression = compression;
+    sink->file = fopen(path, "wb");
+    if (!sink->file) {
+        LOG_ERROR("unable to create %s: %s", path, strerror(errno));
+        free(sink);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < SINK_CHUNKS; i++) {
+        sink->chunks[i].cap = SINK_CHUNK_SIZE;
+        sink->chunks[i].data = malloc(SINK_CHUNK_SIZE);
+        if (!sink->chunks[i].data) {
+            LOG_FATAL("out of memory");
+        }
+    }
+
+    sink->out_cap = SINK_CHUNK_SIZE;
+#ifdef HAVE_ZLIB
+    if (compression == COMPRESS_GZIP) {
+        // windowBits + 16 writes a gzip header and trailer instead of a zlib one.
+        if (deflateInit2(&sink->gz, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            LOG_ERROR("unable to initialize gzip compression of %s", path);
+            fclose(sink->file);
+            sink_free(sink);
+            return NULL;
+        }
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (compression == COMPRESS_ZSTD) {
+        sink->zstd = ZSTD_createCCtx();
+        if (!sink->zstd) {
+            LOG_ERROR("unable to initialize zstd compression of %s", path);
+            fclose(sink->file);
+            sink_free(sink);
+            return NULL;
+        }
+        sink->out_cap = ZSTD_CStreamOutSize();
+    }
+#endif
+
+    sink->out = malloc(sink->out_cap);
+    if (!sink->out) {
+        LOG_FATAL("out of memory");
+    }
+
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->changed, NULL);
+    if (pthread_create(&sink->writer, NULL, sink_writer, sink) != 0) {
+        LOG_ERROR("unable to start writer thread for %s", path);
+        pthread_mutex_destroy(&sink->lock);
+        pthread_cond_destroy(&sink->changed);
+        fclose(sink->file);
+        sink_free(sink);
+        return NULL;
+    }
+    return sink;
+}
+
+// Hand the chunk being filled to the writer and wait for a free one.
+static void sink_flush(FileSink *sink) {
+    pthread_mutex_lock(&sink->lock);
+    sink->filled++;
+    sink->tail = (sink->tail + 1) % SINK_CHUNKS;
+    pthread_cond_signal(&sink->changed);
+    while (sink->filled == SINK_CHUNKS) {
+        pthread_cond_wait(&sink->changed, &sink->lock);
+    }
+    pthread_mutex_unlock(&sink->lock);
+}
+
+void sink_write(FileSink *sink, const char *data, size_t len) {
+    Chunk *chunk = &sink->chunks[sink->tail];
+    if (chunk->len + len > chunk->cap && chunk->len > 0) {
+        sink_flush(sink);
+        chunk = &sink->chunks[sink->tail];
+    }
+
+    // A single write larger than a chunk gets a chunk of its own.
+    if (len > chunk->cap) {
+        chunk->data = realloc(chunk->data, len);
+        if (!chunk->data) {
+            LOG_FATAL("out of memory");
+        }
+        chunk->cap = len;
+    }
+
+    memcpy(chunk->data + chunk->len, data, len);
+    chunk->len += len;
+}
+
+bool sink_close(FileSink *sink, size_t *written) {
+    pthread_mutex_lock(&sink->lock);
+    if (sink->chunks[sink->tail].len > 0) {
+        sink->filled++;
+    }
+    sink->closing = true;
+    pthread_cond_signal(&sink->changed);
+    pthread_mutex_unlock(&sink->lock);
+    pthread_join(sink->writer, NULL);
+
+#ifdef HAVE_ZLIB
+    if (sink->compression == COMPRESS_GZIP) {
+        deflateEnd(&sink->gz);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (sink->compression == COMPRESS_ZSTD) {
+        ZSTD_freeCCtx(sink->zstd);
+    }
+#endif
+
+    bool ok = !sink->failed;
+    if (fclose(sink->file) != 0 && ok) {
+        LOG_ERROR("error writing %s: %s", sink->path, strerror(errno));
+        ok = false;
+    }
+
+    *written = sink->written;
+    pthread_mutex_destroy(&sink->lock);
+    pthread_cond_destroy(&sink->changed);
+    sink_free(sink);
+    return ok;
+}
@@ -0,0 +1,719 @@
+#include "../include/snapshot.h"
+#include "../include/hash.h"
+#include "../include/loader.h"
+#include "../include/strbuf.h"
+#include "../include/timing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+SnapshotOptions snapshot_options = {
+    .path = "prices.snap",
+    .full = false,
+    .listen = false,
+    .name = NULL,
+    .prefix = NULL,
+    .id = NULL,
+    .limit = 20,
+};
+
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_EMPTY UINT32_MAX // Free hash table slot.
+#define SNAPSHOT_CHANNEL "eclinic_prices"
+#define SNAPSHOT_SETTLE_MS 500 // Quiet time after a notification before refreshing.
+
+static const char snapshot_magic[8] = "ECSNAP1";
+
+// Columns stored per item, in record field order.
+static const char *const snapshot_columns[] = {
+    "name", "type", "dept", "quantity", "expiry_date", "cost_price", "cash", "uap",
+    "san_care", "jubilee", "prudential", "aar", "saint_catherine", "icea", "liberty",
+};
+
+#define SNAPSHOT_COLUMNS (sizeof(snapshot_columns) / sizeof(snapshot_columns[0]))
+#define SNAPSHOT_KEY SNAPSHOT_COLUMNS // Field of the lowercase name.
+#define SNAPSHOT_FIRST_PRICE 6        // Field of cash, the first column from prices.
+
+#define SNAPSHOT_PRICES                                                                            \
+    "p.cash, p.uap, p.san_care, p.jubilee, p.prudential, p.aar, p.saint_catherine, p.icea, "     \
+    "p.liberty"
+
+#define SNAPSHOT_SELECT                                                                            \
+    "SELECT i.id, i.name, i.type, i.dept, i.quantity, i.expiry_date, i.cost_price, "             \
+    SNAPSHOT_PRICES " FROM inventory_items i LEFT JOIN prices p ON p.item_id = i.id"
+
+// File header. Sections follow at the given offsets, 8-byte aligned.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_records;
+    uint32_t hash_size; // Slots of each hash table, a power of two.
+    uint32_t reserved;
+    uint64_t watermark; // Oldest transaction id whose rows the file may not include.
+    int64_t created;    // Unix time the rows were read.
+    uint64_t records;   // SnapshotRecord[num_records], sorted by id.
+    uint64_t by_name;   // uint32_t[num_records] record indexes sorted by key.
+    uint64_t name_hash; // uint32_t[hash_size] record indexes by key.
+    uint64_t id_hash;   // uint32_t[hash_size] record indexes by id.
+    uint64_t strings;   // NUL-terminated strings. Offset 0 is NULL.
+    uint64_t size;      // File size.
+} SnapshotHeader;
+
+typedef struct {
+    int64_t id;
+    uint32_t fields[SNAPSHOT_COLUMNS + 1]; // String offsets of the columns and the key.
+} SnapshotRecord;
+
+// A snapshot file mapped into memory.
+typedef struct {
+    void *data;
+    size_t size;
+    const SnapshotHeader *header;
+    const SnapshotRecord *records;
+    const uint32_t *by_name;
+    const uint32_t *name_hash;
+    const uint32_t *id_hash;
+    const char *strings;
+    size_t strings_len;
+} Snapshot;
+
+// ======================= Reading =======================
+
+static bool section_valid(const SnapshotHeader *h, uint64_t offset, uint64_t len) {
+    return offset % 8 == 0 && offset >= sizeof(SnapshotHeader) && offset <= h->size &&
+           len <= h->size - offset;
+}
+
+// Map a snapshot file. Returns false if there is none; aborts if it is damaged.
+static bool snapshot_open(const char *path, Snapshot *snap) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return false;
+        LOG_FATAL("unable to open %s: %s", path, strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOG_FATAL("unable to stat %s: %s", path, strerror(errno));
+    }
+
+    if ((size_t)st.st_size < sizeof(SnapshotHeader)) {
+        LOG_FATAL("%s is not a snapshot file", path);
+    }
+
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG_FATAL("unable to map %s: %s", path, strerror(errno));
+    }
+
+    const SnapshotHeader *h = data;
+    if (memcmp(h->magic, snapshot_magic, sizeof(snapshot_magic)) != 0 ||
+        h->version != SNAPSHOT_VERSION || h->size != (uint64_t)st.st_size) {
+        LOG_FATAL("%s is not a version %d snapshot file", path, SNAPSHOT_VERSION);
+    }
+
+    uint64_t n = h->num_records, slots = h->hash_size;
+    if ((slots & (slots - 1)) != 0 || slots < n ||
+        !section_valid(h, h->records, n * sizeof(SnapshotRecord)) ||
+        !section_valid(h, h->by_name, n * sizeof(uint32_t)) ||
+        !section_valid(h, h->name_hash, slots * sizeof(uint32_t)) ||
+        !section_valid(h, h->id_hash, slots * sizeof(uint32_t)) ||
+        !section_valid(h, h->strings, 1) || ((const char *)data)[h->size - 1] != '\0') {
+        LOG_FATAL("%s is damaged, rebuild it with snapshot --full", path);
+    }
+
+    const char *base = data;
+    *snap = (Snapshot){
+        .data = data,
+        .size = (size_t)st.st_size,
+        .header = h,
+        .records = (const SnapshotRecord *)(base + h->records),
+        .by_name = (const uint32_t *)(base + h->by_name),
+        .name_hash = (const uint32_t *)(base + h->name_hash),
+        .id_hash = (const uint32_t *)(base + h->id_hash),
+        .strings = base + h->strings,
+        .strings_len = h->size - h->strings,
+    };
+    return true;
+}
+
+static void snapshot_close(Snapshot *snap) {
+    if (snap->data) {
+        munmap(snap->data, snap->size);
+        snap->data = NULL;
+    }
+}
+
+// Value of a record field. NULL for SQL NULL.
+static const char *snapshot_field(const Snapshot *snap, const SnapshotRecord *r, size_t field) {
+    uint32_t offset = r->fields[field];
+    return offset == 0 || offset >= snap->strings_len ? NULL : snap->strings + offset;
+}
+
+// ======================= Writing =======================
+
+// Row of a snapshot being written. Values point into query results or the old file.
+typedef struct {
+    int64_t id;
+    const char *values[SNAPSHOT_COLUMNS];
+} SnapshotRow;
+
+// Lookup key of a name: lowercase ASCII without surrounding spaces.
+static char *name_key(const char *name) {
+    while (*name == ' ') {
+        name++;
+    }
+
+    size_t len = strlen(name);
+    while (len > 0 && name[len - 1] == ' ') {
+        len--;
+    }
+
+    char *key = malloc(len + 1);
+    if (!key) {
+        LOG_FATAL("out of memory");
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        key[i] = c >= 'A' && c <= 'Z' ? (char)(c + 'a' - 'A') : c;
+    }
+    key[len] = '\0';
+    return key;
+}
+
+static uint64_t key_hash(const char *key) {
+    return hash64(key, strlen(key), 0);
+}
+
+static uint64_t id_hash(int64_t id) {
+    return hash64(&id, sizeof(id), 0);
+}
+
+// Keys of the records being sorted by snapshot_write.
+static const char *const *sort_keys;
+
+static int compare_keys(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    int c = strcmp(sort_keys[x], sort_keys[y]);
+    return c != 0 ? c : (x > y) - (x < y);
+}
+
+static void hash_insert(uint32_t *table, uint32_t mask, uint64_t hash, uint32_t record) {
+    size_t slot = hash & mask;
+    while (table[slot] != SNAPSHOT_EMPTY) {
+        slot = (slot + 1) & mask;
+    }
+    table[slot] = record;
+}
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+static void write_section(FILE *f, const char *path, const void *data, size_t len) {
+    static const char pad[8];
+    size_t padding = align8(len) - len;
+    if (fwrite(data, 1, len, f) != len || fwrite(pad, 1, padding, f) != padding) {
+        LOG_FATAL("unable to write %s: %s", path, strerror(errno));
+    }
+}
+
+// Write rows, sorted by id, to a new file that then replaces path.
+static void snapshot_write(const char *path, const SnapshotRow *rows, size_t n,
+                           uint64_t watermark) {
+    size_t slots = 16;
+    while (slots < 2 * n) {
+        slots <<= 1;
+    }
+
+    SnapshotRecord *records = calloc(n ? n : 1, sizeof(SnapshotRecord));
+    uint32_t *by_name = malloc((n ? n : 1) * sizeof(uint32_t));
+    uint32_t *name_hash = malloc(slots * sizeof(uint32_t));
+    uint32_t *ids = malloc(slots * sizeof(uint32_t));
+    char **keys = malloc((n ? n : 1) * sizeof(char *));
+    if (!records || !by_name || !name_hash || !ids || !keys) {
+        LOG_FATAL("out of memory");
+    }
+    memset(name_hash, 0xff, slots * sizeof(uint32_t));
+    memset(ids, 0xff, slots * sizeof(uint32_t));
+
+    StrBuf strings;
+    sb_init(&strings, 64 * n + 1);
+    sb_putc(&strings, '\0');
+
+    for (size_t i = 0; i < n; i++) {
+        records[i].id = rows[i].id;
+        for (size_t c = 0; c < SNAPSHOT_COLUMNS; c++) {
+            if (rows[i].values[c]) {
+                records[i].fields[c] = (uint32_t)strings.len;
+                sb_appendn(&strings, rows[i].values[c], strlen(rows[i].values[c]));
+                sb_putc(&strings, '\0');
+            }
+        }
+
+        keys[i] = name_key(rows[i].values[0] ? rows[i].values[0] : "");
+        records[i].fields[SNAPSHOT_KEY] = (uint32_t)strings.len;
+        sb_appendn(&strings, keys[i], strlen(keys[i]));
+        sb_putc(&strings, '\0');
+
+        by_name[i] = (uint32_t)i;
+        hash_insert(name_hash, (uint32_t)slots - 1, key_hash(keys[i]), (uint32_t)i);
+        hash_insert(ids, (uint32_t)slots - 1, id_hash(rows[i].id), (uint32_t)i);
+    }
+
+    if (strings.len > UINT32_MAX) {
+        LOG_FATAL("snapshot strings exceed 4GB");
+    }
+
+    sort_keys = (const char *const *)keys;
+    qsort(by_name, n, sizeof(uint32_t), compare_keys);
+
+    SnapshotHeader h = {.version = SNAPSHOT_VERSION,
+                        .num_records = (uint32_t)n,
+                        .hash_size = (uint32_t)slots,
+                        .watermark = watermark,
+                        .created = (int64_t)time(NULL)};
+    memcpy(h.magic, snapshot_magic, sizeof(snapshot_magic));
+    h.records = align8(sizeof(SnapshotHeader));
+    h.by_name = h.records + align8(n * sizeof(SnapshotRecord));
+    h.name_hash = h.by_name + align8(n * sizeof(uint32_t));
+    h.id_hash = h.name_hash + align8(slots * sizeof(uint32_t));
+    h.strings = h.id_hash + align8(slots * sizeof(uint32_t));
+    h.size = h.strings + align8(strings.len);
+
+    // Readers keep the old file mapped until they reopen; the rename swaps atomically.
+    char *tmp = NULL;
+    asprintf(&tmp, "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        LOG_FATAL("unable to create %s: %s", tmp, strerror(errno));
+    }
+
+    write_section(f, tmp, &h, sizeof(h));
+    write_section(f, tmp, records, n * sizeof(SnapshotRecord));
+    write_section(f, tmp, by_name, n * sizeof(uint32_t));
+    write_section(f, tmp, name_hash, slots * sizeof(uint32_t));
+    write_section(f, tmp, ids, slots * sizeof(uint32_t));
+    write_section(f, tmp, strings.data, strings.len);
+
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0) {
+        LOG_FATAL("unable to write %s: %s", tmp, strerror(errno));
+    }
+
+    if (rename(tmp, path) != 0) {
+        LOG_FATAL("unable to rename %s to %s: %s", tmp, path, strerror(errno));
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+    free(tmp);
+    free(records);
+    free(by_name);
+    free(name_hash);
+    free(ids);
+    sb_free(&strings);
+}
+
+// ======================= Refresh =======================
+
+static PGresult *query_rows(const char *sql, int nparams, const char *const *params) {
+    PGresult *result = PQexecParams(conn, sql, nparams, NULL, params, NULL, NULL, 0);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        LOG_FATAL("%s: %s", sql, PQerrorMessage(conn));
+    }
+    return result;
+}
+
+static void row_from_result(SnapshotRow *row, PGresult *result, int i) {
+    row->id = strtoll(PQgetvalue(result, i, 0), NULL, 10);
+    for (size_t c = 0; c < SNAPSHOT_COLUMNS; c++) {
+        int col = (int)c + 1;
+        row->values[c] = PQgetisnull(result, i, col) ? NULL : PQgetvalue(result, i, col);
+    }
+}
+
+static void row_from_record(SnapshotRow *row, const Snapshot *snap, const SnapshotRecord *r) {
+    row->id = r->id;
+    for (size_t c = 0; c < SNAPSHOT_COLUMNS; c++) {
+        row->values[c] = snapshot_field(snap, r, c);
+    }
+}
+
+// Whether id is in ids, a result of ids in order. *j is where the previous, smaller id
+// was looked up.
+static bool result_has_id(PGresult *ids, size_t num_ids, size_t *j, int64_t id) {
+    while (*j < num_ids && strtoll(PQgetvalue(ids, (int)*j, 0), NULL, 10) < id) {
+        (*j)++;
+    }
+    return *j < num_ids && strtoll(PQgetvalue(ids, (int)*j, 0), NULL, 10) == id;
+}
+
+// Drop the merged rows of deleted items. Every item on the server is in the merged
+// rows, so equal counts mean nothing was deleted; otherwise the ids tell which to drop.
+// Returns the number of rows dropped.
+static size_t drop_deleted_items(SnapshotRow *rows, size_t *n) {
+    PGresult *count = query_rows("SELECT count(*) FROM inventory_items", 0, NULL);
+    size_t num_items = strtoull(PQgetvalue(count, 0, 0), NULL, 10);
+    PQclear(count);
+    if (num_items == *n)
+        return 0;
+
+    PGresult *ids = query_rows("SELECT id FROM inventory_items ORDER BY id", 0, NULL);
+    size_t num_ids = (size_t)PQntuples(ids), kept = 0, j = 0;
+    for (size_t i = 0; i < *n; i++) {
+        if (result_has_id(ids, num_ids, &j, rows[i].id)) {
+            rows[kept++] = rows[i];
+        }
+    }
+    PQclear(ids);
+
+    size_t deleted = *n - kept;
+    *n = kept;
+    return deleted;
+}
+
+static bool row_priced(const SnapshotRow *row) {
+    for (size_t c = SNAPSHOT_FIRST_PRICE; c < SNAPSHOT_COLUMNS; c++) {
+        if (row->values[c])
+            return true;
+    }
+    return false;
+}
+
+// Clear the prices of items whose prices row was deleted. That leaves no row version
+// newer than the watermark to read, but every priced item on the server was read or
+// kept with its prices, so equal counts of priced items mean none was deleted.
+// Otherwise the ids of the priced items tell which rows to clear, as the join would
+// for an item without prices. Returns the number of rows cleared.
+static size_t clear_deleted_prices(SnapshotRow *rows, size_t n) {
+    size_t num_priced = 0;
+    for (size_t i = 0; i < n; i++) {
+        num_priced += row_priced(&rows[i]);
+    }
+
+    PGresult *count = query_rows(
+        "SELECT count(*) FROM prices p JOIN inventory_items i ON i.id = p.item_id "
+        "WHERE num_nonnulls(" SNAPSHOT_PRICES ") > 0",
+        0, NULL);
+    size_t num_server = strtoull(PQgetvalue(count, 0, 0), NULL, 10);
+    PQclear(count);
+    if (num_server == num_priced)
+        return 0;
+
+    PGresult *ids = query_rows("SELECT p.item_id FROM prices p WHERE num_nonnulls(" SNAPSHOT_PRICES
+                               ") > 0 ORDER BY p.item_id",
+                               0, NULL);
+    size_t num_ids = (size_t)PQntuples(ids), j = 0, cleared = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (row_priced(&rows[i]) && !result_has_id(ids, num_ids, &j, rows[i].id)) {
+            for (size_t c = SNAPSHOT_FIRST_PRICE; c < SNAPSHOT_COLUMNS; c++) {
+                rows[i].values[c] = NULL;
+            }
+            cleared++;
+        }
+    }
+    PQclear(ids);
+    return cleared;
+}
+
+// Read the rows changed since the watermark of the old file, or every row without
+// one, and write the new file.
+static void snapshot_refresh(const char *path, bool full) {
+    Snapshot old = {0};
+    bool incremental = !full && snapshot_open(path, &old);
+
+    double start = now_ms();
+    load_exec("BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY");
+
+    // Transactions from the snapshot's xmin on may commit after it: rows they write
+    // are read again next time.
+    PGresult *mark = query_rows(
+        "SELECT txid_snapshot_xmin(txid_current_snapshot()) % 4294967296", 0, NULL);
+    uint64_t watermark = strtoull(PQgetvalue(mark, 0, 0), NULL, 10);
+    PQclear(mark);
+
+    PGresult *changed;
+    if (incremental) {
+        char since[32];
+        snprintf(since, sizeof(since), "%" PRIu64, old.header->watermark);
+        const char *params[1] = {since};
+
+        // age() orders transaction ids across wraparound; frozen rows are the oldest.
+        changed = query_rows(SNAPSHOT_SELECT " WHERE age(i.xmin) <= age($1::text::xid) "
+                                             "OR age(p.xmin) <= age($1::text::xid) ORDER BY i.id",
+                             1, params);
+    } else {
+        changed = query_rows(SNAPSHOT_SELECT " ORDER BY i.id", 0, NULL);
+    }
+
+    size_t num_changed = (size_t)PQntuples(changed);
+    size_t num_old = incremental ? old.header->num_records : 0;
+    SnapshotRow *rows = malloc((num_old + num_changed + 1) * sizeof(SnapshotRow));
+    if (!rows) {
+        LOG_FATAL("out of memory");
+    }
+
+    // Merge the changed rows into the old ones by id.
+    size_t n = 0, o = 0;
+    for (size_t c = 0; c < num_changed; c++) {
+        SnapshotRow row;
+        row_from_result(&row, changed, (int)c);
+        while (o < num_old && old.records[o].id < row.id) {
+            row_from_record(&rows[n++], &old, &old.records[o++]);
+        }
+        if (o < num_old && old.records[o].id == row.id) {
+            o++;
+        }
+        rows[n++] = row;
+    }
+    while (o < num_old) {
+        row_from_record(&rows[n++], &old, &old.records[o++]);
+    }
+
+    size_t deleted = 0, unpriced = 0;
+    if (incremental) {
+        deleted = drop_deleted_items(rows, &n);
+        unpriced = clear_deleted_prices(rows, n);
+    }
+    load_exec("COMMIT");
+
+    snapshot_write(path, rows, n, watermark);
+    LOG_INFO("%s: %zu item(s), %zu read, %zu removed, %zu unpriced in %.1f ms", path, n,
+             num_changed, deleted, unpriced, now_ms() - start);
+
+    free(rows);
+    PQclear(changed);
+    snapshot_close(&old);
+}
+
+// ======================= Notifications =======================
+
+// Statement triggers announcing changes to the snapshot tables on SNAPSHOT_CHANNEL.
+static void install_notify_triggers(void) {
+    static const char *const tables[] = {"inventory_items", "prices"};
+
+    PGresult *existing = query_rows("SELECT count(*) FROM pg_trigger WHERE tgname = "
+                                    "'eclinic_notify_prices' AND tgrelid IN "
+                                    "('inventory_items'::regclass, 'prices'::regclass)",
+                                    0, NULL);
+    bool installed = strcmp(PQgetvalue(existing, 0, 0), "2") == 0;
+    PQclear(existing);
+    if (installed)
+        return;
+
+    load_exec("BEGIN");
+    load_exec("CREATE OR REPLACE FUNCTION eclinic_notify_prices() RETURNS trigger "
+              "LANGUAGE plpgsql AS $$ BEGIN PERFORM pg_notify('" SNAPSHOT_CHANNEL
+              "', TG_TABLE_NAME); RETURN NULL; END $$");
+    for (size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+        char *sql = NULL;
+        asprintf(&sql, "DROP TRIGGER IF EXISTS eclinic_notify_prices ON %s", tables[i]);
+        load_exec(sql);
+        free(sql);
+
+        asprintf(&sql,
+                 "CREATE TRIGGER eclinic_notify_prices AFTER INSERT OR UPDATE OR DELETE OR "
+                 "TRUNCATE ON %s FOR EACH STATEMENT EXECUTE FUNCTION eclinic_notify_prices()",
+                 tables[i]);
+        load_exec(sql);
+        free(sql);
+    }
+    load_exec("COMMIT");
+    LOG_INFO("Installed change notification triggers on inventory_items and prices");
+}
+
+// Wait until the connection has input. timeout_ms < 0 waits forever.
+static bool wait_input(int timeout_ms) {
+    int sock = PQsocket(conn);
+    if (sock < 0) {
+        LOG_FATAL("connection lost: %s", PQerrorMessage(conn));
+    }
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+    int ready = select(sock + 1, &fds, NULL, NULL, timeout_ms < 0 ? NULL : &tv);
+    if (ready < 0 && errno != EINTR) {
+        LOG_FATAL("select failed: %s", strerror(errno));
+    }
+
+    if (ready > 0 && !PQconsumeInput(conn)) {
+        LOG_FATAL("connection lost: %s", PQerrorMessage(conn));
+    }
+    return ready > 0;
+}
+
+// Discard pending notifications. Returns whether there were any.
+static bool drain_notifications(void) {
+    bool any = false;
+    PGnotify *notify;
+    while ((notify = PQnotifies(conn)) != NULL) {
+        any = true;
+        PQfreemem(notify);
+    }
+    return any;
+}
+
+void snapshot_prices(Subcommand *cmd) {
+    (void)cmd;
+    if (!snapshot_options.listen) {
+        snapshot_refresh(snapshot_options.path, snapshot_options.full);
+        return;
+    }
+
+    install_notify_triggers();
+    load_exec("LISTEN " SNAPSHOT_CHANNEL);
+
+    // Changes made before LISTEN took effect are caught by this first refresh.
+    snapshot_refresh(snapshot_options.path, snapshot_options.full);
+    LOG_INFO("Listening on %s", SNAPSHOT_CHANNEL);
+
+    for (;;) {
+        if (!drain_notifications()) {
+            wait_input(-1);
+            continue;
+        }
+
+        // A load sends one notification per statement: refresh once it goes quiet.
+        while (wait_input(SNAPSHOT_SETTLE_MS)) {
+            drain_notifications();
+        }
+        snapshot_refresh(snapshot_options.path, false);
+    }
+}
+
+// ======================= Lookup =======================
+
+static void print_record(const Snapshot *snap, const SnapshotRecord *r) {
+    printf("%" PRId64, r->id);
+    for (size_t c = 0; c < SNAPSHOT_COLUMNS; c++) {
+        const char *value = snapshot_field(snap, r, c);
+        printf("\t%s", value ? value : "");
+    }
+    putchar('\n');
+}
+
+// Records whose key equals key, through the name hash table.
+static size_t find_name(const Snapshot *snap, const char *key, uint32_t *found, size_t limit) {
+    uint32_t mask = snap->header->hash_size - 1;
+    size_t n = 0;
+    for (size_t slot = key_hash(key) & mask; snap->name_hash[slot] != SNAPSHOT_EMPTY && n < limit;
+         slot = (slot + 1) & mask) {
+        uint32_t r = snap->name_hash[slot];
+        const char *k = r < snap->header->num_records
+                            ? snapshot_field(snap, &snap->records[r], SNAPSHOT_KEY)
+                            : NULL;
+        if (k && strcmp(k, key) == 0) {
+            found[n++] = r;
+        }
+    }
+    return n;
+}
+
+// Records whose key starts with prefix, in name order, through the sorted index.
+static size_t find_prefix(const Snapshot *snap, const char *prefix, uint32_t *found,
+                          size_t limit) {
+    size_t len = strlen(prefix), lo = 0, hi = snap->header->num_records;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const char *k = snapshot_field(snap, &snap->records[snap->by_name[mid]], SNAPSHOT_KEY);
+        if (strcmp(k ? k : "", prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t n = 0;
+    for (size_t i = lo; i < snap->header->num_records && n < limit; i++) {
+        const char *k = snapshot_field(snap, &snap->records[snap->by_name[i]], SNAPSHOT_KEY);
+        if (!k || strncmp(k, prefix, len) != 0)
+            break;
+        found[n++] = snap->by_name[i];
+    }
+    return n;
+}
+
+// Record with the id, through the id hash table.
+static size_t find_id(const Snapshot *snap, int64_t id, uint32_t *found) {
+    uint32_t mask = snap->header->hash_size - 1;
+    for (size_t slot = id_hash(id) & mask; snap->id_hash[slot] != SNAPSHOT_EMPTY;
+         slot = (slot + 1) & mask) {
+        uint32_t r = snap->id_hash[slot];
+        if (r < snap->header->num_records && snap->records[r].id == id) {
+            found[0] = r;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void lookup_prices(Subcommand *cmd) {
+    (void)cmd;
+    SnapshotOptions *opts = &snapshot_options;
+    if (!!opts->name + !!opts->prefix + !!opts->id != 1) {
+        LOG_FATAL("give exactly one of --name, --prefix or --id");
+    }
+
+    if (opts->limit <= 0) {
+        LOG_FATAL("limit must be positive, got %d", opts->limit);
+    }
+
+    Snapshot snap;
+    if (!snapshot_open(opts->path, &snap)) {
+        LOG_FATAL("%s does not exist, create it with the snapshot subcommand", opts->path);
+    }
+
+    uint32_t *found = malloc((size_t)opts->limit * sizeof(uint32_t));
+    if (!found) {
+        LOG_FATAL("out of memory");
+    }
+
+    double start = now_ms();
+    size_t n;
+    if (opts->id) {
+        char *end;
+        int64_t id = strtoll(opts->id, &end, 10);
+        if (*opts->id == '\0' || *end != '\0') {
+            LOG_FATAL("invalid id: %s", opts->id);
+        }
+        n = find_id(&snap, id, found);
+    } else {
+        char *key = name_key(opts->name ? opts->name : opts->prefix);
+        n = opts->name ? find_name(&snap, key, found, (size_t)opts->limit)
+                       : find_prefix(&snap, key, found, (size_t)opts->limit);
+        free(key);
+    }
+    double elapsed = now_ms() - start;
+
+    printf("id");
+    for (size_t c = 0; c < SNAPSHOT_COLUMNS; c++) {
+        printf("\t%s", snapshot_columns[c]);
+    }
+    putchar('\n');
+    for (size_t i = 0; i < n; i++) {
+        print_record(&snap, &snap.records[found[i]]);
+    }
+
+    time_t created = (time_t)snap.header->created;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+    LOG_INFO("%zu item(s) in %.1f us from the snapshot of %s", n, elapsed * 1000, when);
+
+    free(found);
+    snapshot_close(&snap);
+}
@@ -0,0 +1,34 @@
+#include "../include/sort.h"
+#include <string.h>
+
+RowOrder row_order_parse(const char *name) {
+    if (strcmp(name, "none") == 0)
+        return ORDER_NONE;
+    if (strcmp(name, "batch") == 0)
+        return ORDER_BATCH;
+    if (strcmp(name, "file") == 0)
+        return ORDER_FILE;
+
+    LOG_FATAL("unknown row order: %s (expected none, batch or file)", name);
+}
+
+static int compare_rows(const void *a, const void *b, void *plan) {
+    return load_key_compare(plan, *(CsvRow *const *)a, *(CsvRow *const *)b);
+}
+
+void sort_batches(const LoadPlan *plan, CsvRow **rows, size_t num_rows, size_t batch_size) {
+    if (plan->num_keys == 0)
+        return;
+
+    for (size_t start = 0; start < num_rows; start += batch_size) {
+        size_t n = start + batch_size < num_rows ? batch_size : num_rows - start;
+        qsort_r(rows + start, n, sizeof(CsvRow *), compare_rows, (void *)plan);
+    }
+}
+
+void sort_rows(const LoadPlan *plan, CsvRow **rows, size_t num_rows) {
+    if (plan->num_keys == 0 || num_rows < 2)
+        return;
+
+    qsort_r(rows, num_rows, sizeof(CsvRow *), compare_rows, (void *)plan);
+}
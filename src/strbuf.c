@@ -0,0 +1,89 @@
+#include "../include/strbuf.h"
+#include "../include/log.h"
+#include <stdio.h>
+#include <string.h>
+
+void sb_init(StrBuf *sb, size_t cap) {
+    sb->cap = cap > 16 ? cap : 16;
+    sb->len = 0;
+    sb->data = malloc(sb->cap);
+    if (!sb->data) {
+        LOG_FATAL("out of memory");
+    }
+    sb->data[0] = '\0';
+}
+
+void sb_reserve(StrBuf *sb, size_t extra) {
+    if (sb->len + extra + 1 <= sb->cap)
+        return;
+
+    size_t cap = sb->cap * 2;
+    while (cap < sb->len + extra + 1) {
+        cap *= 2;
+    }
+
+    char *data = realloc(sb->data, cap);
+    if (!data) {
+        LOG_FATAL("out of memory");
+    }
+    sb->data = data;
+    sb->cap = cap;
+}
+
+void sb_appendn(StrBuf *sb, const char *s, size_t n) {
+    sb_reserve(sb, n);
+    memcpy(sb->data + sb->len, s, n);
+    sb->len += n;
+    sb->data[sb->len] = '\0';
+}
+
+void sb_append(StrBuf *sb, const char *s) {
+    sb_appendn(sb, s, strlen(s));
+}
+
+void sb_appendf(StrBuf *sb, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (n < 0) {
+        LOG_FATAL("invalid format string: %s", fmt);
+    }
+
+    sb_reserve(sb, (size_t)n);
+    va_start(args, fmt);
+    vsnprintf(sb->data + sb->len, (size_t)n + 1, fmt, args);
+    va_end(args);
+    sb->len += (size_t)n;
+}
+
+void sb_putc(StrBuf *sb, char c) {
+    sb_reserve(sb, 1);
+    sb->data[sb->len++] = c;
+    sb->data[sb->len] = '\0';
+}
+
+void sb_append_array_element(StrBuf *sb, const char *value) {
+    sb_putc(sb, '"');
+    while (*value) {
+        size_t span = strcspn(value, "\"\\");
+        sb_appendn(sb, value, span);
+        value += span;
+        if (*value) {
+            sb_putc(sb, '\\');
+            sb_putc(sb, *value++);
+        }
+    }
+    sb_putc(sb, '"');
+}
+
+void sb_reset(StrBuf *sb) {
+    sb->len = 0;
+    sb->data[0] = '\0';
+}
+
+void sb_free(StrBuf *sb) {
+    free(sb->data);
+    sb->data = NULL;
+    sb->len = sb->cap = 0;
+}
@@ -0,0 +1,108 @@
+#include "../include/throttle.h"
+#include "../include/probe.h"
+#include "../include/record.h"
+#include "../include/timing.h"
+#include "../include/trace.h"
+
+// Batches start small and the rate at half the cap until the server proves idle.
+#define THROTTLE_MIN_BATCH 10
+#define THROTTLE_MIN_RATE 10.0
+#define THROTTLE_PROBE_MS 1000.0
+
+void throttle_init(Throttle *t) {
+    size_t max_batch = (size_t)load_options.batch_size;
+    *t = (Throttle){
+        .batch = max_batch < THROTTLE_MIN_BATCH ? max_batch : THROTTLE_MIN_BATCH,
+        .max_batch = max_batch,
+        .rate = load_options.max_rate / 2.0,
+        .max_rate = load_options.max_rate,
+        .target_ms = load_options.target_ms,
+        .max_lag_ms = load_options.max_lag_ms,
+        .last_probe = 0,
+    };
+}
+
+// pg_stat_replication is empty without replicas or without pg_monitor, which reads as no lag.
+void throttle_sample(Throttle *t) {
+    if (now_ms() - t->last_probe < THROTTLE_PROBE_MS)
+        return;
+
+    const char *query =
+        "SELECT (SELECT count(*) FROM pg_stat_activity "
+        "        WHERE wait_event_type = 'Lock' AND datname = current_database() "
+        "        AND pid <> pg_backend_pid()), "
+        "       (SELECT COALESCE(max(EXTRACT(epoch FROM replay_lag)) * 1000, 0) "
+        "        FROM pg_stat_replication)";
+
+    res = record_exec(conn, query);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("unable to sample server activity: %s", PQerrorMessage(conn));
+    }
+
+    t->lock_waiters = atoi(PQgetvalue(res, 0, 0));
+    t->replica_lag = atof(PQgetvalue(res, 0, 1));
+    FreeResult();
+    t->last_probe = now_ms();
+}
+
+void throttle_observe(Throttle *t, double elapsed_ms) {
+    bool slow = elapsed_ms > t->target_ms;
+    bool contended = t->lock_waiters > 0;
+    bool lagging = t->replica_lag > t->max_lag_ms;
+
+    if (slow || contended || lagging) {
+        // Multiplicative decrease.
+        t->batch = t->batch / 2 > THROTTLE_MIN_BATCH ? t->batch / 2 : THROTTLE_MIN_BATCH;
+        t->rate = t->rate / 2 > THROTTLE_MIN_RATE ? t->rate / 2 : THROTTLE_MIN_RATE;
+        if (t->batch > t->max_batch) {
+            t->batch = t->max_batch;
+        }
+
+        LOG_INFO("gentle: backing off to %zu rows/batch at %.0f rows/s "
+                 "(latency %.0f ms, %d lock waiter(s), replica lag %.0f ms)",
+                 t->batch, t->rate, elapsed_ms, t->lock_waiters, t->replica_lag);
+    } else {
+        // Additive batch increase, gentle rate recovery.
+        t->batch = t->batch + THROTTLE_MIN_BATCH < t->max_batch ? t->batch + THROTTLE_MIN_BATCH
+                                                                : t->max_batch;
+        t->rate = t->rate * 1.25 < t->max_rate ? t->rate * 1.25 : t->max_rate;
+    }
+
+    // A sample is acted on once; batches until the next one are judged by latency alone.
+    t->lock_waiters = 0;
+    t->replica_lag = 0;
+}
+
+void throttle_pace(const Throttle *t, size_t rows, double elapsed_ms) {
+    sleep_ms(rows * 1e3 / t->rate - elapsed_ms);
+}
+
+LoadCounts throttle_execute(LoadPlan *plan, CsvRow **rows, size_t num_rows,
+                            LoadStrategy strategy) {
+    Throttle t;
+    throttle_init(&t);
+
+    LoadCounts counts = {0};
+    for (size_t start = 0; start < num_rows;) {
+        size_t n = start + t.batch < num_rows ? t.batch : num_rows - start;
+
+        load_exec("BEGIN");
+        double begin = now_ms();
+        load_counts_add(&counts, load_plan_execute(plan, rows + start, n, strategy));
+        double elapsed = now_ms() - begin;
+        double span = trace_begin();
+        PROBE(commit_start, plan->spec->table);
+        load_exec("COMMIT");
+        PROBE(commit_done, plan->spec->table);
+        trace_end("commit", plan->spec->table, (int64_t)n, span);
+
+        start += n;
+        throttle_sample(&t);
+        throttle_observe(&t, elapsed);
+
+        span = trace_begin();
+        throttle_pace(&t, n, elapsed);
+        trace_end("pace", plan->spec->table, (int64_t)n, span);
+    }
+    return counts;
+}
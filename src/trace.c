@@ -0,0 +1,188 @@
+#include "../include/common.h"
+#include "../include/trace.h"
+#include "../include/timing.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    const char *name;
+    const char *detail;
+    int64_t count;
+    double start; // Microseconds since trace_open.
+    double duration;
+} TraceEvent;
+
+// Spans of one thread. Only the owning thread appends; buffers are linked at
+// creation so the exit handler finds them.
+typedef struct TraceBuffer {
+    TraceEvent *events;
+    size_t len;
+    size_t cap;
+    char **details; // Copies of the distinct details, which callers may free.
+    size_t num_details;
+    size_t cap_details;
+    int tid;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+static const char *trace_path = NULL;
+static double trace_origin = 0;
+static bool tracing = false;
+
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *buffers = NULL;
+static int num_buffers = 0;
+static _Thread_local TraceBuffer *local = NULL;
+
+static double now_us(void) {
+    return (now_ms() - trace_origin) * 1e3;
+}
+
+static TraceBuffer *local_buffer(void) {
+    if (local)
+        return local;
+
+    local = calloc(1, sizeof(TraceBuffer));
+    if (!local) {
+        LOG_FATAL("out of memory");
+    }
+
+    pthread_mutex_lock(&buffers_lock);
+    local->tid = ++num_buffers;
+    local->next = buffers;
+    buffers = local;
+    pthread_mutex_unlock(&buffers_lock);
+    return local;
+}
+
+double trace_begin(void) {
+    return tracing ? now_us() : -1;
+}
+
+// Copy of detail owned by the buffer. Details are table, statement and file names,
+// so there are few distinct ones and a linear search, newest first, is enough.
+static const char *intern_detail(TraceBuffer *b, const char *detail) {
+    for (size_t i = b->num_details; i-- > 0;) {
+        if (strcmp(b->details[i], detail) == 0)
+            return b->details[i];
+    }
+
+    if (b->num_details == b->cap_details) {
+        b->cap_details = b->cap_details ? b->cap_details * 2 : 16;
+        b->details = realloc(b->details, b->cap_details * sizeof(char *));
+        if (!b->details) {
+            LOG_FATAL("out of memory");
+        }
+    }
+
+    char *copy = strdup(detail);
+    if (!copy) {
+        LOG_FATAL("out of memory");
+    }
+    b->details[b->num_details++] = copy;
+    return copy;
+}
+
+void trace_end(const char *name, const char *detail, int64_t count, double start) {
+    if (start < 0)
+        return;
+
+    TraceBuffer *b = local_buffer();
+    if (b->len == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 4096;
+        b->events = realloc(b->events, b->cap * sizeof(TraceEvent));
+        if (!b->events) {
+            LOG_FATAL("out of memory");
+        }
+    }
+
+    b->events[b->len++] = (TraceEvent){
+        .name = name,
+        .detail = detail ? intern_detail(b, detail) : NULL,
+        .count = count,
+        .start = start,
+        .duration = now_us() - start,
+    };
+}
+
+static void write_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+// Exit handler: one complete ("X") event per span and a name per thread.
+static void trace_write(void) {
+    tracing = false;
+
+    FILE *f = fopen(trace_path, "w");
+    if (!f) {
+        LOG_ERROR("unable to write trace %s: %s", trace_path, strerror(errno));
+        return;
+    }
+
+    int pid = (int)getpid();
+    size_t num_events = 0;
+    bool first = true;
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+
+    pthread_mutex_lock(&buffers_lock);
+    for (TraceBuffer *b = buffers; b; b = b->next) {
+        fprintf(f,
+                "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s %d\"}}",
+                first ? "" : ",\n", pid, b->tid, b->tid == 1 ? "main" : "worker", b->tid);
+        first = false;
+
+        for (size_t i = 0; i < b->len; i++) {
+            const TraceEvent *e = &b->events[i];
+            fputs(",\n{\"name\":", f);
+            write_string(f, e->name);
+            fprintf(f, ",\"cat\":\"eclinic\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,"
+                       "\"tid\":%d,\"args\":{",
+                    e->start, e->duration, pid, b->tid);
+            if (e->detail) {
+                fputs("\"detail\":", f);
+                write_string(f, e->detail);
+                fputc(',', f);
+            }
+            fprintf(f, "\"count\":%lld}}", (long long)e->count);
+        }
+        num_events += b->len;
+    }
+    pthread_mutex_unlock(&buffers_lock);
+
+    fputs("\n]}\n", f);
+    if (fclose(f) != 0) {
+        LOG_ERROR("unable to write trace %s: %s", trace_path, strerror(errno));
+        return;
+    }
+    LOG_INFO("Wrote %zu trace event(s) to %s", num_events, trace_path);
+}
+
+void trace_open(const char *path) {
+    if (tracing)
+        return;
+
+    trace_path = path;
+    trace_origin = now_ms();
+    tracing = true;
+
+    // The thread that opens the trace gets tid 1 and is named main.
+    local_buffer();
+    if (atexit(trace_write) != 0) {
+        LOG_FATAL("unable to register the trace writer");
+    }
+}
@@ -0,0 +1,505 @@
+#include "../include/transfer.h"
+#include "../include/strbuf.h"
+#include "../include/timing.h"
+#include <pthread.h>
+#include <string.h>
+
+#define TRANSFER_MAX_JOBS 16
+#define TRANSFER_MAX_TABLES 64
+#define TRANSFER_PROGRESS_MS 2000 // Interval between progress lines of a table.
+
+TransferOptions transfer_options = {
+    .source_env = NULL,
+    .target_env = NULL,
+    .tables = "inventory_items,prices,invoices",
+    .jobs = 2,
+    .truncate = false,
+};
+
+typedef enum {
+    TABLE_PENDING,
+    TABLE_RUNNING,
+    TABLE_DONE,
+} TableState;
+
+typedef struct {
+    const char *name;
+    char *columns;  // Column list of the target table.
+    char *truncate; // With --truncate, TRUNCATE of the table and the tables referencing it.
+    TableState state;
+    bool depends[TRANSFER_MAX_TABLES]; // Referenced tables that must be done first.
+} TransferTable;
+
+typedef struct {
+    TransferTable tables[TRANSFER_MAX_TABLES];
+    size_t num_tables;
+    size_t remaining; // Tables not done.
+    bool failed;      // A table failed, so no more are started.
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Schedule;
+
+typedef struct {
+    Schedule *schedule;
+    PGconn *source;
+    PGconn *target;
+} Worker;
+
+// Main thread only: failures are fatal.
+static void exec_command(PGconn *pg, const char *sql) {
+    PGresult *result = PQexec(pg, sql);
+    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+        LOG_FATAL("%s: %s", sql, PQerrorMessage(pg));
+    }
+    PQclear(result);
+}
+
+// Worker threads run commands with this: it logs a failure and returns false.
+static bool try_command(PGconn *pg, const char *sql) {
+    PGresult *result = PQexec(pg, sql);
+    bool ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+    if (!ok) {
+        LOG_ERROR("%s: %s", sql, PQerrorMessage(pg));
+    }
+    PQclear(result);
+    return ok;
+}
+
+// Main thread only, like exec_command.
+static PGresult *query_params(PGconn *pg, const char *sql, const char *param) {
+    const char *const paramValues[1] = {param};
+    PGresult *result = PQexecParams(pg, sql, 1, NULL, paramValues, NULL, NULL, 0);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        LOG_FATAL("%s", PQerrorMessage(pg));
+    }
+    return result;
+}
+
+// Connect with the PG* variables of a dotenv file. Variables are cleared first, so a
+// setting the file leaves out is not inherited from the other side's file.
+static PGconn *connect_env(const char *env_file) {
+    static const char *const vars[] = {"PGHOST", "PGPORT", "PGDATABASE", "PGUSER", "PGPASSWORD"};
+    for (size_t i = 0; i < sizeof(vars) / sizeof(vars[0]); i++) {
+        unsetenv(vars[i]);
+    }
+
+    parse_env_file(env_file);
+    if (!secure_getenv("PGHOST") || !secure_getenv("PGDATABASE")) {
+        LOG_FATAL("%s must set PGHOST and PGDATABASE", env_file);
+    }
+    return open_connection();
+}
+
+// Target column list, so that both sides agree on the binary row layout.
+static char *target_columns(PGconn *target, const char *table) {
+    const char *sql =
+        "SELECT string_agg(quote_ident(attname), ', ' ORDER BY attnum) FROM pg_attribute "
+        "WHERE attrelid = $1::regclass AND attnum > 0 AND NOT attisdropped AND attgenerated = ''";
+
+    PGresult *result = query_params(target, sql, table);
+    char *columns = strdup(PQgetvalue(result, 0, 0));
+    PQclear(result);
+    return columns;
+}
+
+// Record foreign keys between the selected tables. Self references are ignored.
+static void read_dependencies(PGconn *target, Schedule *schedule, const char *table_array) {
+    const char *sql =
+        "SELECT a.i, b.i FROM unnest($1::text[]) WITH ORDINALITY AS a(name, i) "
+        "JOIN pg_constraint c ON c.conrelid = a.name::regclass AND c.contype = 'f' "
+        "JOIN unnest($1::text[]) WITH ORDINALITY AS b(name, i) ON c.confrelid = b.name::regclass "
+        "WHERE a.i <> b.i";
+
+    PGresult *result = query_params(target, sql, table_array);
+    for (int r = 0; r < PQntuples(result); r++) {
+        size_t child = strtoull(PQgetvalue(result, r, 0), NULL, 10) - 1;
+        size_t parent = strtoull(PQgetvalue(result, r, 1), NULL, 10) - 1;
+        schedule->tables[child].depends[parent] = true;
+    }
+    PQclear(result);
+}
+
+// Abort on foreign key cycles, which would leave tables waiting on each other.
+static void check_cycles(const Schedule *schedule) {
+    bool done[TRANSFER_MAX_TABLES] = {false};
+    size_t num_done = 0;
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (size_t i = 0; i < schedule->num_tables; i++) {
+            if (done[i])
+                continue;
+
+            bool ready = true;
+            for (size_t j = 0; j < schedule->num_tables; j++) {
+                ready = ready && (!schedule->tables[i].depends[j] || done[j]);
+            }
+            if (ready) {
+                done[i] = true;
+                num_done++;
+                progress = true;
+            }
+        }
+    }
+
+    if (num_done < schedule->num_tables) {
+        for (size_t i = 0; i < schedule->num_tables; i++) {
+            if (!done[i]) {
+                LOG_ERROR("%s is part of a foreign key cycle", schedule->tables[i].name);
+            }
+        }
+        LOG_FATAL("transfer the tables of a foreign key cycle in separate runs");
+    }
+}
+
+// Next pending table whose referenced tables are done, or NULL.
+static TransferTable *next_ready(Schedule *schedule) {
+    for (size_t i = 0; i < schedule->num_tables; i++) {
+        TransferTable *table = &schedule->tables[i];
+        if (table->state != TABLE_PENDING)
+            continue;
+
+        bool ready = true;
+        for (size_t j = 0; j < schedule->num_tables; j++) {
+            ready = ready && (!table->depends[j] || schedule->tables[j].state == TABLE_DONE);
+        }
+        if (ready) {
+            return table;
+        }
+    }
+    return NULL;
+}
+
+// Move the sequences of serial and identity columns past the copied values. Returns
+// false, after logging why, on failure.
+static bool reset_sequences(PGconn *target, const char *table) {
+    const char *sql = "SELECT quote_ident(attname), pg_get_serial_sequence($1, attname) "
+                      "FROM pg_attribute WHERE attrelid = $1::regclass AND attnum > 0 "
+                      "AND NOT attisdropped AND pg_get_serial_sequence($1, attname) IS NOT NULL";
+
+    const char *const params[1] = {table};
+    PGresult *columns = PQexecParams(target, sql, 1, NULL, params, NULL, NULL, 0);
+    bool ok = PQresultStatus(columns) == PGRES_TUPLES_OK;
+    if (!ok) {
+        LOG_ERROR("sequences of %s: %s", table, PQerrorMessage(target));
+    }
+
+    for (int i = 0; ok && i < PQntuples(columns); i++) {
+        const char *column = PQgetvalue(columns, i, 0);
+        StrBuf setval;
+        sb_init(&setval, 256);
+        sb_appendf(&setval,
+                   "SELECT setval($1::regclass, coalesce(max(%s), 1), max(%s) IS NOT NULL) FROM %s",
+                   column, column, table);
+
+        const char *const sequence[1] = {PQgetvalue(columns, i, 1)};
+        PGresult *result = PQexecParams(target, setval.data, 1, NULL, sequence, NULL, NULL, 0);
+        if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+            LOG_ERROR("%s: %s", setval.data, PQerrorMessage(target));
+            ok = false;
+        }
+        PQclear(result);
+        sb_free(&setval);
+    }
+    PQclear(columns);
+    return ok;
+}
+
+// Pipe one table from source to target. Returns false, after logging why, on failure;
+// the target transaction is then left for the caller to close. Safe on worker threads:
+// nothing here exits.
+static bool transfer_table(Worker *worker, TransferTable *table) {
+    StrBuf copy_out, copy_in;
+    sb_init(&copy_out, 256);
+    sb_init(&copy_in, 256);
+    sb_appendf(&copy_out, "COPY %s (%s) TO STDOUT (FORMAT binary)", table->name, table->columns);
+    sb_appendf(&copy_in, "COPY %s (%s) FROM STDIN (FORMAT binary)", table->name, table->columns);
+
+    // Emptied in the copy's transaction, so a failed copy leaves the table as it was.
+    bool ok = try_command(worker->target, "BEGIN") &&
+              (!table->truncate || try_command(worker->target, table->truncate));
+
+    PGresult *result = NULL;
+    if (ok) {
+        result = PQexec(worker->target, copy_in.data);
+        ok = PQresultStatus(result) == PGRES_COPY_IN;
+        if (!ok) {
+            LOG_ERROR("%s: %s", copy_in.data, PQerrorMessage(worker->target));
+        }
+        PQclear(result);
+    }
+
+    bool copying = ok; // The target is in COPY IN and must be ended.
+    if (ok) {
+        result = PQexec(worker->source, copy_out.data);
+        ok = PQresultStatus(result) == PGRES_COPY_OUT;
+        if (!ok) {
+            LOG_ERROR("%s: %s", copy_out.data, PQerrorMessage(worker->source));
+        }
+        PQclear(result);
+    }
+
+    // libpq hands out one row per message; the binary header and trailer ride along.
+    double start = now_ms(), last_report = start;
+    size_t rows = 0, bytes = 0;
+    char *data;
+    int len = -1;
+    while (ok && (len = PQgetCopyData(worker->source, &data, 0)) > 0) {
+        if (PQputCopyData(worker->target, data, len) != 1) {
+            LOG_ERROR("%s: %s", table->name, PQerrorMessage(worker->target));
+            ok = false;
+        }
+        PQfreemem(data);
+        rows++;
+        bytes += (size_t)len;
+
+        double now = now_ms();
+        if (now - last_report >= TRANSFER_PROGRESS_MS) {
+            LOG_INFO("%s: %zu rows, %.1f MB (%.1f MB/s)", table->name, rows, bytes / 1e6,
+                     bytes / 1e3 / (now - start));
+            last_report = now;
+        }
+    }
+
+    if (ok && len == -2) {
+        LOG_ERROR("%s: %s", copy_out.data, PQerrorMessage(worker->source));
+        ok = false;
+    } else if (ok) {
+        result = PQgetResult(worker->source);
+        if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+            LOG_ERROR("%s: %s", copy_out.data, PQerrorMessage(worker->source));
+            ok = false;
+        }
+        PQclear(result);
+    }
+
+    // A COPY ended with an error message fails on the server and rolls nothing in.
+    if (copying && PQputCopyEnd(worker->target, ok ? NULL : "source COPY failed") != 1) {
+        LOG_ERROR("%s: %s", copy_in.data, PQerrorMessage(worker->target));
+        ok = false;
+    } else if (copying) {
+        result = PQgetResult(worker->target);
+        if (ok && PQresultStatus(result) != PGRES_COMMAND_OK) {
+            LOG_ERROR("%s: %s", copy_in.data, PQerrorMessage(worker->target));
+            ok = false;
+        }
+        if (ok) {
+            rows = strtoull(PQcmdTuples(result), NULL, 10);
+        }
+        PQclear(result);
+        while ((result = PQgetResult(worker->target)) != NULL) {
+            PQclear(result);
+        }
+    }
+
+    ok = ok && reset_sequences(worker->target, table->name) &&
+         try_command(worker->target, "COMMIT");
+
+    if (ok) {
+        double elapsed = now_ms() - start;
+        LOG_INFO("Transferred %zu row(s) of %s, %.1f MB in %.1f ms", rows, table->name,
+                 bytes / 1e6, elapsed);
+    }
+
+    sb_free(&copy_out);
+    sb_free(&copy_in);
+    return ok;
+}
+
+// Copy tables until none are left or one fails. Returns the failed table, NULL if none.
+// Workers never exit the process: the main thread reports failures once all joined.
+static void *transfer_worker(void *arg) {
+    Worker *worker = arg;
+    Schedule *schedule = worker->schedule;
+
+    for (;;) {
+        pthread_mutex_lock(&schedule->lock);
+        TransferTable *table = NULL;
+        while (!schedule->failed && (table = next_ready(schedule)) == NULL &&
+               schedule->remaining > 0) {
+            pthread_cond_wait(&schedule->changed, &schedule->lock);
+        }
+
+        if (schedule->failed || table == NULL) {
+            pthread_mutex_unlock(&schedule->lock);
+            return NULL;
+        }
+        table->state = TABLE_RUNNING;
+        pthread_mutex_unlock(&schedule->lock);
+
+        bool ok = transfer_table(worker, table);
+
+        pthread_mutex_lock(&schedule->lock);
+        if (ok) {
+            table->state = TABLE_DONE;
+            schedule->remaining--;
+        } else {
+            schedule->failed = true;
+        }
+        pthread_cond_broadcast(&schedule->changed);
+        pthread_mutex_unlock(&schedule->lock);
+
+        if (!ok)
+            return table;
+    }
+}
+
+// TRUNCATE of each table together with the selected tables that reference it, directly
+// or through others, as PostgreSQL requires.
+static void plan_truncates(Schedule *schedule) {
+    for (size_t t = 0; t < schedule->num_tables; t++) {
+        bool listed[TRANSFER_MAX_TABLES] = {false};
+        listed[t] = true;
+        for (bool grew = true; grew;) {
+            grew = false;
+            for (size_t i = 0; i < schedule->num_tables; i++) {
+                for (size_t j = 0; j < schedule->num_tables && !listed[i]; j++) {
+                    if (listed[j] && schedule->tables[i].depends[j]) {
+                        listed[i] = grew = true;
+                    }
+                }
+            }
+        }
+
+        StrBuf sql;
+        sb_init(&sql, 256);
+        sb_appendf(&sql, "TRUNCATE %s", schedule->tables[t].name);
+        for (size_t i = 0; i < schedule->num_tables; i++) {
+            if (listed[i] && i != t) {
+                sb_appendf(&sql, ", %s", schedule->tables[i].name);
+            }
+        }
+        schedule->tables[t].truncate = sql.data;
+    }
+}
+
+void transfer_tables(Subcommand *cmd) {
+    (void)cmd;
+    assert(transfer_options.source_env);
+    assert(transfer_options.target_env);
+
+    int jobs = transfer_options.jobs;
+    if (jobs <= 0 || jobs > TRANSFER_MAX_JOBS) {
+        LOG_FATAL("--jobs must be between 1 and %d, got %d", TRANSFER_MAX_JOBS, jobs);
+    }
+
+    Schedule schedule = {0};
+    char *tables = strdup(transfer_options.tables);
+    if (!tables) {
+        LOG_FATAL("out of memory");
+    }
+
+    StrBuf table_array;
+    sb_init(&table_array, 256);
+    sb_putc(&table_array, '{');
+
+    char *saveptr = NULL;
+    for (char *name = strtok_r(tables, ",", &saveptr); name;
+         name = strtok_r(NULL, ",", &saveptr)) {
+        if (schedule.num_tables == TRANSFER_MAX_TABLES) {
+            LOG_FATAL("at most %d tables can be transferred at once", TRANSFER_MAX_TABLES);
+        }
+        if (schedule.num_tables > 0) {
+            sb_putc(&table_array, ',');
+        }
+        sb_append_array_element(&table_array, name);
+        schedule.tables[schedule.num_tables++].name = name;
+    }
+    sb_putc(&table_array, '}');
+    schedule.remaining = schedule.num_tables;
+
+    // Connections are opened up front: each dotenv file replaces the PG* variables.
+    size_t nworkers = (size_t)jobs < schedule.num_tables ? (size_t)jobs : schedule.num_tables;
+    Worker workers[TRANSFER_MAX_JOBS];
+    PGconn *source = connect_env(transfer_options.source_env);
+    for (size_t i = 0; i < nworkers; i++) {
+        workers[i].source = connect_env(transfer_options.source_env);
+    }
+
+    PGconn *target = connect_env(transfer_options.target_env);
+    for (size_t i = 0; i < nworkers; i++) {
+        workers[i].target = connect_env(transfer_options.target_env);
+        workers[i].schedule = &schedule;
+    }
+
+    for (size_t i = 0; i < schedule.num_tables; i++) {
+        schedule.tables[i].columns = target_columns(target, schedule.tables[i].name);
+    }
+    read_dependencies(target, &schedule, table_array.data);
+    check_cycles(&schedule);
+
+    if (transfer_options.truncate) {
+        plan_truncates(&schedule);
+    }
+
+    // Every worker reads the coordinator's snapshot: the copy is consistent even while
+    // the source stays in use.
+    exec_command(source, "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY");
+    PGresult *result = PQexec(source, "SELECT pg_export_snapshot()");
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        LOG_FATAL("unable to export snapshot: %s", PQerrorMessage(source));
+    }
+
+    char snapshot_sql[128];
+    snprintf(snapshot_sql, sizeof(snapshot_sql), "SET TRANSACTION SNAPSHOT '%s'",
+             PQgetvalue(result, 0, 0));
+    PQclear(result);
+
+    for (size_t i = 0; i < nworkers; i++) {
+        exec_command(workers[i].source, "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY");
+        exec_command(workers[i].source, snapshot_sql);
+    }
+
+    pthread_mutex_init(&schedule.lock, NULL);
+    pthread_cond_init(&schedule.changed, NULL);
+
+    double start = now_ms();
+    pthread_t threads[TRANSFER_MAX_JOBS];
+    size_t started = 0;
+    while (started < nworkers &&
+           pthread_create(&threads[started], NULL, transfer_worker, &workers[started]) == 0) {
+        started++;
+    }
+    if (started < nworkers) {
+        LOG_ERROR("unable to start transfer worker");
+        pthread_mutex_lock(&schedule.lock);
+        schedule.failed = true;
+        pthread_cond_broadcast(&schedule.changed);
+        pthread_mutex_unlock(&schedule.lock);
+    }
+
+    size_t failed = 0;
+    for (size_t i = 0; i < started; i++) {
+        void *table;
+        pthread_join(threads[i], &table);
+        if (table) {
+            LOG_ERROR("transfer of %s failed and was rolled back",
+                      ((const TransferTable *)table)->name);
+            failed++;
+        }
+    }
+
+    // Source transactions are read only and a failed target transaction is rolled back:
+    // closing a connection ends its own. Tables that finished stay committed.
+    for (size_t i = 0; i < nworkers; i++) {
+        PQfinish(workers[i].source);
+        PQfinish(workers[i].target);
+    }
+    PQfinish(source);
+    PQfinish(target);
+
+    pthread_mutex_destroy(&schedule.lock);
+    pthread_cond_destroy(&schedule.changed);
+    for (size_t i = 0; i < schedule.num_tables; i++) {
+        free(schedule.tables[i].columns);
+        free(schedule.tables[i].truncate);
+    }
+    sb_free(&table_array);
+    free(tables);
+
+    if (schedule.failed) {
+        LOG_FATAL("transfer stopped: %zu table(s) failed, %zu of %zu not copied", failed,
+                  schedule.remaining, schedule.num_tables);
+    }
+    LOG_INFO("Transferred %zu table(s) in %.1f ms", schedule.num_tables, now_ms() - start);
+}
@@ -1,93 +1,48 @@
 #include "../include/bcrypt.h"
-#include "../include/common.h"
+#include "../include/loader.h"
 #include <solidc/stdstreams.h>
 #include <string.h>
 
-// Expected CSV Headers
-// Username,  Title,  FirstName, LastName, Email
-// johndoe, Mr, John, Doe,johndoes@gmail.com
-static void upload_users(CsvRow **rows, size_t num_rows) {
-    if (num_rows == 0)
-        return;
-
-    size_t nfields = rows[0]->numFields;
-    if (nfields != 5) {
-        fprintf(stderr, "CVS is expected to have 5 columns\n");
-        exit(1);
-    }
-
-    //  ================= start a transaction ===================
-    res = PQexec(conn, "BEGIN");
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        LOG_FATAL("begin transaction failed");
-    }
-    FreeResult();
-
-    // Default password is the username. It must be changed by the user.
-    char *stmt = "INSERT INTO users (username, title, first_name, last_name, email, password, "
-                 "created_at, updated_at, is_superuser, active)"
-                 "VALUES ($1, $2, $3, $4, $5, $6, NOW(), NOW(), false, true)";
-
-    res = PQprepare(conn, "insert_users", stmt, 6, NULL);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        LOG_FATAL("Failed to prepare statement: %s", PQerrorMessage(conn));
-    }
-    FreeResult();
-
-    ExecStatusType status;
-    for (size_t i = 0; i < num_rows; i++) {
-        char **fields = rows[i]->fields;
-        const char *username = fields[0];
-        const char *title = fields[1];
-        const char *first_name = fields[2];
-        const char *last_name = fields[3];
-        const char *email = fields[4];
-
-        // Hash the password
-        char password[BCRYPT_HASHSIZE] = {0};
-        if (!hash_password(username, password)) {
-            LOG_FATAL("Failed to hash password for user %s", username);
-        }
-
-        const char *const paramValues[] = {
-            username, title, first_name, last_name, email,
-            password, // Hashed password
-        };
-
-        res = PQexecPrepared(conn, "insert_users", 6, paramValues, NULL, NULL, 0);
-        status = PQresultStatus(res);
-        if (status != PGRES_COMMAND_OK) {
-            LOG_FATAL("%s", PQerrorMessage(conn));
-        }
-        FreeResult();
-    }
+// Default password is the username. It must be changed by the user.
+static const char *hash_username(char **fields, size_t numfields) {
+    (void)numfields;
 
-    // Commit the transaction
-    res = PQexec(conn, "COMMIT");
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        LOG_FATAL("commit transaction failed");
+    static char password[BCRYPT_HASHSIZE];
+    if (!hash_password(fields[0], password)) {
+        LOG_FATAL("Failed to hash password for user %s", fields[0]);
     }
-    LOG_INFO("Uploaded %zu user account(s)", num_rows);
+    return password;
 }
 
+// Expected CSV Headers
+// Username,  Title,  FirstName, LastName, Email
+// johndoe, Mr, John, Doe,johndoes@gmail.com
+static const ColumnMap user_columns[] = {
+    {.column = "username", .index = 0},
+    {.column = "title", .index = 1},
+    {.column = "first_name", .index = 2},
+    {.column = "last_name", .index = 3},
+    {.column = "email", .index = 4},
+    {.column = "password", .compute = hash_username},
+    {.column = "created_at", .expr = "NOW()"},
+    {.column = "updated_at", .expr = "NOW()"},
+    {.column = "is_superuser", .expr = "false"},
+    {.column = "active", .expr = "true"},
+};
+
+static const LoadSpec users_spec = {
+    .name = "users",
+    .table = "users",
+    .columns = user_columns,
+    .num_columns = sizeof(user_columns) / sizeof(user_columns[0]),
+    .expected_fields = 5,
+};
+
+const LoadSpec *const users_specs[] = {&users_spec, NULL};
+
 void upload_user_accounts_csv(Subcommand *cmd) {
     (void)cmd;
-    assert(filename);
-
-    CsvParser *parser = csvparser_new(filename);
-    if (!parser) {
-        LOG_FATAL("failed to initialize csv parser");
-    }
-
-    csvparser_setconfig(parser, (CsvParserConfig){.has_header = true, .skip_header = true});
-    CsvRow **rows = csvparser_parse(parser);
-    if (!rows) {
-        LOG_FATAL("csvparser_parse() failed");
-    }
-
-    size_t numrows = csvparser_numrows(parser);
-    upload_users(rows, numrows);
-    csvparser_free(parser);
+    load_csv("users", filename, users_specs, 1);
 }
 
 void read_value(const char *prompt, char *buffer, size_t size) {
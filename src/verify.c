@@ -0,0 +1,598 @@
+#include "../include/verify.h"
+#include "../include/dedup.h"
+#include "../include/md5.h"
+#include "../include/sort.h"
+#include "../include/strbuf.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+char *verify_loader = NULL;
+
+#define VERIFY_MAX_THREADS 16
+#define VERIFY_ROWS_PER_THREAD 4096
+#define VERIFY_MAX_REPORTED 20 // Mismatched keys listed before bisection stops.
+#define VERIFY_FILTER_ROWS 10000 // Rows sent per query evaluating a spec's filter.
+
+// Digest of a set of rows: row count and the sum of the row hashes modulo 2^64.
+typedef struct {
+    size_t rows;
+    uint64_t sum;
+} Digest;
+
+typedef struct {
+    LoadPlan *plan;
+    size_t num_inputs;  // Inputs stored in the table (not input_only or computed).
+    size_t *inputs;     // Their input positions, in spec order.
+    char *sql;          // Server digest of the rows whose keys are in $1..$k.
+    char stmt_name[64]; // Prepared statement name of sql.
+    bool prepared;
+    char *filter_sql;     // Row numbers of $1..$n rows passing the spec's filter, or NULL.
+    char filter_name[64]; // Prepared statement name of filter_sql.
+    bool filter_prepared;
+    size_t reported; // Mismatched keys reported.
+} VerifyPlan;
+
+// ======================= Normalization =======================
+
+// Print a number the way int and numeric output functions do: no '+', no leading
+// zeros, no negative zero and, for numeric(p,s), exactly s fraction digits when
+// the input has fewer. Anything else (exponents, NaN) is left alone.
+static void normalize_number(StrBuf *sb, const char *value, size_t len, int scale) {
+    const char *p = value;
+    size_t n = len;
+    bool negative = false;
+    if (n > 0 && (*p == '+' || *p == '-')) {
+        negative = *p == '-';
+        p++;
+        n--;
+    }
+
+    const char *dot = memchr(p, '.', n);
+    size_t int_len = dot ? (size_t)(dot - p) : n;
+    size_t frac_len = dot ? n - int_len - 1 : 0;
+    if (n == 0 || strspn(p, "0123456789") != int_len ||
+        (dot && strspn(dot + 1, "0123456789") < frac_len)) {
+        sb_appendn(sb, value, len);
+        return;
+    }
+
+    while (int_len > 1 && *p == '0') {
+        p++;
+        int_len--;
+    }
+
+    bool zero = strspn(p, "0.") >= int_len + (dot ? frac_len + 1 : 0);
+    if (negative && !zero) {
+        sb_putc(sb, '-');
+    }
+
+    if (int_len == 0) {
+        sb_putc(sb, '0');
+    } else {
+        sb_appendn(sb, p, int_len);
+    }
+
+    size_t digits = scale > (int)frac_len ? (size_t)scale : frac_len;
+    if (digits > 0) {
+        sb_putc(sb, '.');
+        sb_appendn(sb, dot ? dot + 1 : "", frac_len);
+        for (size_t i = frac_len; i < digits; i++) {
+            sb_putc(sb, '0');
+        }
+    }
+}
+
+// Canonical text of an input as the server prints the stored value: text is
+// unchanged, other types are trimmed and '' is NULL, printed as "\N".
+static void normalize_value(StrBuf *sb, const char *value, const char *type) {
+    if (load_type_is_text(type)) {
+        sb_append(sb, value);
+        return;
+    }
+
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+
+    size_t len = strlen(value);
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+        len--;
+    }
+
+    if (len == 0) {
+        sb_append(sb, "\\N");
+    } else if (strcmp(type, "boolean") == 0) {
+        bool truthy = strchr("tTyY1", value[0]) || strncasecmp(value, "on", 2) == 0;
+        sb_append(sb, truthy ? "true" : "false");
+    } else if (strcmp(type, "smallint") == 0 || strcmp(type, "integer") == 0 ||
+               strcmp(type, "bigint") == 0) {
+        normalize_number(sb, value, len, 0);
+    } else if (strncmp(type, "numeric", 7) == 0) {
+        int precision, scale = -1;
+        if (sscanf(type, "numeric(%d,%d)", &precision, &scale) == 1) {
+            scale = 0;
+        }
+        normalize_number(sb, value, len, scale);
+    } else {
+        sb_appendn(sb, value, len);
+    }
+}
+
+// ======================= Client digest =======================
+
+static uint64_t row_hash(const VerifyPlan *v, CsvRow *row, StrBuf *sb) {
+    sb_reset(sb);
+    for (size_t i = 0; i < v->num_inputs; i++) {
+        size_t input = v->inputs[i];
+        if (i > 0) {
+            sb_putc(sb, '\x1f');
+        }
+        normalize_value(sb, load_input_value(v->plan, row, input), v->plan->input_types[input]);
+    }
+
+    // The first 8 bytes big-endian, as ('x' || left(md5(...), 16))::bit(64) reads them.
+    uint8_t digest[16];
+    md5(sb->data, sb->len, digest);
+
+    uint64_t h = 0;
+    for (int i = 0; i < 8; i++) {
+        h = h << 8 | digest[i];
+    }
+    return h;
+}
+
+typedef struct {
+    const VerifyPlan *verify;
+    CsvRow **rows;
+    uint64_t *hashes;
+    size_t start;
+    size_t end;
+} HashTask;
+
+static void *hash_rows(void *arg) {
+    HashTask *task = arg;
+    StrBuf sb;
+    sb_init(&sb, 256);
+    for (size_t i = task->start; i < task->end; i++) {
+        task->hashes[i] = row_hash(task->verify, task->rows[i], &sb);
+    }
+    sb_free(&sb);
+    return NULL;
+}
+
+// Hash every row, splitting the rows across threads.
+static void hash_all_rows(const VerifyPlan *v, CsvRow **rows, size_t num_rows,
+                          uint64_t *hashes) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cpus > 0 ? (size_t)cpus : 1;
+    if (nthreads > VERIFY_MAX_THREADS) {
+        nthreads = VERIFY_MAX_THREADS;
+    }
+    if (nthreads > num_rows / VERIFY_ROWS_PER_THREAD + 1) {
+        nthreads = num_rows / VERIFY_ROWS_PER_THREAD + 1;
+    }
+
+    pthread_t threads[VERIFY_MAX_THREADS];
+    HashTask tasks[VERIFY_MAX_THREADS];
+    size_t per_thread = (num_rows + nthreads - 1) / nthreads;
+    for (size_t t = 0; t < nthreads; t++) {
+        size_t start = t * per_thread;
+        size_t end = start + per_thread < num_rows ? start + per_thread : num_rows;
+        tasks[t] = (HashTask){.verify = v, .rows = rows, .hashes = hashes, .start = start,
+                              .end = end};
+    }
+
+    // The calling thread takes the first share.
+    for (size_t t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, hash_rows, &tasks[t]) != 0) {
+            LOG_FATAL("unable to start hashing thread");
+        }
+    }
+    hash_rows(&tasks[0]);
+    for (size_t t = 1; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+static Digest client_digest(const uint64_t *hashes, size_t n) {
+    Digest d = {.rows = n};
+    for (size_t i = 0; i < n; i++) {
+        d.sum += hashes[i];
+    }
+    return d;
+}
+
+// ======================= Server digest =======================
+
+// Only rows whose conflict key is read straight from the file, or can be read back
+// through spec->client_key_from, can be looked up.
+static VerifyPlan *verify_plan_new(LoadPlan *plan) {
+    const LoadSpec *spec = plan->spec;
+    if (!spec->conflict_key || (spec->client_key && !spec->client_key_from) ||
+        plan->num_keys == 0) {
+        LOG_ERROR("%s: rows are not keyed by file values, skipping verification", spec->table);
+        return NULL;
+    }
+
+    for (size_t k = 0; k < plan->num_keys; k++) {
+        if (plan->inputs[plan->key_inputs[k]]->compute) {
+            LOG_ERROR("%s: key is computed on the client, skipping verification", spec->table);
+            return NULL;
+        }
+    }
+
+    VerifyPlan *v = calloc(1, sizeof(VerifyPlan));
+    if (!v) {
+        LOG_FATAL("out of memory");
+    }
+
+    v->inputs = calloc(plan->num_inputs, sizeof(size_t));
+    if (!v->inputs) {
+        LOG_FATAL("out of memory");
+    }
+    v->plan = plan;
+    snprintf(v->stmt_name, sizeof(v->stmt_name), "verify_%s", spec->name);
+
+    StrBuf sql;
+    sb_init(&sql, 1024);
+
+    // The sum of signed bigints is brought back to [0, 2^64) to match the unsigned
+    // wrapping sum on the client.
+    sb_append(&sql, "SELECT count(*), (coalesce(sum(('x' || left(md5(concat_ws(E'\\x1f'");
+    for (size_t i = 0; i < plan->num_inputs; i++) {
+        const ColumnMap *col = plan->inputs[i];
+        if (col->input_only || col->compute)
+            continue;
+
+        v->inputs[v->num_inputs++] = i;
+        sb_appendf(&sql, ", coalesce(t.%s::text, '\\N')", col->column);
+    }
+    sb_append(&sql, ")), 16))::bit(64)::bigint::numeric), 0) % 18446744073709551616 "
+                    "+ 18446744073709551616) % 18446744073709551616 FROM ");
+    if (spec->client_key_from) {
+        sb_appendf(&sql, "%s WHERE (", spec->client_key_from);
+    } else {
+        sb_appendf(&sql, "%s t WHERE (", spec->table);
+    }
+
+    const char *alias = spec->client_key_from ? "k" : "t";
+    for (size_t k = 0; k < plan->num_keys; k++) {
+        sb_appendf(&sql, "%s%s.%s::text", k ? ", " : "", alias,
+                   plan->inputs[plan->key_inputs[k]]->column);
+    }
+    sb_append(&sql, ") IN (SELECT * FROM unnest(");
+    for (size_t k = 0; k < plan->num_keys; k++) {
+        sb_appendf(&sql, "%s$%zu::text[]", k ? ", " : "", k + 1);
+    }
+    sb_append(&sql, "))");
+
+    v->sql = sql.data;
+
+    // Rows the filter drops never reach the table, so the server tells which they are
+    // the way the load would: from the typed inputs, joins included.
+    if (spec->where) {
+        snprintf(v->filter_name, sizeof(v->filter_name), "verify_%s_filter", spec->name);
+        sb_init(&sql, 1024);
+        sb_append(&sql, "SELECT s._row FROM (SELECT ");
+        for (size_t i = 0; i < plan->num_inputs; i++) {
+            const char *column = plan->inputs[i]->column, *type = plan->input_types[i];
+            if (load_type_is_text(type)) {
+                sb_appendf(&sql, "r.%s AS %s, ", column, column);
+            } else {
+                sb_appendf(&sql, "NULLIF(r.%s, '')::%s AS %s, ", column, type, column);
+            }
+        }
+        sb_append(&sql, "r._row FROM unnest(");
+        for (size_t i = 0; i < plan->num_inputs; i++) {
+            sb_appendf(&sql, "%s$%zu::text[]", i ? ", " : "", i + 1);
+        }
+        sb_append(&sql, ") WITH ORDINALITY AS r(");
+        for (size_t i = 0; i < plan->num_inputs; i++) {
+            sb_appendf(&sql, "%s, ", plan->inputs[i]->column);
+        }
+        sb_append(&sql, "_row)) AS s");
+        if (spec->joins) {
+            sb_appendf(&sql, " %s", spec->joins);
+        }
+        sb_appendf(&sql, " WHERE %s ORDER BY s._row", spec->where);
+        v->filter_sql = sql.data;
+    }
+    return v;
+}
+
+static void verify_plan_free(VerifyPlan *v) {
+    if (!v)
+        return;
+
+    free(v->inputs);
+    free(v->sql);
+    free(v->filter_sql);
+    free(v);
+}
+
+// Digest of the stored rows whose keys appear in rows. Only the keys are sent.
+static Digest server_digest(VerifyPlan *v, CsvRow **rows, size_t n) {
+    const LoadPlan *plan = v->plan;
+    if (!v->prepared) {
+        res = PQprepare(conn, v->stmt_name, v->sql, (int)plan->num_keys, NULL);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            LOG_FATAL("Failed to prepare statement: %s", PQerrorMessage(conn));
+        }
+        FreeResult();
+        v->prepared = true;
+    }
+
+    StrBuf *arrays = calloc(plan->num_keys, sizeof(StrBuf));
+    const char **params = calloc(plan->num_keys, sizeof(char *));
+    if (!arrays || !params) {
+        LOG_FATAL("out of memory");
+    }
+
+    StrBuf value;
+    sb_init(&value, 64);
+    for (size_t k = 0; k < plan->num_keys; k++) {
+        size_t input = plan->key_inputs[k];
+        sb_init(&arrays[k], n * 16 + 2);
+        sb_putc(&arrays[k], '{');
+        for (size_t i = 0; i < n; i++) {
+            sb_reset(&value);
+            normalize_value(&value, load_input_value(plan, rows[i], input),
+                            plan->input_types[input]);
+            if (i > 0) {
+                sb_putc(&arrays[k], ',');
+            }
+            sb_append_array_element(&arrays[k], value.data);
+        }
+        sb_putc(&arrays[k], '}');
+        params[k] = arrays[k].data;
+    }
+
+    res = PQexecPrepared(conn, v->stmt_name, (int)plan->num_keys, params, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        LOG_FATAL("digest of %s failed: %s", plan->spec->table, PQerrorMessage(conn));
+    }
+
+    Digest d = {
+        .rows = strtoull(PQgetvalue(res, 0, 0), NULL, 10),
+        .sum = strtoull(PQgetvalue(res, 0, 1), NULL, 10),
+    };
+    FreeResult();
+
+    for (size_t k = 0; k < plan->num_keys; k++) {
+        sb_free(&arrays[k]);
+    }
+    sb_free(&value);
+    free(arrays);
+    free(params);
+    return d;
+}
+
+// ======================= Filter =======================
+
+// Drop the rows the spec's filter excludes, keeping the others in order. Returns how
+// many are kept.
+static size_t filter_rows(VerifyPlan *v, CsvRow **rows, size_t num_rows) {
+    const LoadPlan *plan = v->plan;
+    if (!v->filter_sql)
+        return num_rows;
+
+    if (!v->filter_prepared) {
+        res = PQprepare(conn, v->filter_name, v->filter_sql, (int)plan->num_inputs, NULL);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            LOG_FATAL("Failed to prepare statement: %s", PQerrorMessage(conn));
+        }
+        FreeResult();
+        v->filter_prepared = true;
+    }
+
+    StrBuf *arrays = calloc(plan->num_inputs, sizeof(StrBuf));
+    const char **params = calloc(plan->num_inputs, sizeof(char *));
+    if (!arrays || !params) {
+        LOG_FATAL("out of memory");
+    }
+    for (size_t j = 0; j < plan->num_inputs; j++) {
+        sb_init(&arrays[j], 4096);
+    }
+
+    size_t kept = 0;
+    for (size_t start = 0; start < num_rows; start += VERIFY_FILTER_ROWS) {
+        size_t end = start + VERIFY_FILTER_ROWS < num_rows ? start + VERIFY_FILTER_ROWS
+                                                           : num_rows;
+        for (size_t j = 0; j < plan->num_inputs; j++) {
+            sb_reset(&arrays[j]);
+            sb_putc(&arrays[j], '{');
+            for (size_t i = start; i < end; i++) {
+                if (i > start) {
+                    sb_putc(&arrays[j], ',');
+                }
+                sb_append_array_element(&arrays[j], load_input_value(plan, rows[i], j));
+            }
+            sb_putc(&arrays[j], '}');
+            params[j] = arrays[j].data;
+        }
+
+        res = PQexecPrepared(conn, v->filter_name, (int)plan->num_inputs, params, NULL, NULL, 0);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            LOG_FATAL("filter of %s failed: %s", plan->spec->table, PQerrorMessage(conn));
+        }
+
+        // Row numbers come back in order and are never behind kept.
+        for (int r = 0; r < PQntuples(res); r++) {
+            rows[kept++] = rows[start + strtoull(PQgetvalue(res, r, 0), NULL, 10) - 1];
+        }
+        FreeResult();
+    }
+
+    if (kept < num_rows) {
+        LOG_INFO("%s: %zu row(s) are excluded by the filter and not checked", plan->spec->table,
+                 num_rows - kept);
+    }
+
+    for (size_t j = 0; j < plan->num_inputs; j++) {
+        sb_free(&arrays[j]);
+    }
+    free(arrays);
+    free(params);
+    return kept;
+}
+
+// ======================= Bisection =======================
+
+static bool digest_equal(Digest a, Digest b) {
+    return a.rows == b.rows && a.sum == b.sum;
+}
+
+static void report_row(VerifyPlan *v, CsvRow *row, Digest server) {
+    const LoadPlan *plan = v->plan;
+    StrBuf key;
+    sb_init(&key, 64);
+    for (size_t k = 0; k < plan->num_keys; k++) {
+        sb_appendf(&key, "%s%s", k ? ", " : "", load_input_value(plan, row, plan->key_inputs[k]));
+    }
+
+    LOG_ERROR("%s: row (%s) %s", plan->spec->table, key.data,
+              server.rows == 0 ? "is missing" : "differs from the file");
+    sb_free(&key);
+    v->reported++;
+}
+
+// Narrow a range of key-sorted rows whose digest differs from server down to single
+// rows. Only the left half is queried: the right half's server digest is the rest.
+static void bisect(VerifyPlan *v, CsvRow **rows, const uint64_t *hashes, size_t n,
+                   Digest server) {
+    if (v->reported >= VERIFY_MAX_REPORTED)
+        return;
+
+    if (n == 1) {
+        report_row(v, rows[0], server);
+        return;
+    }
+
+    size_t half = n / 2;
+    Digest left = server_digest(v, rows, half);
+    Digest right = {.rows = server.rows - left.rows, .sum = server.sum - left.sum};
+
+    if (!digest_equal(client_digest(hashes, half), left)) {
+        bisect(v, rows, hashes, half, left);
+    }
+
+    if (!digest_equal(client_digest(hashes + half, n - half), right)) {
+        bisect(v, rows + half, hashes + half, n - half, right);
+    }
+}
+
+// Verify the rows of one spec. Returns the number of mismatched rows found.
+static size_t verify_rows(VerifyPlan *v, CsvRow **rows, size_t num_rows) {
+    const char *table = v->plan->spec->table;
+    uint64_t *hashes = malloc(num_rows * sizeof(uint64_t));
+    if (!hashes) {
+        LOG_FATAL("out of memory");
+    }
+
+    hash_all_rows(v, rows, num_rows, hashes);
+    Digest client = client_digest(hashes, num_rows);
+    Digest server = server_digest(v, rows, num_rows);
+
+    if (digest_equal(client, server)) {
+        LOG_INFO("%s: %zu row(s) match (digest %016" PRIx64 ")", table, client.rows, client.sum);
+        free(hashes);
+        return 0;
+    }
+
+    LOG_ERROR("%s: file has %zu row(s) (digest %016" PRIx64 "), server has %zu (digest %016" PRIx64
+              ")",
+              table, client.rows, client.sum, server.rows, server.sum);
+
+    bisect(v, rows, hashes, num_rows, server);
+    if (v->reported >= VERIFY_MAX_REPORTED) {
+        LOG_ERROR("%s: stopped after %d mismatched rows", table, VERIFY_MAX_REPORTED);
+    }
+
+    free(hashes);
+    return v->reported;
+}
+
+void verify_load(Subcommand *cmd) {
+    (void)cmd;
+    assert(filename);
+    assert(verify_loader);
+
+    const LoadSpec *const *specs = NULL;
+    if (strcmp(verify_loader, "pricelist") == 0) {
+        specs = pricelist_specs;
+    } else if (strcmp(verify_loader, "invoices") == 0) {
+        specs = invoices_specs;
+    } else if (strcmp(verify_loader, "users") == 0) {
+        // Passwords are hashed with a random salt and users have no key to look them up by.
+        LOG_FATAL("users cannot be verified: the table has no key and passwords are salted");
+    } else {
+        LOG_FATAL("unknown loader: %s (expected pricelist or invoices)", verify_loader);
+    }
+
+    if (load_options.memory_mb <= 0) {
+        LOG_FATAL("memory budget must be positive, got %d MB", load_options.memory_mb);
+    }
+
+    CsvRow *header, **rows;
+    size_t num_rows;
+    CsvParser *parser = load_csv_parse(filename, &header, &rows, &num_rows);
+    if (num_rows == 0) {
+        LOG_INFO("%s has no rows to verify", filename);
+        csvparser_free(parser);
+        return;
+    }
+
+    DedupMode dedup = dedup_mode_parse(load_options.dedup);
+    size_t memory_budget = (size_t)load_options.memory_mb << 20;
+    CsvRow **plan_rows = malloc(num_rows * sizeof(CsvRow *));
+    if (!plan_rows) {
+        LOG_FATAL("out of memory");
+    }
+
+    // Every digest, including those taken while bisecting, reads the same snapshot.
+    load_exec("BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY");
+    load_exec("SET LOCAL DateStyle = ISO, YMD");
+
+    size_t mismatched = 0;
+    StrBuf skipped; // Tables that cannot be verified, comma separated.
+    sb_init(&skipped, 64);
+    for (size_t i = 0; specs[i]; i++) {
+        LoadPlan *plan = load_plan_compile(specs[i], header);
+        load_validate_rows(plan, rows, num_rows);
+
+        VerifyPlan *v = verify_plan_new(plan);
+        if (v) {
+            // The table holds one row per key: the one the load kept.
+            memcpy(plan_rows, rows, num_rows * sizeof(CsvRow *));
+            size_t n = dedup_rows(plan, plan_rows, num_rows, dedup, memory_budget);
+            sort_rows(plan, plan_rows, n);
+            n = filter_rows(v, plan_rows, n);
+            if (n > 0) {
+                mismatched += verify_rows(v, plan_rows, n);
+            }
+        } else {
+            sb_appendf(&skipped, "%s%s", skipped.len ? ", " : "", specs[i]->table);
+        }
+
+        verify_plan_free(v);
+        load_plan_free(plan);
+    }
+
+    load_exec("COMMIT");
+    free(plan_rows);
+    csvparser_free(parser);
+
+    if (skipped.len > 0) {
+        LOG_ERROR("%s was not verified against %s", filename, skipped.data);
+    }
+    if (mismatched > 0) {
+        LOG_FATAL("%s does not match the database", filename);
+    }
+    if (skipped.len > 0) {
+        LOG_FATAL("%s was only partly verified", filename);
+    }
+    sb_free(&skipped);
+}